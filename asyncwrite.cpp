@@ -0,0 +1,522 @@
+// Asynchronous whole-file writer used by savepng's batch mode.
+//
+// io_uring backend: each file becomes one linked chain of submissions, openat into a registered (direct)
+// file slot, one or more writes through that slot and a close of the slot, so a file costs no system
+// calls of its own. A background thread moves queued files into free slots, submits whole batches with
+// one io_uring_enter() and reaps completions. The ring is driven with raw system calls; liburing is not
+// needed. Files whose chain fails part way (short write, kernel without direct descriptors) are
+// rewritten synchronously, and direct descriptors are abandoned for the rest of the writer. When the ring
+// itself fails, its outstanding requests are cancelled and reaped before their files are rewritten, as the
+// kernel may still be reading their names and buffers.
+//
+// Thread backend: used on other platforms, or when io_uring is unavailable or disabled (seccomp,
+// io_uring_disabled sysctl). A few background threads write queued files with plain blocking I/O.
+//
+#include "asyncwrite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <errno.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #include <linux/io_uring.h>
+    #endif
+#endif
+
+/* Direct descriptors (openat/close into registered file slots) need 5.19 era headers */
+#if defined(IORING_FILE_INDEX_ALLOC)
+    #include <sys/syscall.h>
+    #include <sys/mman.h>
+    #define ASYNCWRITE_URING (1)
+#else
+    #define ASYNCWRITE_URING (0)
+#endif
+
+/* Threads writing files when io_uring is not used */
+#define FALLBACK_THREADS 4
+
+/* Largest single write submitted; bigger files are written by several linked writes */
+#define URING_WRITE_MAX  (1u << 30)
+
+typedef struct {
+    std::string filename;
+    uint8_t *buf;
+    size_t len;
+#if ASYNCWRITE_URING
+    uint32_t slot;          /* registered file slot */
+    uint32_t pending;       /* completions still to reap */
+    size_t written;
+    bool failed;
+#endif
+} write_job;
+
+struct async_writer {
+    std::mutex lock;
+    std::condition_variable changed;    /* queue, pending count or finishing state changed */
+    std::deque<write_job*> queue;
+    uint32_t max_pending, pending;      /* queued + being written */
+    bool finishing;
+    size_t failures;
+    std::string first_failed;
+    std::vector<std::thread> threads;
+    bool uring;
+#if ASYNCWRITE_URING
+    int ring_fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    std::vector<uint32_t> free_slots;
+    bool no_direct;                     /* kernel rejected openat into a file slot */
+#endif
+};
+
+/* Write a whole file with blocking I/O, returns false on failure */
+static bool write_whole_file(const char *filename, const uint8_t *buf, size_t len)
+{
+#ifndef _WIN32
+    size_t done = 0;
+    bool ok = true;
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) return false;
+
+    while (ok && (done < len)) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n < 0) {
+            if (errno != EINTR) ok = false;
+            continue;
+        }
+        done += n;
+    }
+    return (close(fd) == 0) && ok;
+#else
+    FILE *file = fopen(filename, "wb");
+    bool ok;
+    if (!file) return false;
+    ok = (fwrite(buf, 1, len, file) == len);
+    return (fclose(file) == 0) && ok;
+#endif
+}
+
+/* A file is done: record the outcome, release its buffer and wake blocked submitters */
+static void job_done(async_writer *w, write_job *job, bool ok)
+{
+    free(job->buf);
+
+    std::lock_guard<std::mutex> guard(w->lock);
+    if (!ok) {
+        if (!w->failures) w->first_failed = job->filename;
+        w->failures++;
+    }
+    w->pending--;
+    w->changed.notify_all();
+    delete job;
+}
+
+/* Thread backend worker */
+static void fallback_worker(async_writer *w)
+{
+    for (;;) {
+        write_job *job;
+        {
+            std::unique_lock<std::mutex> guard(w->lock);
+            w->changed.wait(guard, [w]() { return !w->queue.empty() || w->finishing; });
+            if (w->queue.empty()) return;
+            job = w->queue.front();
+            w->queue.pop_front();
+        }
+        job_done(w, job, write_whole_file(job->filename.c_str(), job->buf, job->len));
+    }
+}
+
+#if ASYNCWRITE_URING
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Set up the ring and a table of empty file slots, returns false when io_uring is unavailable */
+static bool uring_init(async_writer *w, uint32_t slots)
+{
+    struct io_uring_params p;
+    std::vector<int> fds(slots, -1);
+    uint8_t *sq, *cq;
+    uint32_t i;
+
+    memset(&p, 0, sizeof(p));
+    w->ring_fd = uring_setup(slots * 4, &p);
+    if (w->ring_fd < 0) return false;
+
+    w->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    w->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (w->cq_len > w->sq_len) w->sq_len = w->cq_len;
+        w->cq_len = w->sq_len;
+    }
+    w->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    w->sq_ptr = mmap(NULL, w->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, w->ring_fd, IORING_OFF_SQ_RING);
+    if (w->sq_ptr == MAP_FAILED) goto fail_ring;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        w->cq_ptr = w->sq_ptr;
+    }
+    else {
+        w->cq_ptr = mmap(NULL, w->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, w->ring_fd, IORING_OFF_CQ_RING);
+        if (w->cq_ptr == MAP_FAILED) goto fail_sq;
+    }
+    w->sqes = (struct io_uring_sqe*)mmap(NULL, w->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, w->ring_fd, IORING_OFF_SQES);
+    if (w->sqes == MAP_FAILED) goto fail_cq;
+
+    sq = (uint8_t*)w->sq_ptr;
+    cq = (uint8_t*)w->cq_ptr;
+    w->sq_head = (unsigned*)(sq + p.sq_off.head);
+    w->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    w->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    w->sq_array = (unsigned*)(sq + p.sq_off.array);
+    w->sq_entries = p.sq_entries;
+    w->cq_head = (unsigned*)(cq + p.cq_off.head);
+    w->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    w->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    w->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    /* Sparse table of direct descriptors, one per file in flight */
+    if (uring_register(w->ring_fd, IORING_REGISTER_FILES, fds.data(), slots) < 0)
+        goto fail_sqes;
+    for (i = 0; i < slots; i++)
+        w->free_slots.push_back(slots - 1 - i);
+    return true;
+
+fail_sqes:
+    munmap(w->sqes, w->sqes_len);
+fail_cq:
+    if (w->cq_ptr != w->sq_ptr) munmap(w->cq_ptr, w->cq_len);
+fail_sq:
+    munmap(w->sq_ptr, w->sq_len);
+fail_ring:
+    close(w->ring_fd);
+    return false;
+}
+
+static void uring_free(async_writer *w)
+{
+    munmap(w->sqes, w->sqes_len);
+    if (w->cq_ptr != w->sq_ptr) munmap(w->cq_ptr, w->cq_len);
+    munmap(w->sq_ptr, w->sq_len);
+    close(w->ring_fd);
+}
+
+/* Next free submission entry; the caller checked there is room */
+static struct io_uring_sqe* uring_get_sqe(async_writer *w, unsigned &tail)
+{
+    unsigned idx = tail & *w->sq_mask;
+    struct io_uring_sqe *sqe = &w->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    w->sq_array[idx] = idx;
+    tail++;
+    return sqe;
+}
+
+/* Completions carry the job pointer with the operation in the low bits */
+enum { OP_OPEN = 0, OP_WRITE = 1, OP_CLOSE = 2 };
+
+/* Queue the open/write.../close chain of a file */
+static void uring_queue_job(async_writer *w, write_job *job, unsigned &tail)
+{
+    struct io_uring_sqe *sqe;
+    size_t ofs;
+
+    sqe = uring_get_sqe(w, tail);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)job->filename.c_str();
+    /* O_CLOEXEC is refused with a file slot; direct descriptors are never in the fd table anyway */
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->len = 0666;
+    sqe->file_index = job->slot + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = (uint64_t)(uintptr_t)job | OP_OPEN;
+    job->pending = 1;
+
+    for (ofs = 0; (ofs < job->len) || (ofs == 0); ofs += URING_WRITE_MAX) {
+        size_t n = (job->len - ofs < URING_WRITE_MAX) ? job->len - ofs : URING_WRITE_MAX;
+        sqe = uring_get_sqe(w, tail);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = (int)job->slot;
+        sqe->addr = (uint64_t)(uintptr_t)(job->buf + ofs);
+        sqe->len = (uint32_t)n;
+        sqe->off = ofs;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+        sqe->user_data = (uint64_t)(uintptr_t)job | OP_WRITE;
+        job->pending++;
+        if (!job->len) break;
+    }
+
+    /* Writes are hard linked, so the close runs even after a failed or short write and the slot is
+     * always released. A failed open cancels the whole chain and leaves the slot empty. */
+    sqe = uring_get_sqe(w, tail);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = job->slot + 1;
+    sqe->user_data = (uint64_t)(uintptr_t)job | OP_CLOSE;
+    job->pending++;
+}
+
+/* Number of submission entries the chain of a file takes */
+static unsigned uring_job_sqes(const write_job *job)
+{
+    return 2 + (job->len ? (unsigned)((job->len + URING_WRITE_MAX - 1) / URING_WRITE_MAX) : 1);
+}
+
+/* Reap completions. Files whose chain has completed leave in_flight; failed ones are added to retry. */
+static void uring_reap(async_writer *w, std::vector<write_job*> &in_flight, std::vector<write_job*> &retry)
+{
+    unsigned head = *w->cq_head;
+    size_t i;
+
+    while (head != __atomic_load_n(w->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &w->cqes[head & *w->cq_mask];
+        write_job *job = (write_job*)(uintptr_t)(cqe->user_data & ~(uint64_t)3);
+        unsigned op = (unsigned)(cqe->user_data & 3);
+        head++;
+
+        /* The cancel request of uring_quiesce() */
+        if (!job)
+            continue;
+
+        if ((cqe->res < 0) && (op != OP_CLOSE)) {
+            job->failed = true;
+            if ((op == OP_OPEN) && (cqe->res == -EINVAL))
+                w->no_direct = true;
+        }
+        else if (op == OP_WRITE) {
+            job->written += cqe->res;
+        }
+
+        /* Short writes show up once the whole chain is reaped */
+        if ((job->pending == 1) && (job->written != job->len))
+            job->failed = true;
+
+        if (--job->pending == 0) {
+            i = 0;
+            while (in_flight[i] != job) i++;
+            in_flight[i] = in_flight.back();
+            in_flight.pop_back();
+            {
+                std::lock_guard<std::mutex> guard(w->lock);
+                w->free_slots.push_back(job->slot);
+            }
+            if (job->failed)
+                retry.push_back(job);
+            else
+                job_done(w, job, true);
+        }
+    }
+    __atomic_store_n(w->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Bring a failed ring to rest. In-flight requests still point at their job's file name and buffer, so the
+ * entries the kernel has not consumed are taken back, the consumed ones are cancelled and every one of them
+ * is reaped before the files are handed to retry for a blocking rewrite. */
+static void uring_quiesce(async_writer *w, std::vector<write_job*> &in_flight, std::vector<write_job*> &retry)
+{
+    unsigned head = __atomic_load_n(w->sq_head, __ATOMIC_ACQUIRE), tail = *w->sq_tail;
+    size_t i;
+
+    /* Unconsumed entries never complete; nothing enters the ring while they are taken back */
+    while (tail != head) {
+        struct io_uring_sqe *sqe = &w->sqes[w->sq_array[--tail & *w->sq_mask]];
+        ((write_job*)(uintptr_t)(sqe->user_data & ~(uint64_t)3))->pending--;
+    }
+    __atomic_store_n(w->sq_tail, tail, __ATOMIC_RELEASE);
+
+    /* Whatever becomes of their chains, the files still in flight are rewritten */
+    for (i = 0; i < in_flight.size(); ) {
+        write_job *job = in_flight[i];
+        job->failed = true;
+        if (job->pending) {
+            i++;
+            continue;
+        }
+        in_flight[i] = in_flight.back();
+        in_flight.pop_back();
+        retry.push_back(job);
+    }
+    if (in_flight.empty())
+        return;
+
+    /* Cancel everything still running; if the ring refuses, the requests are waited out instead */
+    {
+        struct io_uring_sqe *sqe = uring_get_sqe(w, tail);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        sqe->user_data = 0;
+        __atomic_store_n(w->sq_tail, tail, __ATOMIC_RELEASE);
+        uring_enter(w->ring_fd, 1, 0, 0);
+        __atomic_store_n(w->sq_tail, __atomic_load_n(w->sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    }
+
+    /* A ring that cannot even wait for completions is polled; completions are still posted to it */
+    while (!in_flight.empty()) {
+        if ((uring_enter(w->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY))
+            usleep(1000);
+        uring_reap(w, in_flight, retry);
+    }
+}
+
+/* io_uring backend: move queued files into free slots, submit, reap */
+static void uring_worker(async_writer *w)
+{
+    std::vector<write_job*> in_flight, retry;
+    bool ring_failed = false;
+    size_t i;
+
+    for (;;) {
+        unsigned tail = *w->sq_tail, to_submit;
+
+        {
+            std::unique_lock<std::mutex> guard(w->lock);
+            if (in_flight.empty())
+                w->changed.wait(guard, [w]() { return !w->queue.empty() || w->finishing; });
+            if (in_flight.empty() && ((w->queue.empty() && w->finishing) || w->no_direct))
+                break;
+
+            while (!w->no_direct && !w->queue.empty() && !w->free_slots.empty() &&
+                   (tail + uring_job_sqes(w->queue.front()) - __atomic_load_n(w->sq_head, __ATOMIC_ACQUIRE) <= w->sq_entries)) {
+                write_job *job = w->queue.front();
+                w->queue.pop_front();
+                job->slot = w->free_slots.back();
+                w->free_slots.pop_back();
+                job->failed = false;
+                job->written = 0;
+                uring_queue_job(w, job, tail);
+                in_flight.push_back(job);
+            }
+        }
+
+        /* Publish the new entries and submit every entry the kernel has not consumed yet, which includes
+         * any left over by an earlier partial submission; wait for at least one completion */
+        __atomic_store_n(w->sq_tail, tail, __ATOMIC_RELEASE);
+        to_submit = tail - __atomic_load_n(w->sq_head, __ATOMIC_ACQUIRE);
+        if ((uring_enter(w->ring_fd, to_submit, in_flight.empty() ? 0 : 1, IORING_ENTER_GETEVENTS) < 0) &&
+            (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY))
+            ring_failed = true;
+
+        uring_reap(w, in_flight, retry);
+
+        /* The ring failed: wait out the requests it still holds before their files are rewritten */
+        if (ring_failed)
+            uring_quiesce(w, in_flight, retry);
+
+        /* Failed chains are rewritten with blocking I/O, which also reports genuine errors */
+        for (i = 0; i < retry.size(); i++)
+            job_done(w, retry[i], write_whole_file(retry[i]->filename.c_str(), retry[i]->buf, retry[i]->len));
+        retry.clear();
+
+        if (ring_failed)
+            break;
+    }
+
+    /* The ring failed or has no direct descriptors; anything left is written with blocking I/O */
+    for (;;) {
+        write_job *job;
+        {
+            std::unique_lock<std::mutex> guard(w->lock);
+            w->changed.wait(guard, [w]() { return !w->queue.empty() || w->finishing; });
+            if (w->queue.empty()) return;
+            job = w->queue.front();
+            w->queue.pop_front();
+        }
+        job_done(w, job, write_whole_file(job->filename.c_str(), job->buf, job->len));
+    }
+}
+#endif
+
+async_writer* async_writer_create(uint32_t max_pending)
+{
+    async_writer *w = new async_writer;
+    uint32_t i;
+
+    w->max_pending = max_pending ? max_pending : 1;
+    w->pending = 0;
+    w->finishing = false;
+    w->failures = 0;
+    w->uring = false;
+
+#if ASYNCWRITE_URING
+    w->no_direct = false;
+    if (uring_init(w, w->max_pending)) {
+        w->uring = true;
+        w->threads.push_back(std::thread(uring_worker, w));
+        return w;
+    }
+#endif
+
+    for (i = 0; i < FALLBACK_THREADS; i++)
+        w->threads.push_back(std::thread(fallback_worker, w));
+    return w;
+}
+
+void async_writer_submit(async_writer *w, const char *filename, uint8_t *buf, size_t len)
+{
+    write_job *job = new write_job;
+    job->filename = filename;
+    job->buf = buf;
+    job->len = len;
+
+    std::unique_lock<std::mutex> guard(w->lock);
+    w->changed.wait(guard, [w]() { return w->pending < w->max_pending; });
+    w->pending++;
+    w->queue.push_back(job);
+    w->changed.notify_all();
+}
+
+size_t async_writer_finish(async_writer *w, std::string *first_failed)
+{
+    size_t failures, i;
+
+    {
+        std::lock_guard<std::mutex> guard(w->lock);
+        w->finishing = true;
+        w->changed.notify_all();
+    }
+    for (i = 0; i < w->threads.size(); i++)
+        w->threads[i].join();
+
+#if ASYNCWRITE_URING
+    if (w->uring) uring_free(w);
+#endif
+
+    failures = w->failures;
+    if (first_failed) *first_failed = w->first_failed;
+    delete w;
+    return failures;
+}
+
+bool async_writer_uses_uring(const async_writer *w)
+{
+    return w->uring;
+}
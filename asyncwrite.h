@@ -0,0 +1,25 @@
+// Asynchronous whole-file writer used by savepng's batch mode.
+// Files are opened, written and closed by io_uring on Linux when the kernel supports it (submitted in
+// batches and reaped on a background thread), otherwise by a small pool of background threads.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+typedef struct async_writer async_writer;
+
+/* Create a writer. At most max_pending files are queued or being written at any time; further submits
+ * block until one completes, which bounds the memory held by encoded files waiting for the disk. */
+async_writer* async_writer_create(uint32_t max_pending);
+
+/* Queue buf (len bytes, allocated with malloc()) to be written to filename, replacing any existing file.
+ * The writer takes ownership of buf and frees it once written. Safe to call from several threads. */
+void async_writer_submit(async_writer *w, const char *filename, uint8_t *buf, size_t len);
+
+/* Wait for all queued files and release the writer. Returns the number of files that could not be
+ * written; the name of the first one goes to *first_failed (if not NULL). */
+size_t async_writer_finish(async_writer *w, std::string *first_failed);
+
+/* True when files are written through io_uring rather than the thread pool */
+bool async_writer_uses_uring(const async_writer *w);
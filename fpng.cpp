@@ -1579,6 +1579,168 @@ do_literals:
 		return dst_ofs;
 	}
 
+	// Distance codes of the pixel sizes handled by pixel_deflate_dyn_n_rle(), which may need one extra bit
+	static const uint8_t g_defl_small_dist_extra[9] = { 0, 0, 0, 0, 0, 1, 1, 1, 1 };
+	static const uint8_t g_defl_small_dist_base[9] = { 0, 1, 2, 3, 4, 5, 5, 7, 7 };
+
+	// Variant for any pixel size of 1 to 8 bytes: grayscale, grayscale+alpha and 16-bit images. Runs of identical
+	// pixels become matches at a distance of one pixel, everything else is coded as literals with a Huffman table
+	// computed for the image. There are no pre-trained tables for these formats, so this is used both with and
+	// without FPNG_ENCODE_SLOWER. The image is scanned twice, first for symbol frequencies and then to code it.
+	template<uint32_t bpp>
+	static uint32_t pixel_deflate_dyn_n_rle(
+		const uint8_t* pImg, uint32_t w, uint32_t h,
+		uint8_t* pDst, uint32_t dst_buf_size)
+	{
+		const uint32_t bpl = 1 + w * bpp;
+		const uint32_t max_run = DEFL_MAX_MATCH_LEN - (DEFL_MAX_MATCH_LEN % bpp);
+		const uint32_t dist_extra_bits = g_defl_small_dist_extra[bpp];
+		const uint32_t dist_extra = bpp - g_defl_small_dist_base[bpp];
+
+		uint64_t bit_buf = 0;
+		int bit_buf_size = 0;
+
+		uint32_t dst_ofs = 0;
+
+		// zlib header
+		PUT_BITS(0x78, 8);
+		PUT_BITS(0x01, 8);
+
+		// write BFINAL bit
+		PUT_BITS(1, 1);
+
+		uint32_t lit_freq[DEFL_MAX_HUFF_SYMBOLS_0];
+		memset(lit_freq, 0, sizeof(lit_freq));
+
+		uint32_t src_adler32 = fpng_adler32(pImg, bpl * h, FPNG_ADLER32_INIT);
+
+		const uint32_t dist_sym = g_defl_small_dist_sym[bpp - 1];
+
+		defl_huff dh;
+
+		for (uint32_t pass = 0; pass < 2; pass++)
+		{
+			if (pass)
+			{
+				lit_freq[256] = 1;
+
+				adjust_freq32(DEFL_MAX_HUFF_SYMBOLS_0, lit_freq, &dh.m_huff_count[0][0]);
+
+				memset(&dh.m_huff_count[1][0], 0, sizeof(dh.m_huff_count[1][0]) * DEFL_MAX_HUFF_SYMBOLS_1);
+				dh.m_huff_count[1][dist_sym] = 1;
+				dh.m_huff_count[1][dist_sym + 1] = 1; // to workaround a bug in wuffs decoder
+
+				if (!defl_start_dynamic_block(&dh, pDst, dst_ofs, dst_buf_size, bit_buf, bit_buf_size))
+					return 0;
+
+				assert(bit_buf_size <= 7);
+				assert(dh.m_huff_codes[1][dist_sym] == 0 && dh.m_huff_code_sizes[1][dist_sym] == 1);
+			}
+
+			const uint8_t* pSrc = pImg;
+
+			for (uint32_t y = 0; y < h; y++, pSrc += bpl)
+			{
+				const uint32_t filter_lit = pSrc[0];
+				if (pass)
+				{
+					PUT_BITS_CZ(dh.m_huff_codes[0][filter_lit], dh.m_huff_code_sizes[0][filter_lit]);
+					PUT_BITS_FLUSH;
+				}
+				else
+					lit_freq[filter_lit]++;
+
+				uint32_t src_ofs = 1;
+
+				while (src_ofs < bpl)
+				{
+					// Run of pixels equal to the previous one (never the first pixel of a scanline)
+					uint32_t match_len = 0;
+					if (src_ofs > 1)
+					{
+						uint32_t max_match_len = minimum<uint32_t>(max_run, bpl - src_ofs);
+						while ((match_len < max_match_len) && (memcmp(pSrc + src_ofs + match_len, pSrc + src_ofs + match_len - bpp, bpp) == 0))
+							match_len += bpp;
+					}
+
+					// Deflate matches are at least 3 bytes long
+					if (match_len >= 3)
+					{
+						uint32_t adj_match_len = match_len - 3;
+						if (pass)
+						{
+							PUT_BITS_CZ(dh.m_huff_codes[0][g_defl_len_sym[adj_match_len]], dh.m_huff_code_sizes[0][g_defl_len_sym[adj_match_len]]);
+							PUT_BITS(adj_match_len & g_bitmasks[g_defl_len_extra[adj_match_len]], g_defl_len_extra[adj_match_len] + 1); // up to 6 bits, +1 for the match distance Huff code which is always 0
+							if (dist_extra_bits)
+								PUT_BITS(dist_extra, dist_extra_bits);
+						}
+						else
+							lit_freq[g_defl_len_sym[adj_match_len]]++;
+
+						src_ofs += match_len;
+					}
+					else
+					{
+						for (uint32_t i = 0; i < bpp; i++)
+						{
+							uint32_t lit = pSrc[src_ofs + i];
+							if (pass)
+								PUT_BITS_CZ(dh.m_huff_codes[0][lit], dh.m_huff_code_sizes[0][lit]);
+							else
+								lit_freq[lit]++;
+
+							if ((i & 3) == 3)
+							{
+								if (pass)
+									PUT_BITS_FLUSH;
+							}
+						}
+
+						src_ofs += bpp;
+					}
+
+					// up to 55 bits
+					if (pass)
+						PUT_BITS_FLUSH;
+				} // while (src_ofs < bpl)
+
+			} // y
+		} // pass
+
+		PUT_BITS_CZ(dh.m_huff_codes[0][256], dh.m_huff_code_sizes[0][256]);
+
+		PUT_BITS_FORCE_FLUSH;
+
+		// Write zlib adler32
+		for (uint32_t i = 0; i < 4; i++)
+		{
+			if ((dst_ofs + 1) > dst_buf_size)
+				return 0;
+			*(uint8_t*)(pDst + dst_ofs) = (uint8_t)(src_adler32 >> 24);
+			dst_ofs++;
+
+			src_adler32 <<= 8;
+		}
+
+		return dst_ofs;
+	}
+
+	static uint32_t pixel_deflate_dyn_n_rle(
+		const uint8_t* pImg, uint32_t w, uint32_t h, uint32_t bpp,
+		uint8_t* pDst, uint32_t dst_buf_size)
+	{
+		switch (bpp)
+		{
+		case 1: return pixel_deflate_dyn_n_rle<1>(pImg, w, h, pDst, dst_buf_size);
+		case 2: return pixel_deflate_dyn_n_rle<2>(pImg, w, h, pDst, dst_buf_size);
+		case 4: return pixel_deflate_dyn_n_rle<4>(pImg, w, h, pDst, dst_buf_size);
+		case 6: return pixel_deflate_dyn_n_rle<6>(pImg, w, h, pDst, dst_buf_size);
+		case 8: return pixel_deflate_dyn_n_rle<8>(pImg, w, h, pDst, dst_buf_size);
+		}
+		assert(0);
+		return 0;
+	}
+
 	static void vector_append(std::vector<uint8_t>& buf, const void* pData, size_t len)
 	{
 		if (len)
@@ -1635,7 +1797,7 @@ do_literals:
 						pDst += 3;
 					}
 				}
-				else
+				else if (num_chans == 4)
 				{
 					for (uint32_t x = 0; x < (uint32_t)w; x++)
 					{
@@ -1649,6 +1811,11 @@ do_literals:
 						pDst += 4;
 					}
 				}
+				else
+				{
+					for (uint32_t i = 0; i < w * num_chans; i++)
+						pDst[i] = (uint8_t)(pSrc[i] - pPrev_src[i]);
+				}
 			}
 
 			break;
@@ -1673,13 +1840,21 @@ do_literals:
 			return false;
 		}
 
-		if ((num_chans != 3) && (num_chans != 4))
+		if ((num_chans < 1) || (num_chans > 4))
 		{
 			assert(0);
 			return false;
 		}
 
-		int i, bpl = w * num_chans;
+		// 16-bit samples are filtered and coded as pixels of twice the size
+		const uint32_t bit_depth = (flags & FPNG_SAMPLES_16BIT) ? 16 : 8;
+		const uint32_t bpp = num_chans * (bit_depth / 8);
+
+		// Offsets below are 32-bit and the output is a single IDAT chunk, limited to 2^31-1 bytes
+		if (((uint64_t)w * bpp + 1) * h > FPNG_MAX_RAW_SIZE)
+			return false;
+
+		int i, bpl = w * bpp;
 		uint32_t y;
 
 		std::vector<uint8_t> temp_buf;
@@ -1693,7 +1868,7 @@ do_literals:
 
 			uint8_t* pDst = &temp_buf[temp_buf_ofs];
 
-			apply_filter(y ? 2 : 0, w, h, num_chans, bpl, pSrc, pPrev_src, pDst);
+			apply_filter(y ? 2 : 0, w, h, bpp, bpl, pSrc, pPrev_src, pDst);
 
 			temp_buf_ofs += 1 + bpl;
 		}
@@ -1707,7 +1882,9 @@ do_literals:
 		uint32_t defl_size = 0;
 		if ((flags & FPNG_FORCE_UNCOMPRESSED) == 0)
 		{
-			if (num_chans == 3)
+			if ((num_chans <= 2) || (bit_depth == 16))
+				defl_size = pixel_deflate_dyn_n_rle(temp_buf.data(), w, h, bpp, &out_buf[out_ofs], (uint32_t)out_buf.size() - out_ofs);
+			else if (num_chans == 3)
 			{
 				if (flags & FPNG_ENCODE_SLOWER)
 					defl_size = pixel_deflate_dyn_3_rle(temp_buf.data(), w, h, &out_buf[out_ofs], (uint32_t)out_buf.size() - out_ofs);
@@ -1737,7 +1914,7 @@ do_literals:
 
 				uint8_t* pDst = &temp_buf[temp_buf_ofs];
 
-				apply_filter(0, w, h, num_chans, bpl, pSrc, nullptr, pDst);
+				apply_filter(0, w, h, bpp, bpl, pSrc, nullptr, pDst);
 
 				temp_buf_ofs += 1 + bpl;
 			}
@@ -1770,9 +1947,9 @@ do_literals:
 			uint8_t pnghdr[58] = { 
 				0x89,0x50,0x4e,0x47,0x0d,0x0a,0x1a,0x0a,   // PNG sig
 				0x00,0x00,0x00,0x0d, 'I','H','D','R',  // IHDR chunk len, type
-			    0,0,(uint8_t)(w >> 8),(uint8_t)w, // width
-				0,0,(uint8_t)(h >> 8),(uint8_t)h, // height
-				8,   //bit_depth
+			    (uint8_t)(w >> 24),(uint8_t)(w >> 16),(uint8_t)(w >> 8),(uint8_t)w, // width
+				(uint8_t)(h >> 24),(uint8_t)(h >> 16),(uint8_t)(h >> 8),(uint8_t)h, // height
+				(uint8_t)bit_depth,   //bit_depth
 				s_color_type[num_chans], // color_type
 				0, // compression
 				0, // filter
@@ -2109,8 +2286,7 @@ do_literals:
 		uint8_t* pDst, uint32_t w, uint32_t h,
 		uint32_t src_chans, uint32_t dst_chans)
 	{
-		assert((src_chans == 3) || (src_chans == 4));
-		assert((dst_chans == 3) || (dst_chans == 4));
+		assert(((src_chans >= 3) && (dst_chans >= 3)) || (src_chans == dst_chans));
 		
 		const uint32_t src_bpl = w * src_chans;
 		const uint32_t dst_bpl = w * dst_chans;
@@ -2900,6 +3076,193 @@ do_literals:
 		return true;
 	}
 
+	// Grayscale (1) and grayscale+alpha (2) channel streams from pixel_deflate_dyn_n_rle(). No channel conversion.
+	template<uint32_t num_chans>
+	static bool fpng_pixel_zlib_decompress_12(
+		const uint8_t* pSrc, uint32_t src_len, uint32_t zlib_len,
+		uint8_t* pDst, uint32_t w, uint32_t h)
+	{
+		assert(src_len >= (zlib_len + 4));
+
+		const uint32_t dst_bpl = w * num_chans;
+
+		if (zlib_len < 7)
+			return false;
+
+		// check zlib header
+		if ((pSrc[0] != 0x78) || (pSrc[1] != 0x01))
+			return false;
+
+		uint32_t src_ofs = 2;
+
+		if ((pSrc[src_ofs] & 6) == 0)
+			return fpng_pixel_zlib_raw_decompress(pSrc, src_len, zlib_len, pDst, w, h, num_chans, num_chans);
+
+		if ((src_ofs + 4) > src_len)
+			return false;
+		uint64_t bit_buf = READ_LE32(pSrc + src_ofs);
+		src_ofs += 4;
+
+		uint32_t bit_buf_size = 32;
+
+		uint32_t bfinal, btype;
+		GET_BITS(bfinal, 1);
+		GET_BITS(btype, 2);
+
+		// Must be the final block or it's not valid, and type=2 (dynamic)
+		if ((bfinal != 1) || (btype != 2))
+			return false;
+
+		uint32_t lit_table[FPNG_DECODER_TABLE_SIZE];
+		if (!prepare_dynamic_block(pSrc, src_len, src_ofs, bit_buf_size, bit_buf, lit_table, num_chans))
+			return false;
+
+		const uint8_t* pPrev_scanline = nullptr;
+		uint8_t* pCur_scanline = pDst;
+
+		for (uint32_t y = 0; y < h; y++)
+		{
+			// At start of PNG scanline, so read the filter literal
+			assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+			uint32_t filter = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+			uint32_t filter_len = (filter >> 9) & 15;
+			if (!filter_len)
+				return false;
+			SKIP_BITS(filter_len);
+			filter &= 511;
+
+			uint32_t expected_filter = (y ? 2 : 0);
+			if (filter != expected_filter)
+				return false;
+
+			uint32_t x_ofs = 0;
+			uint8_t prev_delta[2] = { 0, 0 };
+			do
+			{
+				assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+				uint32_t lit0 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+				uint32_t lit0_len = (lit0 >> 9) & 15;
+				if (!lit0_len)
+					return false;
+				SKIP_BITS(lit0_len);
+				lit0 &= 511;
+
+				if (lit0 & 256)
+				{
+					// Can't be EOB - we still have more pixels to decompress.
+					if (lit0 == 256)
+						return false;
+
+					// Must be an RLE match against the previous pixel.
+					uint32_t run_len = s_length_range[lit0 - 257];
+					// Runs go up to 258 bytes here, so code 285 (no extra bits) can appear
+					if ((lit0 >= 265) && (lit0 < 285))
+					{
+						uint32_t e;
+						GET_BITS_NE(e, s_length_extra[lit0 - 257]);
+
+						run_len += e;
+					}
+
+					// Skip match distance - it's always the same (num_chans)
+					SKIP_BITS_NE(1);
+
+					// Matches must be whole pixels, cannot cross scanlines or precede the first pixel
+					const uint32_t x_ofs_end = x_ofs + run_len;
+					if ((run_len % num_chans) || (x_ofs_end > dst_bpl) || !x_ofs)
+						return false;
+
+					if (pPrev_scanline)
+					{
+						for (; x_ofs < x_ofs_end; x_ofs += num_chans)
+						{
+							pCur_scanline[x_ofs] = (uint8_t)(pPrev_scanline[x_ofs] + prev_delta[0]);
+							if (num_chans == 2)
+								pCur_scanline[x_ofs + 1] = (uint8_t)(pPrev_scanline[x_ofs + 1] + prev_delta[1]);
+						}
+					}
+					else
+					{
+						for (; x_ofs < x_ofs_end; x_ofs += num_chans)
+						{
+							pCur_scanline[x_ofs] = prev_delta[0];
+							if (num_chans == 2)
+								pCur_scanline[x_ofs + 1] = prev_delta[1];
+						}
+					}
+				}
+				else
+				{
+					uint32_t lit1 = 0;
+
+					if (num_chans == 2)
+					{
+						assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+						lit1 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+						uint32_t lit1_len = (lit1 >> 9) & 15;
+						if (!lit1_len)
+							return false;
+						SKIP_BITS(lit1_len);
+						lit1 &= 511;
+
+						// Check for matches
+						if (lit1 & 256)
+							return false;
+					}
+
+					if (pPrev_scanline)
+					{
+						pCur_scanline[x_ofs] = (uint8_t)(pPrev_scanline[x_ofs] + lit0);
+						if (num_chans == 2)
+							pCur_scanline[x_ofs + 1] = (uint8_t)(pPrev_scanline[x_ofs + 1] + lit1);
+					}
+					else
+					{
+						pCur_scanline[x_ofs] = (uint8_t)lit0;
+						if (num_chans == 2)
+							pCur_scanline[x_ofs + 1] = (uint8_t)lit1;
+					}
+
+					x_ofs += num_chans;
+
+					prev_delta[0] = (uint8_t)lit0;
+					prev_delta[1] = (uint8_t)lit1;
+				}
+
+			} while (x_ofs < dst_bpl);
+
+			pPrev_scanline = pCur_scanline;
+			pCur_scanline += dst_bpl;
+		} // y
+
+		// The last symbol should be EOB
+		assert(bit_buf_size >= FPNG_DECODER_TABLE_BITS);
+		uint32_t lit0 = lit_table[bit_buf & (FPNG_DECODER_TABLE_SIZE - 1)];
+		uint32_t lit0_len = (lit0 >> 9) & 15;
+		if (!lit0_len)
+			return false;
+		lit0 &= 511;
+		if (lit0 != 256)
+			return false;
+
+		bit_buf_size -= lit0_len;
+		bit_buf >>= lit0_len;
+
+		uint32_t align_bits = bit_buf_size & 7;
+		bit_buf_size -= align_bits;
+		bit_buf >>= align_bits;
+
+		if (src_ofs < (bit_buf_size >> 3))
+			return false;
+		src_ofs -= (bit_buf_size >> 3);
+
+		// We should be at the very end, because the bit buf reads ahead 32-bits (which contains the zlib adler32).
+		if ((src_ofs + 4) != zlib_len)
+			return false;
+
+		return true;
+	}
+
 #pragma pack(push)
 #pragma pack(1)
 	struct png_chunk_prefix
@@ -2973,7 +3336,11 @@ do_literals:
 		if ((ihdr.m_comp_method) || (ihdr.m_filter_method) || (ihdr.m_interlace_method) || (ihdr.m_bitdepth != 8))
 			return FPNG_DECODE_NOT_FPNG;
 
-		if (ihdr.m_color_type == 2)
+		if (ihdr.m_color_type == 0)
+			channels_in_file = 1;
+		else if (ihdr.m_color_type == 4)
+			channels_in_file = 2;
+		else if (ihdr.m_color_type == 2)
 			channels_in_file = 3;
 		else if (ihdr.m_color_type == 6)
 			channels_in_file = 4;
@@ -3089,7 +3456,7 @@ do_literals:
 		height = 0;
 		channels_in_file = 0;
 
-		if ((!pImage) || (!image_size) || ((desired_channels != 3) && (desired_channels != 4)))
+		if ((!pImage) || (!image_size) || (desired_channels < 1) || (desired_channels > 4))
 		{
 			assert(0);
 			return FPNG_DECODE_INVALID_ARG;
@@ -3099,6 +3466,10 @@ do_literals:
 		int status = fpng_get_info_internal(pImage, image_size, width, height, channels_in_file, idat_ofs, idat_len);
 		if (status)
 			return status;
+
+		// Grayscale files are only decoded as they are, 24/32bpp files only to 24/32bpp
+		if (((channels_in_file <= 2) || (desired_channels <= 2)) && (desired_channels != channels_in_file))
+			return FPNG_DECODE_INVALID_ARG;
 				
 		const uint64_t mem_needed = (uint64_t)width * height * desired_channels;
 		if (mem_needed > UINT32_MAX)
@@ -3114,7 +3485,11 @@ do_literals:
 		const uint32_t src_len = image_size - (idat_ofs + sizeof(uint32_t) * 2);
 
 		bool decomp_status;
-		if (desired_channels == 3)
+		if (desired_channels == 1)
+			decomp_status = fpng_pixel_zlib_decompress_12<1>(pIDAT_data, src_len, idat_len, out.data(), width, height);
+		else if (desired_channels == 2)
+			decomp_status = fpng_pixel_zlib_decompress_12<2>(pIDAT_data, src_len, idat_len, out.data(), width, height);
+		else if (desired_channels == 3)
 		{
 			if (channels_in_file == 3)
 				decomp_status = fpng_pixel_zlib_decompress_3<3>(pIDAT_data, src_len, idat_len, out.data(), width, height);
@@ -39,12 +39,17 @@ namespace fpng
 		
 		// Only use raw Deflate blocks (no compression at all). Intended for testing.
 		FPNG_FORCE_UNCOMPRESSED = 2,
+
+		// pImage holds 16-bit samples, most significant byte first (PNG byte order). Always gets a per-image Huffman table.
+		FPNG_SAMPLES_16BIT = 4,
 	};
 
 	// Fast PNG encoding. The resulting file can be decoded either using a standard PNG decoder or by the fpng_decode_memory() function below.
 	// pImage: pointer to RGB or RGBA image pixels, R first in memory, B/A last.
-	// w/h - image dimensions. Image's row pitch in bytes must is w*num_chans.
-	// num_chans must be 3 or 4. 
+	// w/h - image dimensions. Image's row pitch in bytes must is w*num_chans (w*num_chans*2 with FPNG_SAMPLES_16BIT).
+	// num_chans must be 1 to 4 (grayscale, grayscale+alpha, RGB, RGBA). 1 and 2 channel images always get a per-image Huffman table.
+	// The filtered image, h*(1+row pitch) bytes, may be at most FPNG_MAX_RAW_SIZE: offsets are 32-bit and the output is a single IDAT chunk.
+	const uint64_t FPNG_MAX_RAW_SIZE = 0x7F000000;
 	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, uint32_t flags = 0);
 
 #ifndef FPNG_NO_STDIO
@@ -90,14 +95,14 @@ namespace fpng
 	// If another error occurs, the file is likely corrupted or invalid, but you can still try to decompress the file with another decoder (which will likely fail).
 	int fpng_get_info(const void* pImage, uint32_t image_size, uint32_t& width, uint32_t& height, uint32_t& channels_in_file);
 
-	// fpng_decode_memory() decompresses 24/32bpp PNG files ONLY encoded by this module.
+	// fpng_decode_memory() decompresses 8/16/24/32bpp PNG files ONLY encoded by this module.
 	// If the image was written by FPNG, it will decompress the image data, otherwise it will return FPNG_DECODE_NOT_FPNG in which case you should fall back to a general purpose PNG decoder (lodepng, stb_image, libpng, etc.)
 	//
 	// pImage, image_size: Pointer to PNG image data and its size
 	// out: Output 24/32bpp image buffer
 	// width, height: output image's dimensions
-	// channels_in_file: will be 3 or 4
-	// desired_channels: must be 3 or 4 
+	// channels_in_file: will be 1 to 4
+	// desired_channels: must be 3 or 4, or equal to channels_in_file for grayscale (1) and grayscale+alpha (2) files
 	// 
 	// If the image is 24bpp and 32bpp is requested, the alpha values will be set to 0xFF. 
 	// If the image is 32bpp and 24bpp is requested, the alpha values will be discarded.
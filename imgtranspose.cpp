@@ -0,0 +1,680 @@
+// Pixel layout conversion between MATLAB column-major planes and PNG row-major
+// interleaved scanlines.
+//
+// The SSE kernels work on blocks of 16 rows by one 16-byte group of pixels (16/8/4/4 pixels for
+// 1/2/3/4 channels). A pshufb gathers each channel's bytes together and a 16x16 byte transpose turns
+// the 16 row vectors into column vectors, which are stored straight into the destination planes.
+// Blocks are walked in vertical strips of TILE_PIXELS columns so the destination cache lines
+// stay resident while consecutive row blocks fill them. The forward direction (MATLAB to PNG) runs the
+// same steps in reverse: 16-byte column loads, the transpose, then a pshufb that interleaves channels.
+// 16-bit samples use 8 row blocks and an 8x8 word transpose, and the pshufb also swaps each sample
+// between big-endian (PNG) and host order. When asked to, the forward kernels also clear fully transparent
+// pixels with a compare and mask on each interleaved vector before it is stored, so the cleaning costs no
+// extra pass. An alpha matrix passed on its own is read as one more plane by the column loads, so it is
+// interleaved without first being copied next to the colour planes; a logical one is negated on load to
+// turn 1 into 255.
+//
+// Crops are gathered a column at a time, with one memcpy per column when rows are not skipped, so their
+// cost follows the number of samples kept rather than the size of the source.
+//
+// Logical planes are packed to 1-bit rows without a byte transpose: the 16 rows of one column are a
+// single load, compared with zero, and ANDed with the column's bit (0x80 >> x%8), so ORing eight such
+// columns leaves in each byte of the register the packed byte of one row. The 16 bytes are then stored
+// to their rows. This walks the same TILE_PIXELS strips as the interleave kernels.
+//
+// The reduction checks compare 64 bytes (or 16 samples) per step and return at the first group that
+// fails, so an image that cannot be reduced costs little more than reading its first few columns.
+//
+// Floating point samples are scaled 16 at a time: max against zero (which also turns NaN into 0, as
+// maxpd returns its second operand when either is NaN), min against one, multiply by 255, add one half
+// and truncate, then two saturating packs narrow the integers to bytes.
+//
+#include "imgtranspose.h"
+#include "fpng.h"
+
+#include <string.h>
+
+#ifndef FPNG_NO_SSE
+    #define FPNG_NO_SSE (0)
+#endif
+
+#if (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)) && !FPNG_NO_SSE
+    #define IMGTRANSPOSE_SSE (1)
+    #include <emmintrin.h>      // SSE2
+    #include <tmmintrin.h>      // SSSE3
+    #include <smmintrin.h>      // SSE4.1
+#else
+    #define IMGTRANSPOSE_SSE (0)
+#endif
+
+#define TILE_PIXELS 64
+
+/* Scalar de-interleave of the pixel rectangle [x0,x1) x [y0,y1) */
+static void deinterleave_block_scalar(const uint8_t *src, uint32_t w, uint32_t h, uint32_t nchan, uint8_t *dst,
+                                      uint32_t x0, uint32_t x1, uint32_t y0, uint32_t y1)
+{
+    size_t plane = (size_t)w*h;
+    uint32_t x, y, c;
+
+    for (x = x0; x < x1; x++) {
+        for (y = y0; y < y1; y++) {
+            const uint8_t *p = src + ((size_t)y*w + x)*nchan;
+            uint8_t *q = dst + (size_t)x*h + y;
+            for (c = 0; c < nchan; c++)
+                q[c*plane] = p[c];
+        }
+    }
+}
+
+/* Scalar 16-bit de-interleave of the pixel rectangle [x0,x1) x [y0,y1), big-endian samples */
+static void deinterleave16_block_scalar(const uint8_t *src, uint32_t w, uint32_t h, uint32_t nchan, uint16_t *dst,
+                                        uint32_t x0, uint32_t x1, uint32_t y0, uint32_t y1)
+{
+    size_t plane = (size_t)w*h;
+    uint32_t x, y, c;
+
+    for (x = x0; x < x1; x++) {
+        for (y = y0; y < y1; y++) {
+            const uint8_t *p = src + ((size_t)y*w + x)*nchan*2;
+            uint16_t *q = dst + (size_t)x*h + y;
+            for (c = 0; c < nchan; c++)
+                q[c*plane] = (uint16_t)((p[2*c] << 8) | p[2*c + 1]);
+        }
+    }
+}
+
+/* Scalar interleave of the pixel rectangle [x0,x1) x [y0,y1), rows relative to row0 in dst. With mask the
+ * last plane holds 0 and 1, written as 0 and 255. */
+static void interleave_block_scalar(const uint8_t *const *planes, uint32_t h, uint32_t nchan, bool mask, uint8_t *dst, size_t dst_stride,
+                                    uint32_t row0, uint32_t x0, uint32_t x1, uint32_t y0, uint32_t y1, bool clear)
+{
+    uint32_t x, y, c;
+
+    for (y = y0; y < y1; y++) {
+        uint8_t *q = dst + (size_t)(y - row0)*dst_stride;
+        for (x = x0; x < x1; x++) {
+            size_t i = (size_t)x*h + y;
+            if (clear && !planes[nchan - 1][i]) {
+                memset(q + (size_t)x*nchan, 0, nchan);
+                continue;
+            }
+            for (c = 0; c < nchan; c++)
+                q[(size_t)x*nchan + c] = planes[c][i];
+            if (mask)
+                q[(size_t)x*nchan + nchan - 1] = (uint8_t)-q[(size_t)x*nchan + nchan - 1];
+        }
+    }
+}
+
+/* Scalar 16-bit interleave of the pixel rectangle [x0,x1) x [y0,y1), big-endian samples */
+static void interleave16_block_scalar(const uint16_t *src, uint32_t w, uint32_t h, uint32_t nchan, uint8_t *dst, size_t dst_stride,
+                                      uint32_t row0, uint32_t x0, uint32_t x1, uint32_t y0, uint32_t y1, bool clear)
+{
+    size_t plane = (size_t)w*h;
+    uint32_t x, y, c;
+
+    for (y = y0; y < y1; y++) {
+        uint8_t *q = dst + (size_t)(y - row0)*dst_stride;
+        for (x = x0; x < x1; x++) {
+            const uint16_t *p = src + (size_t)x*h + y;
+            if (clear && !p[(nchan - 1)*plane]) {
+                memset(q + (size_t)x*nchan*2, 0, nchan*2);
+                continue;
+            }
+            for (c = 0; c < nchan; c++) {
+                uint16_t v = p[c*plane];
+                q[((size_t)x*nchan + c)*2] = (uint8_t)(v >> 8);
+                q[((size_t)x*nchan + c)*2 + 1] = (uint8_t)v;
+            }
+        }
+    }
+}
+
+#if IMGTRANSPOSE_SSE
+/* Transpose 16 rows of 16 bytes. On return m[bitrev4(j)] holds byte column j. */
+static inline void transpose16x16(__m128i *m)
+{
+    __m128i t[16];
+    int i;
+
+    for (i = 0; i < 8; i++) { t[i] = _mm_unpacklo_epi8(m[2*i], m[2*i+1]);  t[i+8] = _mm_unpackhi_epi8(m[2*i], m[2*i+1]); }
+    for (i = 0; i < 8; i++) { m[i] = _mm_unpacklo_epi16(t[2*i], t[2*i+1]); m[i+8] = _mm_unpackhi_epi16(t[2*i], t[2*i+1]); }
+    for (i = 0; i < 8; i++) { t[i] = _mm_unpacklo_epi32(m[2*i], m[2*i+1]); t[i+8] = _mm_unpackhi_epi32(m[2*i], m[2*i+1]); }
+    for (i = 0; i < 8; i++) { m[i] = _mm_unpacklo_epi64(t[2*i], t[2*i+1]); m[i+8] = _mm_unpackhi_epi64(t[2*i], t[2*i+1]); }
+}
+
+static const uint8_t s_bitrev4[16] = { 0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15 };
+
+/* Shuffle masks that group a 16-byte pixel run by channel: byte c*P+p <- byte p*nchan+c */
+static const uint8_t s_group_by_channel[5][16] = {
+    { 0 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15 },
+    { 0, 3, 6, 9, 1, 4, 7, 10, 2, 5, 8, 11, 0x80, 0x80, 0x80, 0x80 },
+    { 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15 },
+};
+
+/* Inverse of s_group_by_channel: byte p*nchan+c <- byte c*P+p */
+static const uint8_t s_interleave_channels[5][16] = {
+    { 0 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 0, 8, 1, 9, 2, 10, 3, 11, 4, 12, 5, 13, 6, 14, 7, 15 },
+    { 0, 4, 8, 1, 5, 9, 2, 6, 10, 3, 7, 11, 0x80, 0x80, 0x80, 0x80 },
+    { 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15 },
+};
+
+/* Transpose 8 rows of 8 words, m[j] holds word column j on return */
+static inline void transpose8x8_epi16(__m128i *m)
+{
+    __m128i t[8];
+    int i;
+
+    for (i = 0; i < 4; i++) { t[i] = _mm_unpacklo_epi16(m[2*i], m[2*i+1]); t[i+4] = _mm_unpackhi_epi16(m[2*i], m[2*i+1]); }
+    m[0] = _mm_unpacklo_epi32(t[0], t[1]); m[1] = _mm_unpackhi_epi32(t[0], t[1]);
+    m[2] = _mm_unpacklo_epi32(t[4], t[5]); m[3] = _mm_unpackhi_epi32(t[4], t[5]);
+    m[4] = _mm_unpacklo_epi32(t[2], t[3]); m[5] = _mm_unpackhi_epi32(t[2], t[3]);
+    m[6] = _mm_unpacklo_epi32(t[6], t[7]); m[7] = _mm_unpackhi_epi32(t[6], t[7]);
+    t[0] = _mm_unpacklo_epi64(m[0], m[4]); t[1] = _mm_unpackhi_epi64(m[0], m[4]);
+    t[2] = _mm_unpacklo_epi64(m[1], m[5]); t[3] = _mm_unpackhi_epi64(m[1], m[5]);
+    t[4] = _mm_unpacklo_epi64(m[2], m[6]); t[5] = _mm_unpackhi_epi64(m[2], m[6]);
+    t[6] = _mm_unpacklo_epi64(m[3], m[7]); t[7] = _mm_unpackhi_epi64(m[3], m[7]);
+    for (i = 0; i < 8; i++) m[i] = t[i];
+}
+
+/* Interleave channels of a run of 16-bit pixels and swap each sample to big-endian:
+ * word p*nchan+c <- word c*P+p, high byte first */
+static const uint8_t s_interleave_channels16[5][16] = {
+    { 0 },
+    { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+    { 1, 0, 9, 8, 3, 2, 11, 10, 5, 4, 13, 12, 7, 6, 15, 14 },
+    { 1, 0, 5, 4, 9, 8, 3, 2, 7, 6, 11, 10, 0x80, 0x80, 0x80, 0x80 },
+    { 1, 0, 5, 4, 9, 8, 13, 12, 3, 2, 7, 6, 11, 10, 15, 14 },
+};
+
+/* Group a run of big-endian 16-bit pixels by channel and swap each sample to host order, the inverse of
+ * s_interleave_channels16: word c*P+p <- word p*nchan+c, low byte first */
+static const uint8_t s_group_by_channel16[5][16] = {
+    { 0 },
+    { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+    { 1, 0, 5, 4, 9, 8, 13, 12, 3, 2, 7, 6, 11, 10, 15, 14 },
+    { 1, 0, 7, 6, 3, 2, 9, 8, 5, 4, 11, 10, 0x80, 0x80, 0x80, 0x80 },
+    { 1, 0, 9, 8, 3, 2, 11, 10, 5, 4, 13, 12, 7, 6, 15, 14 },
+};
+
+/* Zero the pixels of v (psize bytes each) whose alpha bytes, selected by amask, are all zero */
+static inline __m128i clear_transparent_sse(__m128i v, __m128i amask, uint32_t psize)
+{
+    const __m128i a = _mm_and_si128(v, amask), zero = _mm_setzero_si128();
+    __m128i t = (psize == 2) ? _mm_cmpeq_epi16(a, zero) : (psize == 4) ? _mm_cmpeq_epi32(a, zero) : _mm_cmpeq_epi64(a, zero);
+    return _mm_andnot_si128(t, v);
+}
+
+static void interleave16_sse(const uint16_t *src, uint32_t w, uint32_t h, uint32_t nchan, uint32_t row0, uint32_t row1,
+                             uint8_t *dst, size_t dst_stride, bool clear)
+{
+    const __m128i amask = (nchan == 2) ? _mm_set1_epi32((int)0xFFFF0000) : _mm_set1_epi64x((long long)0xFFFF000000000000ull);
+    const uint32_t P = (nchan == 1) ? 8 : (nchan == 2) ? 4 : 2;    /* pixels per vector */
+    const uint32_t E = P*nchan;                                     /* valid words per vector */
+    const __m128i shuf = _mm_loadu_si128((const __m128i*)s_interleave_channels16[nchan]);
+    const size_t plane = (size_t)w*h;
+    const uint32_t y8 = row0 + ((row1 - row0) & ~7u);
+    const uint32_t wv = (w / P) * P;
+    uint32_t xt, x0, y0, r, j;
+    __m128i m[8];
+
+    for (xt = 0; xt < wv; xt += TILE_PIXELS) {
+        uint32_t xe = (xt + TILE_PIXELS < wv) ? xt + TILE_PIXELS : wv;
+
+        for (y0 = row0; y0 < y8; y0 += 8) {
+            uint8_t *d = dst + (size_t)(y0 - row0)*dst_stride;
+
+            for (x0 = xt; x0 < xe; x0 += P) {
+                /* 3 channel stores write 4 bytes past the group, which would run past the end of the row */
+                if ((nchan == 3) && (x0 + P + 1 > w)) {
+                    interleave16_block_scalar(src, w, h, nchan, dst, dst_stride, row0, x0, x0 + P, y0, y0 + 8, false);
+                    continue;
+                }
+
+                for (j = 0; j < E; j++) {
+                    uint32_t c = j / P, p = j % P;
+                    m[j] = _mm_loadu_si128((const __m128i*)(src + c*plane + (size_t)(x0 + p)*h + y0));
+                }
+                for (; j < 8; j++)
+                    m[j] = _mm_setzero_si128();
+
+                transpose8x8_epi16(m);
+
+                for (r = 0; r < 8; r++) {
+                    __m128i v = _mm_shuffle_epi8(m[r], shuf);
+                    if (clear)
+                        v = clear_transparent_sse(v, amask, nchan*2);
+                    _mm_storeu_si128((__m128i*)(d + r*dst_stride + x0*nchan*2), v);
+                }
+            }
+        }
+    }
+
+    /* Leftover columns and rows */
+    if (wv < w)
+        interleave16_block_scalar(src, w, h, nchan, dst, dst_stride, row0, wv, w, row0, y8, clear);
+    if (y8 < row1)
+        interleave16_block_scalar(src, w, h, nchan, dst, dst_stride, row0, 0, w, y8, row1, clear);
+}
+
+static void interleave_sse(const uint8_t *const *planes, uint32_t w, uint32_t h, uint32_t nchan, bool mask, uint32_t row0, uint32_t row1,
+                           uint8_t *dst, size_t dst_stride, bool clear)
+{
+    const __m128i amask = (nchan == 2) ? _mm_set1_epi16((short)0xFF00) : _mm_set1_epi32((int)0xFF000000);
+    const uint32_t P = (nchan == 1) ? 16 : (nchan == 2) ? 8 : 4;  /* pixels per vector */
+    const uint32_t B = P*nchan;                                     /* valid bytes per vector */
+    const __m128i shuf = _mm_loadu_si128((const __m128i*)s_interleave_channels[nchan]);
+    const uint32_t y16 = row0 + ((row1 - row0) & ~15u);
+    const uint32_t wv = (w / P) * P;
+    uint32_t xt, x0, y0, r, j;
+    __m128i m[16];
+
+    for (j = B; j < 16; j++)
+        m[j] = _mm_setzero_si128();
+
+    for (xt = 0; xt < wv; xt += TILE_PIXELS) {
+        uint32_t xe = (xt + TILE_PIXELS < wv) ? xt + TILE_PIXELS : wv;
+
+        for (y0 = row0; y0 < y16; y0 += 16) {
+            uint8_t *d = dst + (size_t)(y0 - row0)*dst_stride;
+
+            for (x0 = xt; x0 < xe; x0 += P) {
+                /* 3 channel stores write 4 bytes past the group, which would run past the end of the row */
+                if ((nchan == 3) && (x0 + P + 2 > w)) {
+                    interleave_block_scalar(planes, h, nchan, false, dst, dst_stride, row0, x0, x0 + P, y0, y0 + 16, false);
+                    continue;
+                }
+
+                for (j = 0; j < B; j++) {
+                    uint32_t c = j / P, p = j % P;
+                    m[j] = _mm_loadu_si128((const __m128i*)(planes[c] + (size_t)(x0 + p)*h + y0));
+                }
+                /* A logical alpha column of 0s and 1s becomes 0s and 255s by negation */
+                if (mask)
+                    for (j = B - P; j < B; j++)
+                        m[j] = _mm_sub_epi8(_mm_setzero_si128(), m[j]);
+
+                transpose16x16(m);
+
+                for (r = 0; r < 16; r++) {
+                    __m128i v = _mm_shuffle_epi8(m[s_bitrev4[r]], shuf);
+                    if (clear)
+                        v = clear_transparent_sse(v, amask, nchan);
+                    _mm_storeu_si128((__m128i*)(d + r*dst_stride + x0*nchan), v);
+                }
+
+                /* The transpose overwrote the zero padding */
+                for (j = B; j < 16; j++)
+                    m[j] = _mm_setzero_si128();
+            }
+        }
+    }
+
+    /* Leftover columns and rows */
+    if (wv < w)
+        interleave_block_scalar(planes, h, nchan, mask, dst, dst_stride, row0, wv, w, row0, y16, clear);
+    if (y16 < row1)
+        interleave_block_scalar(planes, h, nchan, mask, dst, dst_stride, row0, 0, w, y16, row1, clear);
+}
+
+static void deinterleave_sse(const uint8_t *src, uint32_t w, uint32_t h, uint32_t nchan, uint8_t *dst)
+{
+    const uint32_t P = (nchan == 1) ? 16 : (nchan == 2) ? 8 : 4;  /* pixels per vector */
+    const uint32_t B = P*nchan;                                     /* valid bytes per vector */
+    const __m128i shuf = _mm_loadu_si128((const __m128i*)s_group_by_channel[nchan]);
+    const size_t plane = (size_t)w*h;
+    const size_t stride = (size_t)w*nchan;
+    const uint32_t h16 = h & ~15u;
+    const uint32_t wv = (w / P) * P;
+    uint32_t xt, x0, y0, r, j;
+    __m128i m[16];
+
+    for (xt = 0; xt < wv; xt += TILE_PIXELS) {
+        uint32_t xe = (xt + TILE_PIXELS < wv) ? xt + TILE_PIXELS : wv;
+
+        for (y0 = 0; y0 < h16; y0 += 16) {
+            const uint8_t *s = src + (size_t)y0*stride;
+
+            for (x0 = xt; x0 < xe; x0 += P) {
+                /* 3 channel loads read 4 bytes past the group, which overruns the end of the final row */
+                if ((nchan == 3) && (y0 + 16 == h) && (x0 + P + 2 > w)) {
+                    deinterleave_block_scalar(src, w, h, nchan, dst, x0, x0 + P, y0, y0 + 16);
+                    continue;
+                }
+
+                for (r = 0; r < 16; r++)
+                    m[r] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(s + r*stride + x0*nchan)), shuf);
+
+                transpose16x16(m);
+
+                for (j = 0; j < B; j++) {
+                    uint32_t c = j / P, p = j % P;
+                    _mm_storeu_si128((__m128i*)(dst + c*plane + (size_t)(x0 + p)*h + y0), m[s_bitrev4[j]]);
+                }
+            }
+        }
+    }
+
+    /* Leftover columns and rows */
+    if (wv < w)
+        deinterleave_block_scalar(src, w, h, nchan, dst, wv, w, 0, h16);
+    if (h16 < h)
+        deinterleave_block_scalar(src, w, h, nchan, dst, 0, w, h16, h);
+}
+
+static void deinterleave16_sse(const uint8_t *src, uint32_t w, uint32_t h, uint32_t nchan, uint16_t *dst)
+{
+    const uint32_t P = (nchan == 1) ? 8 : (nchan == 2) ? 4 : 2;    /* pixels per vector */
+    const uint32_t E = P*nchan;                                     /* valid words per vector */
+    const __m128i shuf = _mm_loadu_si128((const __m128i*)s_group_by_channel16[nchan]);
+    const size_t plane = (size_t)w*h;
+    const size_t stride = (size_t)w*nchan*2;
+    const uint32_t h8 = h & ~7u;
+    const uint32_t wv = (w / P) * P;
+    uint32_t xt, x0, y0, r, j;
+    __m128i m[8];
+
+    for (xt = 0; xt < wv; xt += TILE_PIXELS) {
+        uint32_t xe = (xt + TILE_PIXELS < wv) ? xt + TILE_PIXELS : wv;
+
+        for (y0 = 0; y0 < h8; y0 += 8) {
+            const uint8_t *s = src + (size_t)y0*stride;
+
+            for (x0 = xt; x0 < xe; x0 += P) {
+                /* 3 channel loads read 4 bytes past the group, which overruns the end of the final row */
+                if ((nchan == 3) && (y0 + 8 == h) && (x0 + P + 1 > w)) {
+                    deinterleave16_block_scalar(src, w, h, nchan, dst, x0, x0 + P, y0, y0 + 8);
+                    continue;
+                }
+
+                for (r = 0; r < 8; r++)
+                    m[r] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(s + r*stride + x0*nchan*2)), shuf);
+
+                transpose8x8_epi16(m);
+
+                for (j = 0; j < E; j++) {
+                    uint32_t c = j / P, p = j % P;
+                    _mm_storeu_si128((__m128i*)(dst + c*plane + (size_t)(x0 + p)*h + y0), m[j]);
+                }
+            }
+        }
+    }
+
+    /* Leftover columns and rows */
+    if (wv < w)
+        deinterleave16_block_scalar(src, w, h, nchan, dst, wv, w, 0, h8);
+    if (h8 < h)
+        deinterleave16_block_scalar(src, w, h, nchan, dst, 0, w, h8, h);
+}
+#endif
+
+void deinterleave_to_planar(const uint8_t *src, uint32_t w, uint32_t h, uint32_t nchan, uint8_t *dst)
+{
+#if IMGTRANSPOSE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        deinterleave_sse(src, w, h, nchan, dst);
+        return;
+    }
+#endif
+
+    uint32_t xt;
+    for (xt = 0; xt < w; xt += TILE_PIXELS)
+        deinterleave_block_scalar(src, w, h, nchan, dst, xt, (xt + TILE_PIXELS < w) ? xt + TILE_PIXELS : w, 0, h);
+}
+
+void deinterleave_to_planar16(const uint8_t *src, uint32_t w, uint32_t h, uint32_t nchan, uint16_t *dst)
+{
+#if IMGTRANSPOSE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        deinterleave16_sse(src, w, h, nchan, dst);
+        return;
+    }
+#endif
+
+    uint32_t xt;
+    for (xt = 0; xt < w; xt += TILE_PIXELS)
+        deinterleave16_block_scalar(src, w, h, nchan, dst, xt, (xt + TILE_PIXELS < w) ? xt + TILE_PIXELS : w, 0, h);
+}
+
+void interleave_from_planar(const uint8_t *src, uint32_t w, uint32_t h, uint32_t nchan, uint32_t y0, uint32_t y1,
+                            uint8_t *dst, size_t dst_stride, bool clear_transparent)
+{
+    interleave_with_alpha(src, NULL, w, h, nchan, y0, y1, dst, dst_stride, clear_transparent);
+}
+
+void interleave_with_alpha(const uint8_t *src, const alpha_plane *alpha, uint32_t w, uint32_t h, uint32_t nchan, uint32_t y0, uint32_t y1,
+                           uint8_t *dst, size_t dst_stride, bool clear_transparent)
+{
+    const uint8_t *planes[4];
+    bool mask = false;
+    uint32_t c;
+
+    for (c = 0; c < nchan; c++)
+        planes[c] = src + c*(size_t)w*h;
+    /* Only gray+alpha and RGBA have an alpha channel */
+    if (alpha && !(nchan & 1)) {
+        planes[nchan - 1] = alpha->data;
+        mask = alpha->logical;
+    }
+    clear_transparent = clear_transparent && !(nchan & 1);
+
+#if IMGTRANSPOSE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        interleave_sse(planes, w, h, nchan, mask, y0, y1, dst, dst_stride, clear_transparent);
+        return;
+    }
+#endif
+
+    uint32_t xt;
+    for (xt = 0; xt < w; xt += TILE_PIXELS)
+        interleave_block_scalar(planes, h, nchan, mask, dst, dst_stride, y0, xt, (xt + TILE_PIXELS < w) ? xt + TILE_PIXELS : w, y0, y1, clear_transparent);
+}
+
+void interleave_from_planar16(const uint16_t *src, uint32_t w, uint32_t h, uint32_t nchan, uint32_t y0, uint32_t y1,
+                              uint8_t *dst, size_t dst_stride, bool clear_transparent)
+{
+    clear_transparent = clear_transparent && !(nchan & 1);
+
+#if IMGTRANSPOSE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        interleave16_sse(src, w, h, nchan, y0, y1, dst, dst_stride, clear_transparent);
+        return;
+    }
+#endif
+
+    uint32_t xt;
+    for (xt = 0; xt < w; xt += TILE_PIXELS)
+        interleave16_block_scalar(src, w, h, nchan, dst, dst_stride, y0, xt, (xt + TILE_PIXELS < w) ? xt + TILE_PIXELS : w, y0, y1, clear_transparent);
+}
+
+template <typename T>
+static void crop_plane(const T *src, uint32_t src_h, uint32_t r0, uint32_t c0, uint32_t h, uint32_t w, uint32_t step, T *dst)
+{
+    uint32_t x, y;
+
+    for (x = 0; x < w; x++) {
+        const T *p = src + (size_t)(c0 + x*step)*src_h + r0;
+        T *q = dst + (size_t)x*h;
+        if (step == 1) {
+            memcpy(q, p, (size_t)h*sizeof(T));
+            continue;
+        }
+        for (y = 0; y < h; y++)
+            q[y] = p[(size_t)y*step];
+    }
+}
+
+void crop_planes(const uint8_t *src, uint32_t src_h, uint32_t src_w, uint32_t nplanes, uint32_t esize,
+                 uint32_t r0, uint32_t c0, uint32_t h, uint32_t w, uint32_t step, uint8_t *dst)
+{
+    uint32_t c;
+
+    for (c = 0; c < nplanes; c++) {
+        const uint8_t *s = src + (size_t)c*src_w*src_h*esize;
+        uint8_t *d = dst + (size_t)c*w*h*esize;
+        switch (esize) {
+        case 1: crop_plane(s, src_h, r0, c0, h, w, step, d); break;
+        case 2: crop_plane((const uint16_t *)s, src_h, r0, c0, h, w, step, (uint16_t *)d); break;
+        case 4: crop_plane((const uint32_t *)s, src_h, r0, c0, h, w, step, (uint32_t *)d); break;
+        default: crop_plane((const uint64_t *)s, src_h, r0, c0, h, w, step, (uint64_t *)d); break;
+        }
+    }
+}
+
+/* Scalar packing of the pixel rectangle [x0,x1) x [y0,y1), x0 a multiple of 8, rows relative to row0 in dst */
+static void pack_bits_block_scalar(const uint8_t *src, uint32_t h, uint8_t *dst, size_t dst_stride,
+                                   uint32_t row0, uint32_t x0, uint32_t x1, uint32_t y0, uint32_t y1)
+{
+    uint32_t x, y, j;
+
+    for (y = y0; y < y1; y++) {
+        uint8_t *q = dst + (size_t)(y - row0)*dst_stride;
+        for (x = x0; x < x1; x += 8) {
+            uint8_t byte = 0;
+            for (j = 0; (j < 8) && (x + j < x1); j++)
+                if (src[(size_t)(x + j)*h + y])
+                    byte |= (uint8_t)(0x80 >> j);
+            q[x >> 3] = byte;
+        }
+    }
+}
+
+void pack_bits_from_planar(const uint8_t *src, uint32_t w, uint32_t h, uint32_t y0, uint32_t y1, uint8_t *dst, size_t dst_stride)
+{
+    uint32_t xt;
+
+    for (xt = 0; xt < w; xt += TILE_PIXELS) {
+        uint32_t xe = (xt + TILE_PIXELS < w) ? xt + TILE_PIXELS : w, y = y0;
+
+#if IMGTRANSPOSE_SSE
+        if (fpng::fpng_cpu_supports_sse41()) {
+            const __m128i zero = _mm_setzero_si128();
+            uint32_t xv = xt + ((xe - xt) & ~7u), x, j;
+            uint8_t bytes[16];
+
+            for (; y + 16 <= y1; y += 16) {
+                for (x = xt; x < xv; x += 8) {
+                    __m128i v = zero;
+                    for (j = 0; j < 8; j++) {
+                        __m128i c = _mm_loadu_si128((const __m128i*)(src + (size_t)(x + j)*h + y));
+                        v = _mm_or_si128(v, _mm_andnot_si128(_mm_cmpeq_epi8(c, zero), _mm_set1_epi8((char)(0x80 >> j))));
+                    }
+                    _mm_storeu_si128((__m128i*)bytes, v);
+                    for (j = 0; j < 16; j++)
+                        dst[(size_t)(y + j - y0)*dst_stride + (x >> 3)] = bytes[j];
+                }
+                if (xv < xe)
+                    pack_bits_block_scalar(src, h, dst, dst_stride, y0, xv, xe, y, y + 16);
+            }
+        }
+#endif
+
+        pack_bits_block_scalar(src, h, dst, dst_stride, y0, xt, xe, y, y1);
+    }
+}
+
+bool bytes_all_ff(const uint8_t *p, size_t len)
+{
+    size_t i = 0;
+
+#if IMGTRANSPOSE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        const __m128i ones = _mm_set1_epi8(-1);
+        for (; i + 64 <= len; i += 64) {
+            __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(p + i)), _mm_loadu_si128((const __m128i*)(p + i + 16)));
+            __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(p + i + 32)), _mm_loadu_si128((const __m128i*)(p + i + 48)));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(a, b), ones)) != 0xFFFF)
+                return false;
+        }
+    }
+#endif
+
+    for (; i < len; i++)
+        if (p[i] != 0xFF)
+            return false;
+    return true;
+}
+
+bool narrow_samples16(const uint16_t *src, size_t n, uint8_t *dst)
+{
+    size_t i = 0;
+
+#if IMGTRANSPOSE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        const __m128i lo = _mm_set1_epi16(0xFF), zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 8));
+            __m128i a_lo = _mm_and_si128(a, lo), b_lo = _mm_and_si128(b, lo);
+            __m128i diff = _mm_or_si128(_mm_xor_si128(_mm_srli_epi16(a, 8), a_lo), _mm_xor_si128(_mm_srli_epi16(b, 8), b_lo));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, zero)) != 0xFFFF)
+                return false;
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a_lo, b_lo));
+        }
+    }
+#endif
+
+    for (; i < n; i++) {
+        if ((src[i] >> 8) != (src[i] & 0xFF))
+            return false;
+        dst[i] = (uint8_t)src[i];
+    }
+    return true;
+}
+
+void unit_to_uint8(const double *src, size_t n, uint8_t *dst)
+{
+    size_t i = 0;
+
+#if IMGTRANSPOSE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        const __m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1.0), scale = _mm_set1_pd(255.0), half = _mm_set1_pd(0.5);
+        for (; i + 16 <= n; i += 16) {
+            __m128i v[8];
+            uint32_t k;
+            for (k = 0; k < 8; k++) {
+                __m128d x = _mm_min_pd(_mm_max_pd(_mm_loadu_pd(src + i + 2*k), zero), one);
+                v[k] = _mm_cvttpd_epi32(_mm_add_pd(_mm_mul_pd(x, scale), half));
+            }
+            __m128i a = _mm_packs_epi32(_mm_unpacklo_epi64(v[0], v[1]), _mm_unpacklo_epi64(v[2], v[3]));
+            __m128i b = _mm_packs_epi32(_mm_unpacklo_epi64(v[4], v[5]), _mm_unpacklo_epi64(v[6], v[7]));
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a, b));
+        }
+    }
+#endif
+
+    for (; i < n; i++) {
+        double x = src[i];
+        dst[i] = !(x > 0) ? 0 : (x >= 1) ? 255 : (uint8_t)(x * 255.0 + 0.5);
+    }
+}
+
+void unit_to_uint8f(const float *src, size_t n, uint8_t *dst)
+{
+    size_t i = 0;
+
+#if IMGTRANSPOSE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), scale = _mm_set1_ps(255.0f), half = _mm_set1_ps(0.5f);
+        for (; i + 16 <= n; i += 16) {
+            __m128i v[4];
+            uint32_t k;
+            for (k = 0; k < 4; k++) {
+                __m128 x = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i + 4*k), zero), one);
+                v[k] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(x, scale), half));
+            }
+            __m128i a = _mm_packs_epi32(v[0], v[1]), b = _mm_packs_epi32(v[2], v[3]);
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a, b));
+        }
+    }
+#endif
+
+    for (; i < n; i++) {
+        float x = src[i];
+        dst[i] = !(x > 0) ? 0 : (x >= 1) ? 255 : (uint8_t)(x * 255.0f + 0.5f);
+    }
+}
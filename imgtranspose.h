@@ -0,0 +1,69 @@
+// Pixel layout conversion between MATLAB column-major planes and PNG row-major
+// interleaved scanlines, the plane checks behind savepng's lossless reductions and the
+// scaling of floating point images to 8 bits.
+// SSE versions are used when available (see fpng_init()), otherwise scalar fallbacks.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* De-interleave row-major pixels (RGB, RGB, ...) into column-major planes (RRR..., GGG..., BBB...)
+ * src:   h rows of w*nchan bytes
+ * dst:   nchan planes of h*w bytes, element (y,x) of plane c at dst[c*w*h + x*h + y]
+ * nchan: 1 to 4 */
+void deinterleave_to_planar(const uint8_t *src, uint32_t w, uint32_t h, uint32_t nchan, uint8_t *dst);
+
+/* Same for 16-bit samples stored big-endian (PNG byte order), swapped to host order on the way
+ * src:   h rows of w*nchan*2 bytes
+ * dst:   nchan planes of h*w samples, element (y,x) of plane c at dst[c*w*h + x*h + y] */
+void deinterleave_to_planar16(const uint8_t *src, uint32_t w, uint32_t h, uint32_t nchan, uint16_t *dst);
+
+/* An alpha plane kept apart from the colour planes (an alpha matrix passed on its own): h*w bytes, element
+ * (y,x) at data[x*h + y]. A logical plane holds 0 and 1, read as 0 and 255. */
+typedef struct {
+    const uint8_t *data;
+    bool logical;
+} alpha_plane;
+
+/* Interleave rows [y0,y1) of column-major planes into row-major pixels, the inverse of deinterleave_to_planar()
+ * src:        nchan planes of h*w bytes, element (y,x) of plane c at src[c*w*h + x*h + y]
+ * dst:        row y goes to dst + (y-y0)*dst_stride, w*nchan bytes; bytes between rows are left untouched
+ * nchan:      1 to 4
+ * clear_transparent: write pixels whose alpha (last channel of a 2 or 4 channel image) is 0 as all zero */
+void interleave_from_planar(const uint8_t *src, uint32_t w, uint32_t h, uint32_t nchan, uint32_t y0, uint32_t y1,
+                            uint8_t *dst, size_t dst_stride, bool clear_transparent);
+
+/* Same, with the alpha channel of a gray+alpha or RGBA image taken from alpha when it is not NULL; src then
+ * holds only the nchan-1 colour planes */
+void interleave_with_alpha(const uint8_t *src, const alpha_plane *alpha, uint32_t w, uint32_t h, uint32_t nchan, uint32_t y0, uint32_t y1,
+                           uint8_t *dst, size_t dst_stride, bool clear_transparent);
+
+/* Same for 16-bit samples, written big-endian (PNG byte order): row y goes to dst + (y-y0)*dst_stride,
+ * w*nchan*2 bytes */
+void interleave_from_planar16(const uint16_t *src, uint32_t w, uint32_t h, uint32_t nchan, uint32_t y0, uint32_t y1,
+                              uint8_t *dst, size_t dst_stride, bool clear_transparent);
+
+/* Gather a region of column-major planes into compact planes: rows r0, r0+step, ... (h of them) of columns
+ * c0, c0+step, ... (w of them) of each of nplanes planes of src_h*src_w samples of esize bytes. dst gets
+ * nplanes planes of h*w samples, element (y,x) of plane c at dst[(c*w*h + x*h + y)*esize]. */
+void crop_planes(const uint8_t *src, uint32_t src_h, uint32_t src_w, uint32_t nplanes, uint32_t esize,
+                 uint32_t r0, uint32_t c0, uint32_t h, uint32_t w, uint32_t step, uint8_t *dst);
+
+/* Pack rows [y0,y1) of a plane of h*w bytes (a MATLAB logical matrix, element (y,x) at src[x*h + y]) into
+ * 1-bit samples, set for nonzero bytes, leftmost pixel in the high-order bit of a byte. Row y goes to
+ * dst + (y-y0)*dst_stride, (w+7)/8 bytes with the unused low bits of the last byte clear. */
+void pack_bits_from_planar(const uint8_t *src, uint32_t w, uint32_t h, uint32_t y0, uint32_t y1, uint8_t *dst, size_t dst_stride);
+
+/* Checks for lossless reductions; both stop at the first byte or sample that rules the reduction out */
+
+/* True when all len bytes are 0xFF, e.g. an alpha plane that is fully opaque at 8 or 16 bits */
+bool bytes_all_ff(const uint8_t *p, size_t len);
+
+/* Narrow n 16-bit samples to 8 bits when every one of them has equal high and low bytes (an 8-bit value
+ * scaled by 257, the PNG rule for raising sample depth). Returns false otherwise, with dst partly written. */
+bool narrow_samples16(const uint16_t *src, size_t n, uint8_t *dst);
+
+/* Scale n samples of a double or single image to 8 bits as im2uint8 does: values are clamped to [0,1],
+ * multiplied by 255 and rounded, half away from zero; NaN becomes 0 */
+void unit_to_uint8(const double *src, size_t n, uint8_t *dst);
+void unit_to_uint8f(const float *src, size_t n, uint8_t *dst);
@@ -158,6 +158,18 @@ LIBDEFLATEAPI size_t
 libdeflate_deflate_compress_bound(struct libdeflate_compressor *compressor,
 				  size_t in_nbytes);
 
+/*
+ * savepng addition: like libdeflate_deflate_compress(), but the last block is
+ * not marked final and the output is terminated with an empty uncompressed
+ * block (a zlib "sync flush"), so the result ends on a byte boundary and
+ * further DEFLATE data may be appended after it.  The output may be up to 6
+ * bytes longer than libdeflate_deflate_compress_bound() reports.
+ */
+LIBDEFLATEAPI size_t
+libdeflate_deflate_compress_sync(struct libdeflate_compressor *compressor,
+				 const void *in, size_t in_nbytes,
+				 void *out, size_t out_nbytes_avail);
+
 /*
  * Like libdeflate_deflate_compress(), but uses the zlib wrapper format instead
  * of raw DEFLATE.
@@ -11094,6 +11106,9 @@ struct libdeflate_compressor {
 	/* Anything of this size or less we won't bother trying to compress. */
 	size_t max_passthrough_size;
 
+	/* savepng addition: don't set BFINAL, see libdeflate_deflate_compress_sync() */
+	bool sync_flush;
+
 	/*
 	 * The maximum search depth: consider at most this many potential
 	 * matches at each position
@@ -12457,7 +12472,7 @@ deflate_flush_block(struct libdeflate_compressor *c,
 			size_t len = UINT16_MAX;
 
 			if (in_end - in_next <= UINT16_MAX) {
-				bfinal = is_final_block;
+				bfinal = is_final_block && !c->sync_flush;
 				len = in_end - in_next;
 			}
 			/* It was already checked that there is enough space. */
@@ -12489,7 +12504,7 @@ deflate_flush_block(struct libdeflate_compressor *c,
 	if (best_cost == static_cost) {
 		/* Static Huffman block */
 		codes = &c->static_codes;
-		ADD_BITS(is_final_block, 1);
+		ADD_BITS(is_final_block && !c->sync_flush, 1);
 		ADD_BITS(DEFLATE_BLOCKTYPE_STATIC_HUFFMAN, 2);
 		FLUSH_BITS();
 	} else {
@@ -12502,7 +12517,7 @@ deflate_flush_block(struct libdeflate_compressor *c,
 
 		codes = &c->codes;
 		STATIC_ASSERT(CAN_BUFFER(1 + 2 + 5 + 5 + 4 + 3));
-		ADD_BITS(is_final_block, 1);
+		ADD_BITS(is_final_block && !c->sync_flush, 1);
 		ADD_BITS(DEFLATE_BLOCKTYPE_DYNAMIC_HUFFMAN, 2);
 		ADD_BITS(c->o.precode.num_litlen_syms - 257, 5);
 		ADD_BITS(c->o.precode.num_offset_syms - 1, 5);
@@ -14544,6 +14559,7 @@ libdeflate_alloc_compressor_ex(int compression_level,
 	 * compress very small inputs.
 	 */
 	c->max_passthrough_size = 55 - (compression_level * 4);
+	c->sync_flush = false;
 
 	switch (compression_level) {
 	case 0:
@@ -14691,6 +14707,62 @@ libdeflate_deflate_compress(struct libdeflate_compressor *c,
 	return os.next - (u8 *)out;
 }
 
+LIBDEFLATEAPI size_t
+libdeflate_deflate_compress_sync(struct libdeflate_compressor *c,
+				 const void *in, size_t in_nbytes,
+				 void *out, size_t out_nbytes_avail)
+{
+	struct deflate_output_bitstream os;
+	static const u8 empty_block[4] = { 0x00, 0x00, 0xFF, 0xFF };
+
+	if (unlikely(in_nbytes <= c->max_passthrough_size)) {
+		size_t n = deflate_compress_none(in, in_nbytes,
+						 out, out_nbytes_avail);
+		if (n == 0 || out_nbytes_avail - n < 5)
+			return 0;
+		/* Clear BFINAL in the header of the last uncompressed block */
+		if (in_nbytes != 0)
+			((u8 *)out)[((in_nbytes - 1) / UINT16_MAX) *
+				    (5 + UINT16_MAX)] &= ~1;
+		else
+			((u8 *)out)[0] &= ~1;
+		((u8 *)out)[n] = DEFLATE_BLOCKTYPE_UNCOMPRESSED << 1;
+		memcpy((u8 *)out + n + 1, empty_block, 4);
+		return n + 5;
+	}
+
+	os.bitbuf = 0;
+	os.bitcount = 0;
+	os.next = out;
+	os.end = os.next + out_nbytes_avail;
+	os.overflow = false;
+
+	c->sync_flush = true;
+	(*c->impl)(c, in, in_nbytes, &os);
+	c->sync_flush = false;
+
+	if (os.overflow)
+		return 0;
+
+	/*
+	 * Append BFINAL = 0 and BTYPE = uncompressed, pad to a byte boundary,
+	 * then LEN = 0 and NLEN = 0xFFFF.
+	 */
+	ASSERT(os.bitcount <= 7);
+	os.bitcount += 3;
+	if ((size_t)(os.end - os.next) < DIV_ROUND_UP(os.bitcount, 8) + 4)
+		return 0;
+	while (os.bitcount > 0) {
+		*os.next++ = os.bitbuf;
+		os.bitbuf >>= 8;
+		os.bitcount = (os.bitcount > 8) ? os.bitcount - 8 : 0;
+	}
+	memcpy(os.next, empty_block, 4);
+	os.next += 4;
+
+	return os.next - (u8 *)out;
+}
+
 LIBDEFLATEAPI void
 libdeflate_free_compressor(struct libdeflate_compressor *c)
 {
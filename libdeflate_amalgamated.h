@@ -114,6 +114,18 @@ LIBDEFLATEAPI size_t
 libdeflate_deflate_compress_bound(struct libdeflate_compressor *compressor,
 				  size_t in_nbytes);
 
+/*
+ * savepng addition: like libdeflate_deflate_compress(), but the last block is
+ * not marked final and the output is terminated with an empty uncompressed
+ * block (a zlib "sync flush"), so the result ends on a byte boundary and
+ * further DEFLATE data may be appended after it.  The output may be up to 6
+ * bytes longer than libdeflate_deflate_compress_bound() reports.
+ */
+LIBDEFLATEAPI size_t
+libdeflate_deflate_compress_sync(struct libdeflate_compressor *compressor,
+				 const void *in, size_t in_nbytes,
+				 void *out, size_t out_nbytes_avail);
+
 /*
  * Like libdeflate_deflate_compress(), but uses the zlib wrapper format instead
  * of raw DEFLATE.
@@ -0,0 +1,350 @@
+// % LOADPNG
+// %   Very fast PNG image decompression routine.
+// %
+// %   Input syntax is:
+// %   CDATA = loadpng(filename);
+// %   CDATA = loadpng({filename1,filename2,...});
+// %
+// %   Output:
+// %       CDATA           MxNx3 or MxNx4 (when the file has an alpha channel)
+// %                       matrix of uint8, or uint16 for 16-bit files, laid
+// %                       out the same way as the input to savepng and the
+// %                       output of imread.
+// %                       Grayscale files give MxN or MxNx2 (gray+alpha),
+// %                       1, 2 and 4-bit gray is scaled to 0-255 (masks
+// %                       read back as 0 and 255),
+// %                       palette files are expanded to RGB or RGBA.
+// %
+// %                       Given a cell array of file names, the files are
+// %                       decoded concurrently. When all images have the same
+// %                       size, number of channels and class CDATA is an
+// %                       MxNxCxK array with image k in CDATA(:,:,:,k),
+// %                       otherwise it is a cell array of images the size of
+// %                       the input.
+// %
+// %   Files written by savepng at compression levels 0-2 (fpng) are decoded
+// %   with fpng's fast single-pass decoder. Any other non-interlaced 8 or
+// %   16-bit PNG file (imwrite, savepng levels 3-14, ...) is decoded by a
+// %   general reader supporting all scanline filters.
+// %
+// %   Example 1:
+// %       savepng(img.cdata,'example.png',1);
+// %       cdata   = loadpng('example.png');
+// %
+// %   Example 2:
+// %       files   = dir('frames/*.png');
+// %       frames  = loadpng(fullfile({files.folder},{files.name}));
+// %
+// %   PNG decoding routine based on fpng:
+// %   https://github.com/richgel999/fpng
+// %
+//
+// % Author: S.Slonevskiy, 02/18/2013
+// % File bug reports at:
+// %       https://github.com/stefslon/savepng/issues
+//
+// % Versions:
+// %   10/18/2026, Initial version
+// %   10/18/2026, Added general PNG reader as fallback for non-fpng files
+// %   10/18/2026, Parallel decoding of files saved with the Stripes option
+// %   10/18/2026, Added batch decoding of a cell array of files on a worker pool
+// %   10/19/2026, Decode 16-bit files to uint16
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+
+#include "mex.h"
+#include "matrix.h"
+
+#include "fpng.h"
+#include "imgtranspose.h"
+#include "pngread.h"
+
+static uint8_t fpng_initialized = false;
+
+/* Read entire file into a newly allocated buffer, returns NULL on failure */
+uint8_t* read_file_to_memory(const char *filename, size_t &len_out)
+{
+    uint8_t *buf;
+    long filelen;
+
+    FILE *file = fopen(filename, "rb");
+    if (!file) return 0;
+
+    if ((fseek(file, 0, SEEK_END) != 0) || ((filelen = ftell(file)) < 0) || (fseek(file, 0, SEEK_SET) != 0)) {
+        fclose(file);
+        return 0;
+    }
+
+    buf = (uint8_t*)malloc(filelen ? filelen : 1);
+    if (!buf || (fread(buf, 1, filelen, file) != (size_t)filelen)) {
+        free(buf);
+        fclose(file);
+        return 0;
+    }
+    fclose(file);
+
+    len_out = (size_t)filelen;
+    return buf;
+}
+
+/* Leading bytes of a file read when probing its header; grown when the chunks before IDAT are larger */
+#define HEADER_PROBE_LEN 4096
+
+/* Parse the header of a PNG file reading as little of it as possible */
+int read_file_header(const char *filename, png_header &hdr)
+{
+    std::vector<uint8_t> head(HEADER_PROBE_LEN);
+    size_t got, more;
+    int status;
+
+    FILE *file = fopen(filename, "rb");
+    if (!file) return -1;
+
+    got = fread(head.data(), 1, head.size(), file);
+    for (;;) {
+        status = png_parse_header(head.data(), got, hdr, &more);
+        if ((status != PNG_DECODE_FAILED_CHUNK_PARSING) || !more || (got < head.size()))
+            break;
+
+        /* Prefix ended inside the chunks preceding IDAT */
+        head.resize((more > 2*head.size()) ? more : 2*head.size());
+        got += fread(head.data() + got, 1, head.size() - got, file);
+    }
+    fclose(file);
+
+    return status;
+}
+
+/* Batch state shared by the workers */
+typedef struct {
+    std::vector<std::string> filenames;
+    std::vector<png_header> hdr;
+    std::vector<uint8_t*> dst;          /* output planes of each image, uint16 ones for 16-bit files */
+    std::vector<int> status;            /* per file: decode status, -1 when it could not be read */
+    std::atomic<size_t> next;           /* next file to process */
+} batch_state;
+
+/* Worker: parse the header of each file to size the outputs */
+void probe_worker(batch_state *b)
+{
+    size_t i;
+    while ((i = b->next++) < b->filenames.size())
+        b->status[i] = read_file_header(b->filenames[i].c_str(), b->hdr[i]);
+}
+
+/* Decoded sample size: 16-bit files give uint16 outputs, everything else uint8 */
+static uint32_t output_depth(const png_header &hdr)
+{
+    return (hdr.bit_depth == 16) ? 16 : 8;
+}
+
+/* Transpose decoded pixels into a MATLAB array of the matching class */
+static void to_planar(const uint8_t *src, uint32_t width, uint32_t height, uint32_t nchan, uint32_t bit_depth, void *dst)
+{
+    if (bit_depth == 16)
+        deinterleave_to_planar16(src, width, height, nchan, (uint16_t *)dst);
+    else
+        deinterleave_to_planar(src, width, height, nchan, (uint8_t *)dst);
+}
+
+/* Worker: read, decode and transpose each file into its preallocated output. Reading in one worker
+ * overlaps decoding in the others. */
+void decode_worker(batch_state *b)
+{
+    std::vector<uint8_t> imgdata;
+    uint32_t width, height, nchan, depth;
+    uint8_t *filedata;
+    size_t filelen, i;
+
+    while ((i = b->next++) < b->filenames.size()) {
+        filedata = read_file_to_memory(b->filenames[i].c_str(), filelen);
+        if (!filedata) {
+            b->status[i] = -1;
+            continue;
+        }
+
+        b->status[i] = png_decode_memory(filedata, filelen, imgdata, width, height, nchan, depth);
+        free(filedata);
+
+        /* The file changed between header probe and decode */
+        if ((b->status[i] == PNG_DECODE_SUCCESS) && ((width != b->hdr[i].width) || (height != b->hdr[i].height) || (nchan != b->hdr[i].channels) ||
+                                                     (depth != output_depth(b->hdr[i]))))
+            b->status[i] = PNG_DECODE_FAILED_CHUNK_PARSING;
+
+        if (b->status[i] == PNG_DECODE_SUCCESS)
+            to_planar(imgdata.data(), width, height, nchan, depth, b->dst[i]);
+    }
+}
+
+/* Run a worker over all files of the batch on a pool of threads */
+void run_workers(void (*worker)(batch_state*), batch_state *b)
+{
+    std::vector<std::thread> threads;
+    uint32_t nthreads = std::thread::hardware_concurrency(), i;
+
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > b->filenames.size()) nthreads = (uint32_t)b->filenames.size();
+
+    b->next = 0;
+    for (i = 0; i < nthreads; i++)
+        threads.push_back(std::thread(worker, b));
+    for (i = 0; i < nthreads; i++)
+        threads[i].join();
+}
+
+/* Describe the first failed file of the batch, returns false when all succeeded */
+bool batch_error(const batch_state *b, const char **errid, char *errmsg, size_t errmsg_len)
+{
+    size_t i;
+    for (i = 0; i < b->filenames.size(); i++) {
+        if (b->status[i] == -1) {
+            *errid = "loadpng:fopen";
+            snprintf(errmsg, errmsg_len, "Could not read file '%s'.", b->filenames[i].c_str());
+            return true;
+        }
+        if (b->status[i] != PNG_DECODE_SUCCESS) {
+            *errid = "loadpng:decode";
+            snprintf(errmsg, errmsg_len, "%s: %s", b->filenames[i].c_str(), png_decode_status_string(b->status[i]));
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Decode a cell array of files into a 4-D array (all images alike) or a cell array of images.
+ * Returns false with the error identifier and message filled in on failure. */
+bool load_batch(mxArray *plhs[], const mxArray *files, const char **errid, char *errmsg, size_t errmsg_len)
+{
+    size_t n = mxGetNumberOfElements(files), i;
+    batch_state b;
+    mwSize dims[4];
+    bool uniform = true;
+
+    b.filenames.resize(n);
+    b.hdr.resize(n);
+    b.dst.resize(n);
+    b.status.resize(n);
+
+    for (i = 0; i < n; i++) {
+        const mxArray *f = mxGetCell(files, i);
+        char *filename;
+        if (!f || !mxIsChar(f)) {
+            *errid = "loadpng:nrhs";
+            snprintf(errmsg, errmsg_len, "File names must be given as a cell array of strings.");
+            return false;
+        }
+        filename = mxArrayToString(f);
+        b.filenames[i] = filename;
+        mxFree(filename);
+    }
+
+    /* Size the outputs up front from the file headers */
+    run_workers(probe_worker, &b);
+    if (batch_error(&b, errid, errmsg, errmsg_len))
+        return false;
+
+    for (i = 1; i < n; i++) {
+        if ((b.hdr[i].width != b.hdr[0].width) || (b.hdr[i].height != b.hdr[0].height) || (b.hdr[i].channels != b.hdr[0].channels) ||
+            (output_depth(b.hdr[i]) != output_depth(b.hdr[0])))
+            uniform = false;
+    }
+
+    if (uniform && n) {
+        size_t image_len = (size_t)b.hdr[0].width * b.hdr[0].height * b.hdr[0].channels * (output_depth(b.hdr[0]) / 8);
+        dims[0] = b.hdr[0].height;
+        dims[1] = b.hdr[0].width;
+        dims[2] = b.hdr[0].channels;
+        dims[3] = n;
+        plhs[0] = mxCreateUninitNumericArray(4, dims, (output_depth(b.hdr[0]) == 16) ? mxUINT16_CLASS : mxUINT8_CLASS, mxREAL);
+        for (i = 0; i < n; i++)
+            b.dst[i] = (uint8_t *)mxGetData(plhs[0]) + i*image_len;
+    }
+    else {
+        plhs[0] = mxCreateCellArray(mxGetNumberOfDimensions(files), mxGetDimensions(files));
+        for (i = 0; i < n; i++) {
+            mxArray *img;
+            dims[0] = b.hdr[i].height;
+            dims[1] = b.hdr[i].width;
+            dims[2] = b.hdr[i].channels;
+            img = mxCreateUninitNumericArray((dims[2] > 1) ? 3 : 2, dims, (output_depth(b.hdr[i]) == 16) ? mxUINT16_CLASS : mxUINT8_CLASS, mxREAL);
+            b.dst[i] = (uint8_t *)mxGetData(img);
+            mxSetCell(plhs[0], i, img);
+        }
+    }
+
+    run_workers(decode_worker, &b);
+    return !batch_error(&b, errid, errmsg, errmsg_len);
+}
+
+/* The gateway function */
+void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    uint8_t *filedata;        /* raw PNG file contents */
+    size_t filelen;
+    uint32_t width, height, nchan;  /* size of image */
+    uint32_t depth;                 /* 8 or 16 bits per sample */
+    mwSize dims[3];
+    int status;
+
+    char *filename = NULL;
+    size_t filenamelen;
+
+    std::vector<uint8_t> imgdata;   /* decoded row-major pixels */
+
+    /* Check for proper number of arguments */
+    if((nrhs!=1) || !(mxIsChar(prhs[0]) || mxIsCell(prhs[0]))) {
+        mexErrMsgIdAndTxt("loadpng:nrhs","File name input required.");
+    }
+
+    if (!fpng_initialized) {
+        fpng::fpng_init();
+        fpng_initialized = 1;
+    }
+
+    /* Batch of files */
+    if (mxIsCell(prhs[0])) {
+        const char *errid = NULL;
+        char errmsg[1024];
+        if (!load_batch(plhs, prhs[0], &errid, errmsg, sizeof(errmsg))) {
+            mexErrMsgIdAndTxt(errid, "%s", errmsg);
+        }
+        return;
+    }
+
+    /* Fetch input filename */
+    filenamelen = mxGetN(prhs[0])*sizeof(mxChar)+1;
+    filename = (char *)malloc(filenamelen);
+    mxGetString(prhs[0], filename, (mwSize)filenamelen);
+
+    filedata = read_file_to_memory(filename, filelen);
+    free(filename);
+    if (!filedata) {
+        mexErrMsgIdAndTxt("loadpng:fopen","Could not read file.");
+    }
+
+    /* fpng fast path, falling back to the general decoder for other PNG files */
+    status = png_decode_memory(filedata, filelen, imgdata, width, height, nchan, depth);
+    free(filedata);
+
+    if (status != PNG_DECODE_SUCCESS) {
+        mexErrMsgIdAndTxt("loadpng:decode","%s", png_decode_status_string(status));
+    }
+
+    /* Convert raw pixels to MATLAB image */
+    /* imgdata format: RGB, RGB, RGB, ... (16-bit samples big-endian) */
+    /* outdata format: RRRRRR..., GGGGGG..., BBBBBB... */
+    dims[0] = height;
+    dims[1] = width;
+    dims[2] = nchan;
+    plhs[0] = mxCreateUninitNumericArray((nchan > 1) ? 3 : 2, dims, (depth == 16) ? mxUINT16_CLASS : mxUINT8_CLASS, mxREAL);
+
+    to_planar(imgdata.data(), width, height, nchan, depth, mxGetData(plhs[0]));
+}
@@ -0,0 +1,59 @@
+function CDATA = loadpng(filename) %#ok<STOUT,INUSD>
+% LOADPNG
+%   Very fast PNG image decompression routine.
+%
+%   Input syntax is:
+%   CDATA = loadpng(filename);
+%   CDATA = loadpng({filename1,filename2,...});
+%
+%   Output:
+%       CDATA           MxNx3 or MxNx4 (when the file has an alpha channel)
+%                       matrix of uint8, or uint16 for 16-bit files, laid
+%                       out the same way as the input to savepng and the
+%                       output of imread.
+%                       Grayscale files give MxN or MxNx2 (gray+alpha),
+%                       1, 2 and 4-bit gray is scaled to 0-255 (masks
+%                       read back as 0 and 255),
+%                       palette files are expanded to RGB or RGBA.
+%
+%                       Given a cell array of file names, the files are
+%                       decoded concurrently. When all images have the same
+%                       size, number of channels and class CDATA is an
+%                       MxNxCxK array with image k in CDATA(:,:,:,k),
+%                       otherwise it is a cell array of images the size of
+%                       the input.
+%
+%   Files written by savepng at compression levels 0-2 (fpng) are decoded
+%   with fpng's fast single-pass decoder. Any other non-interlaced 8 or
+%   16-bit PNG file (imwrite, savepng levels 3-14, ...) is decoded by a
+%   general reader supporting all scanline filters.
+%
+%   Example 1:
+%       savepng(img.cdata,'example.png',1);
+%       cdata   = loadpng('example.png');
+%
+%   Example 2:
+%       files   = dir('frames/*.png');
+%       frames  = loadpng(fullfile({files.folder},{files.name}));
+%
+%   PNG decoding routine based on fpng:
+%   https://github.com/richgel999/fpng
+%
+
+% Author: S.Slonevskiy, 02/18/2013
+% File bug reports at: 
+%       https://github.com/stefslon/savepng/issues
+
+% Versions:
+%   10/18/2026, Initial version
+%   10/18/2026, Added general PNG reader as fallback for non-fpng files
+%   10/18/2026, Parallel decoding of files saved with the Stripes option
+%   10/18/2026, Added batch decoding of a cell array of files on a worker pool
+%   10/19/2026, Decode 16-bit files to uint16
+
+% Compile string
+try
+    mex loadpng.cpp pngread.cpp imgtranspose.cpp fpng.cpp -largeArrayDims -DFPNG_NO_SSE=0 CXXFLAGS="$CXXFLAGS -msse4.1 -mpclmul"
+catch
+    error('Sorry, auto-compilation failed.');
+end
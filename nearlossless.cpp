@@ -0,0 +1,67 @@
+// Near-lossless mode of savepng.
+//
+// This is the error-bounded prediction of JPEG-LS applied to the PNG Up filter: each sample is replaced by
+// the value nearest to it whose difference from the (already rounded) sample above is a multiple of
+// 2*max_error+1, so the filtered residuals take a fraction of the 256 possible values and the error
+// never exceeds max_error. Values past 0 or 255 are clamped, which only brings them closer. Up is the
+// predictor because fpng filters with it, so the same rounding serves both encoders; the libdeflate
+// writers filter with Up in the same pass. The rounding depends only on the pair of samples, so it is
+// a lookup in a 256x256 table.
+//
+#include "nearlossless.h"
+
+void near_lossless_init(uint32_t max_error, near_lossless_table *t)
+{
+    const int32_t step = 2 * (int32_t)max_error + 1;
+    int32_t p, x;
+
+    t->max_error = max_error;
+    for (p = 0; p < 256; p++) {
+        for (x = 0; x < 256; x++) {
+            int32_t r = x - p, v;
+            r = (r >= 0) ? ((r + (int32_t)max_error) / step) * step : -(((-r + (int32_t)max_error) / step) * step);
+            v = p + r;
+            t->recon[p][x] = (uint8_t)((v < 0) ? 0 : (v > 255) ? 255 : v);
+        }
+    }
+}
+
+/* One row with nchan samples per pixel, the last of them copied exactly when keep_last */
+template<uint32_t nchan, bool keep_last>
+static void round_row(const near_lossless_table *t, const uint8_t *src, const uint8_t *prev, size_t len,
+                      uint8_t *recon, uint8_t *residual)
+{
+    static const uint8_t zero[nchan] = { 0 };
+    size_t i;
+    uint32_t c;
+
+    for (i = 0; i < len; i += nchan) {
+        const uint8_t *p = prev ? prev + i : zero;
+        for (c = 0; c < nchan; c++) {
+            uint8_t above = p[c];
+            uint8_t v = (keep_last && (c == nchan - 1)) ? src[i + c] : t->recon[above][src[i + c]];
+            recon[i + c] = v;
+            if (residual)
+                residual[i + c] = (uint8_t)(v - above);
+        }
+    }
+}
+
+void near_lossless_row(const near_lossless_table *t, const uint8_t *src, const uint8_t *prev, size_t len, uint32_t nchan,
+                       uint8_t *recon, uint8_t *residual)
+{
+    switch (nchan) {
+    case 1: round_row<1, false>(t, src, prev, len, recon, residual); break;
+    case 2: round_row<2, true>(t, src, prev, len, recon, residual); break;
+    case 3: round_row<3, false>(t, src, prev, len, recon, residual); break;
+    default: round_row<4, true>(t, src, prev, len, recon, residual); break;
+    }
+}
+
+void near_lossless_image(const near_lossless_table *t, uint8_t *img, size_t row_len, uint32_t h, uint32_t nchan)
+{
+    uint32_t y;
+
+    for (y = 0; y < h; y++)
+        near_lossless_row(t, img + y * row_len, y ? img + (y - 1) * row_len : NULL, row_len, nchan, img + y * row_len, NULL);
+}
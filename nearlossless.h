@@ -0,0 +1,28 @@
+// Near-lossless mode of savepng: rounding 8-bit samples by at most a given error so that the PNG Up
+// filter leaves only a few distinct residuals, which deflate then codes in fewer bits.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define NEAR_LOSSLESS_MAX_ERROR 32
+
+typedef struct {
+    uint32_t max_error;
+    uint8_t recon[256][256];    /* sample written for x below a written sample p: recon[p][x] */
+} near_lossless_table;
+
+/* Fill in the table for a maximum error of 1 to NEAR_LOSSLESS_MAX_ERROR levels */
+void near_lossless_init(uint32_t max_error, near_lossless_table *t);
+
+/* Round one row of len bytes of interleaved samples, nchan per pixel (the alpha of grayscale+alpha and
+ * RGBA images is kept exact), against prev, the already rounded row above it. prev is NULL for a row
+ * predicted from zero: the first row of the image or of a stripe. The rounded samples go to recon and,
+ * when residual is not NULL, their PNG Up filter bytes to residual. Each byte is read before any byte at
+ * the same offset is written, so recon may be src or prev, and residual may be src. */
+void near_lossless_row(const near_lossless_table *t, const uint8_t *src, const uint8_t *prev, size_t len, uint32_t nchan,
+                       uint8_t *recon, uint8_t *residual);
+
+/* Round a whole image in place, row by row from the top, as fpng (which filters every row but the first
+ * with Up) will predict it */
+void near_lossless_image(const near_lossless_table *t, uint8_t *img, size_t row_len, uint32_t h, uint32_t nchan);
@@ -0,0 +1,394 @@
+// Palette (indexed colour) support for savepng.
+//
+// Colours are counted straight from the MATLAB planes. The SSE pass packs 16 pixels at a time into
+// 32-bit keys (c0 | c1<<8 | c2<<16 | c3<<24) with byte and word unpacks and skips the whole group when
+// every key equals the last colour seen, which is the common case for the flat backgrounds and lines
+// of plots. Other keys go through a small open addressing hash table; the scan stops at the 257th
+// colour, so photographs are rejected after a few rows.
+//
+// Colormap indices of floating point fields are computed two samples per SSE register in double
+// precision, in the same order of operations as MATLAB so that boundary samples land on the same entry:
+// max against zero (which also takes NaN to 0, as maxpd returns its second operand when either is NaN)
+// and min against the last index clamp the value before it is truncated, then saturating packs narrow
+// 16 indices to bytes. Integer fields without CLim only need an unsigned min.
+//
+#include "palette.h"
+#include "imgtranspose.h"
+#include "fpng.h"
+
+#include <string.h>
+#include <vector>
+
+#ifndef FPNG_NO_SSE
+    #define FPNG_NO_SSE (0)
+#endif
+
+#if (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)) && !FPNG_NO_SSE
+    #define PALETTE_SSE (1)
+    #include <emmintrin.h>      // SSE2
+    #include <smmintrin.h>      // SSE4.1
+#else
+    #define PALETTE_SSE (0)
+#endif
+
+/* Rows interleaved at a time when converting to indices */
+#define INDEX_BAND_ROWS 16
+
+static inline uint32_t palette_hash(uint32_t key)
+{
+    return (key * 0x9E3779B1u) >> 22;
+}
+
+/* Add a colour if it is new, returns false when the palette is full */
+static bool palette_insert(image_palette *pal, uint32_t key)
+{
+    uint32_t i = palette_hash(key);
+
+    while (pal->slot[i]) {
+        if (pal->key[i] == key)
+            return true;
+        i = (i + 1) & (PALETTE_HASH_SIZE - 1);
+    }
+    if (pal->ncolors == PALETTE_MAX_COLORS)
+        return false;
+    pal->key[i] = key;
+    pal->slot[i] = (uint16_t)++pal->ncolors;
+    return true;
+}
+
+/* Palette index of a colour known to be in the palette */
+static inline uint32_t palette_lookup(const image_palette *pal, uint32_t key)
+{
+    uint32_t i = palette_hash(key);
+
+    while (!pal->slot[i] || (pal->key[i] != key))
+        i = (i + 1) & (PALETTE_HASH_SIZE - 1);
+    return pal->slot[i] - 1;
+}
+
+/* Fill in the RGBA entries, translucent colours first so tRNS can stop after the last of them */
+static void palette_finish(image_palette *pal)
+{
+    uint32_t i, pass, n = 0;
+
+    pal->ntrans = 0;
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < PALETTE_HASH_SIZE; i++) {
+            uint32_t key = pal->key[i], alpha;
+            uint8_t *e = pal->rgba + 4 * n;
+
+            if (!pal->slot[i])
+                continue;
+            alpha = (pal->nchan == 4) ? (key >> 24) : (pal->nchan == 2) ? ((key >> 8) & 0xFF) : 0xFF;
+            if ((alpha < 0xFF) != (pass == 0))
+                continue;
+
+            if (pal->nchan <= 2) {
+                e[0] = e[1] = e[2] = (uint8_t)key;
+            }
+            else {
+                e[0] = (uint8_t)key;
+                e[1] = (uint8_t)(key >> 8);
+                e[2] = (uint8_t)(key >> 16);
+            }
+            e[3] = (uint8_t)alpha;
+            pal->slot[i] = (uint16_t)++n;
+            if (alpha < 0xFF)
+                pal->ntrans = n;
+        }
+    }
+}
+
+bool palette_from_planar(const uint8_t *src, const alpha_plane *alpha, uint32_t w, uint32_t h, uint32_t nchan, bool clear_transparent, image_palette *pal)
+{
+    size_t n = (size_t)w*h, i = 0;
+    const uint8_t *plane[4];
+    uint32_t last, c, amask, lmask = 0;
+
+    memset(pal->slot, 0, sizeof(pal->slot));
+    pal->ncolors = 0;
+    pal->nchan = nchan;
+    pal->clear_transparent = clear_transparent && !(nchan & 1);
+    for (c = 0; c < 4; c++)
+        plane[c] = (c < nchan) ? src + c*n : NULL;
+    if (alpha && !(nchan & 1)) {
+        plane[nchan - 1] = alpha->data;
+        /* A logical alpha byte of 1 is taken as 255 by negating it */
+        if (alpha->logical)
+            lmask = 0xFFu << (8*(nchan - 1));
+    }
+
+    /* Alpha byte of a key, none when transparent pixels are kept as they are */
+    amask = pal->clear_transparent ? 0xFFu << (8*(nchan - 1)) : 0;
+
+    last = 0;
+    for (c = 0; c < nchan; c++)
+        last |= (uint32_t)plane[c][0] << (8*c);
+    if (last & lmask)
+        last |= lmask;
+    if (amask && !(last & amask))
+        last = 0;
+    palette_insert(pal, last);
+
+#if PALETTE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        const __m128i zero = _mm_setzero_si128(), a = _mm_set1_epi32((int)amask), lm = _mm_set1_epi32((int)lmask);
+        uint32_t keys[16], j;
+
+        for (; i + 16 <= n; i += 16) {
+            __m128i c0 = _mm_loadu_si128((const __m128i *)(plane[0] + i));
+            __m128i c1 = plane[1] ? _mm_loadu_si128((const __m128i *)(plane[1] + i)) : zero;
+            __m128i c2 = plane[2] ? _mm_loadu_si128((const __m128i *)(plane[2] + i)) : zero;
+            __m128i c3 = plane[3] ? _mm_loadu_si128((const __m128i *)(plane[3] + i)) : zero;
+            __m128i lo01 = _mm_unpacklo_epi8(c0, c1), hi01 = _mm_unpackhi_epi8(c0, c1);
+            __m128i lo23 = _mm_unpacklo_epi8(c2, c3), hi23 = _mm_unpackhi_epi8(c2, c3);
+            __m128i k0 = _mm_unpacklo_epi16(lo01, lo23), k1 = _mm_unpackhi_epi16(lo01, lo23);
+            __m128i k2 = _mm_unpacklo_epi16(hi01, hi23), k3 = _mm_unpackhi_epi16(hi01, hi23);
+            __m128i l = _mm_set1_epi32((int)last);
+
+            if (lmask) {
+                k0 = _mm_or_si128(_mm_andnot_si128(lm, k0), _mm_and_si128(_mm_sub_epi8(zero, k0), lm));
+                k1 = _mm_or_si128(_mm_andnot_si128(lm, k1), _mm_and_si128(_mm_sub_epi8(zero, k1), lm));
+                k2 = _mm_or_si128(_mm_andnot_si128(lm, k2), _mm_and_si128(_mm_sub_epi8(zero, k2), lm));
+                k3 = _mm_or_si128(_mm_andnot_si128(lm, k3), _mm_and_si128(_mm_sub_epi8(zero, k3), lm));
+            }
+
+            /* Transparent pixels become key 0 */
+            if (amask) {
+                k0 = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(k0, a), zero), k0);
+                k1 = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(k1, a), zero), k1);
+                k2 = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(k2, a), zero), k2);
+                k3 = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(k3, a), zero), k3);
+            }
+            __m128i eq = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi32(k0, l), _mm_cmpeq_epi32(k1, l)),
+                                       _mm_and_si128(_mm_cmpeq_epi32(k2, l), _mm_cmpeq_epi32(k3, l)));
+
+            /* Run of the last colour */
+            if (_mm_movemask_epi8(eq) == 0xFFFF)
+                continue;
+
+            _mm_storeu_si128((__m128i *)(keys + 0), k0);
+            _mm_storeu_si128((__m128i *)(keys + 4), k1);
+            _mm_storeu_si128((__m128i *)(keys + 8), k2);
+            _mm_storeu_si128((__m128i *)(keys + 12), k3);
+            for (j = 0; j < 16; j++) {
+                if (keys[j] == last)
+                    continue;
+                last = keys[j];
+                if (!palette_insert(pal, last))
+                    return false;
+            }
+        }
+    }
+#endif
+
+    for (; i < n; i++) {
+        uint32_t key = 0;
+        for (c = 0; c < nchan; c++)
+            key |= (uint32_t)plane[c][i] << (8*c);
+        if (key & lmask)
+            key |= lmask;
+        if (amask && !(key & amask))
+            key = 0;
+        if (key == last)
+            continue;
+        last = key;
+        if (!palette_insert(pal, last))
+            return false;
+    }
+
+    palette_finish(pal);
+    return true;
+}
+
+void palette_from_colormap(const uint8_t *rgb, uint32_t ncolors, image_palette *pal)
+{
+    uint32_t k;
+
+    memset(pal->slot, 0, sizeof(pal->slot));
+    pal->ncolors = 0;
+    pal->ntrans = 0;
+    pal->nchan = 1;
+    pal->clear_transparent = false;
+    for (k = 0; k < ncolors; k++) {
+        palette_insert(pal, k);
+        memcpy(pal->rgba + 4 * k, rgb + 3 * k, 3);
+        pal->rgba[4 * k + 3] = 0xFF;
+    }
+}
+
+uint32_t palette_index_bits(const image_palette *pal)
+{
+    if (pal->ncolors <= 2) return 1;
+    if (pal->ncolors <= 4) return 2;
+    if (pal->ncolors <= 16) return 4;
+    return 8;
+}
+
+/* Map one row of interleaved pixels to packed indices */
+template<uint32_t nchan>
+static void index_row(const image_palette *pal, const uint8_t *p, uint32_t w, uint32_t bits, uint8_t *dst)
+{
+    uint32_t last_key = 0, last_idx, acc = 0, nbits = 0, x, c;
+
+    /* Prime the cache with the first pixel rather than a colour that may not be in the palette */
+    for (c = 0; c < nchan; c++)
+        last_key |= (uint32_t)p[c] << (8*c);
+    last_idx = palette_lookup(pal, last_key);
+
+    for (x = 0; x < w; x++, p += nchan) {
+        uint32_t key = 0, idx;
+        for (c = 0; c < nchan; c++)
+            key |= (uint32_t)p[c] << (8*c);
+        if (key != last_key) {
+            last_key = key;
+            last_idx = palette_lookup(pal, key);
+        }
+        idx = last_idx;
+
+        if (bits == 8) {
+            dst[x] = (uint8_t)idx;
+            continue;
+        }
+        acc = (acc << bits) | idx;
+        nbits += bits;
+        if (nbits == 8) {
+            *dst++ = (uint8_t)acc;
+            acc = nbits = 0;
+        }
+    }
+    if (nbits)
+        *dst = (uint8_t)(acc << (8 - nbits));
+}
+
+void palette_index_from_planar(const uint8_t *src, const alpha_plane *alpha, uint32_t w, uint32_t h, const image_palette *pal,
+                               uint32_t y0, uint32_t y1, uint8_t *dst, size_t dst_stride)
+{
+    const uint32_t nchan = pal->nchan, bits = palette_index_bits(pal);
+    const size_t row_len = (size_t)w * nchan;
+    std::vector<uint8_t> band(row_len * INDEX_BAND_ROWS);
+    uint32_t r0, r1, y;
+
+    for (r0 = y0; r0 < y1; r0 = r1) {
+        r1 = (y1 - r0 > INDEX_BAND_ROWS) ? r0 + INDEX_BAND_ROWS : y1;
+        interleave_with_alpha(src, alpha, w, h, nchan, r0, r1, band.data(), row_len, pal->clear_transparent);
+
+        for (y = r0; y < r1; y++) {
+            const uint8_t *p = band.data() + (y - r0) * row_len;
+            uint8_t *q = dst + (size_t)(y - y0) * dst_stride;
+            switch (nchan) {
+            case 1: index_row<1>(pal, p, w, bits, q); break;
+            case 2: index_row<2>(pal, p, w, bits, q); break;
+            case 3: index_row<3>(pal, p, w, bits, q); break;
+            default: index_row<4>(pal, p, w, bits, q); break;
+            }
+        }
+    }
+}
+
+/* Index of one sample, the scalar version of the SSE code below */
+static inline uint8_t colormap_index(double x, const double *clim, double last)
+{
+    double t = clim ? (x - clim[0]) / (clim[1] - clim[0]) * (last + 1) : x - 1;
+    return !(t > 0) ? 0 : (t >= last) ? (uint8_t)last : (uint8_t)t;
+}
+
+#if PALETTE_SSE
+/* Indices of 16 samples, converted to double by load(k) two at a time */
+template<typename Load>
+static inline void colormap_indices_sse(Load load, const double *clim, double last, uint8_t *dst)
+{
+    const __m128d zero = _mm_setzero_pd(), top = _mm_set1_pd(last), one = _mm_set1_pd(1.0);
+    const __m128d lo = _mm_set1_pd(clim ? clim[0] : 0), range = _mm_set1_pd(clim ? clim[1] - clim[0] : 1), count = _mm_set1_pd(last + 1);
+    __m128i v[8];
+    uint32_t k;
+
+    for (k = 0; k < 8; k++) {
+        __m128d x = load(k), t;
+        t = clim ? _mm_mul_pd(_mm_div_pd(_mm_sub_pd(x, lo), range), count) : _mm_sub_pd(x, one);
+        v[k] = _mm_cvttpd_epi32(_mm_min_pd(_mm_max_pd(t, zero), top));
+    }
+    __m128i a = _mm_packs_epi32(_mm_unpacklo_epi64(v[0], v[1]), _mm_unpacklo_epi64(v[2], v[3]));
+    __m128i b = _mm_packs_epi32(_mm_unpacklo_epi64(v[4], v[5]), _mm_unpacklo_epi64(v[6], v[7]));
+    _mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(a, b));
+}
+#endif
+
+void colormap_indices(const double *src, size_t n, const double *clim, uint32_t ncolors, uint8_t *dst)
+{
+    const double last = ncolors - 1;
+    size_t i = 0;
+
+#if PALETTE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        for (; i + 16 <= n; i += 16)
+            colormap_indices_sse([&](uint32_t k) { return _mm_loadu_pd(src + i + 2*k); }, clim, last, dst + i);
+    }
+#endif
+
+    for (; i < n; i++)
+        dst[i] = colormap_index(src[i], clim, last);
+}
+
+void colormap_indicesf(const float *src, size_t n, const double *clim, uint32_t ncolors, uint8_t *dst)
+{
+    const double last = ncolors - 1;
+    size_t i = 0;
+
+#if PALETTE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        for (; i + 16 <= n; i += 16)
+            colormap_indices_sse([&](uint32_t k) { return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(src + i + 2*k)))); }, clim, last, dst + i);
+    }
+#endif
+
+    for (; i < n; i++)
+        dst[i] = colormap_index(src[i], clim, last);
+}
+
+void colormap_indices8(const uint8_t *src, size_t n, const double *clim, uint32_t ncolors, uint8_t *dst)
+{
+    size_t i = 0;
+
+    if (clim) {
+        for (; i < n; i++)
+            dst[i] = colormap_index(src[i], clim, ncolors - 1);
+        return;
+    }
+
+#if PALETTE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        const __m128i top = _mm_set1_epi8((char)(ncolors - 1));
+        for (; i + 16 <= n; i += 16)
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_min_epu8(_mm_loadu_si128((const __m128i*)(src + i)), top));
+    }
+#endif
+
+    for (; i < n; i++)
+        dst[i] = (src[i] < ncolors) ? src[i] : (uint8_t)(ncolors - 1);
+}
+
+void colormap_indices16(const uint16_t *src, size_t n, const double *clim, uint32_t ncolors, uint8_t *dst)
+{
+    size_t i = 0;
+
+    if (clim) {
+        for (; i < n; i++)
+            dst[i] = colormap_index(src[i], clim, ncolors - 1);
+        return;
+    }
+
+#if PALETTE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        const __m128i top = _mm_set1_epi16((short)(ncolors - 1));
+        for (; i + 16 <= n; i += 16) {
+            __m128i a = _mm_min_epu16(_mm_loadu_si128((const __m128i*)(src + i)), top);
+            __m128i b = _mm_min_epu16(_mm_loadu_si128((const __m128i*)(src + i + 8)), top);
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a, b));
+        }
+    }
+#endif
+
+    for (; i < n; i++)
+        dst[i] = (src[i] < ncolors) ? (uint8_t)src[i] : (uint8_t)(ncolors - 1);
+}
@@ -0,0 +1,51 @@
+// Palette (indexed colour) support for savepng: finding the distinct colours of a MATLAB image and
+// mapping its pixels to packed palette indices, and mapping scalar fields through a colormap.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "imgtranspose.h"
+
+#define PALETTE_MAX_COLORS  256
+#define PALETTE_HASH_SIZE   1024    /* open addressing, at most a quarter full */
+
+typedef struct {
+    uint32_t ncolors;
+    uint32_t ntrans;                        /* entries with alpha < 255, which come first (tRNS length) */
+    uint8_t rgba[PALETTE_MAX_COLORS * 4];   /* palette entries as RGBA */
+    uint32_t nchan;                         /* channels of the image the palette was built for */
+    bool clear_transparent;                 /* pixels with alpha 0 are taken as all zero */
+    uint32_t key[PALETTE_HASH_SIZE];        /* pixel value packed as c0 | c1<<8 | c2<<16 | c3<<24 */
+    uint16_t slot[PALETTE_HASH_SIZE];       /* palette index + 1, 0 for an empty slot */
+} image_palette;
+
+/* Collect the distinct colours of a MATLAB image, giving up as soon as there are more than 256
+ * src:   nchan planes of h*w bytes, element (y,x) of plane c at src[c*w*h + x*h + y]
+ * nchan: 1 to 4; grayscale entries are stored as R = G = B
+ * alpha: alpha plane of a gray+alpha or RGBA image kept apart from src (see interleave_with_alpha()), or NULL
+ * clear_transparent: count (and later index) every pixel with alpha 0 as the single colour 0
+ * Returns false when the image has more than PALETTE_MAX_COLORS colours. */
+bool palette_from_planar(const uint8_t *src, const alpha_plane *alpha, uint32_t w, uint32_t h, uint32_t nchan, bool clear_transparent, image_palette *pal);
+
+/* Bits per palette index: 1, 2, 4 or 8 */
+uint32_t palette_index_bits(const image_palette *pal);
+
+/* Convert rows [y0,y1) of the image to packed palette indices of palette_index_bits() each, leftmost
+ * pixel in the high-order bits of a byte. Row y goes to dst + (y-y0)*dst_stride, (w*bits+7)/8 bytes. */
+void palette_index_from_planar(const uint8_t *src, const alpha_plane *alpha, uint32_t w, uint32_t h, const image_palette *pal,
+                               uint32_t y0, uint32_t y1, uint8_t *dst, size_t dst_stride);
+
+/* Palette for planes of colormap indices (see colormap_indices()), read as a grayscale image: entry k is
+ * found by key k. rgb holds ncolors (1 to 256) RGB triples. */
+void palette_from_colormap(const uint8_t *rgb, uint32_t ncolors, image_palette *pal);
+
+/* Palette indices of the n samples of a scalar field shown with a colormap of ncolors entries, one byte
+ * per sample. With clim = {lo, hi} the mapping is MATLAB's scaled one (imagesc): (x-lo)/(hi-lo)*ncolors
+ * rounded toward zero. Without (NULL) it is the direct one (image, ind2rgb): x rounded toward zero is a
+ * 1-based index for single and double, 0-based for integer classes. Indices are clamped to the colormap;
+ * NaN takes the first entry. */
+void colormap_indices(const double *src, size_t n, const double *clim, uint32_t ncolors, uint8_t *dst);
+void colormap_indicesf(const float *src, size_t n, const double *clim, uint32_t ncolors, uint8_t *dst);
+void colormap_indices8(const uint8_t *src, size_t n, const double *clim, uint32_t ncolors, uint8_t *dst);
+void colormap_indices16(const uint16_t *src, size_t n, const double *clim, uint32_t ncolors, uint8_t *dst);
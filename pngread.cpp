@@ -0,0 +1,771 @@
+// General purpose PNG reader used when a file was not written by fpng.
+//
+// The inflate below is a straightforward table driven decoder: a 64-bit bit buffer refilled a word at a
+// time, and two-level Huffman tables (10/8 bit primary lookup plus subtables for longer codes).
+//
+// Files carrying a savepng stripe index (spIX chunk) are decoded one stripe per thread: each stripe of
+// the zlib stream starts on a byte boundary with an empty window, so it inflates on its own, and the
+// per-stripe Adler-32 sums are combined to check the whole stream.
+//
+#include "pngread.h"
+#include "fpng.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <thread>
+#include <atomic>
+
+#define LITLEN_TABLE_BITS   10
+#define DIST_TABLE_BITS     8
+#define PRECODE_TABLE_BITS  7
+
+/* Table entry: symbol or subtable start (bits 0-15), code length or subtable bits (16-20), subtable flag */
+#define HUFF_SUBTABLE       0x200000u
+#define HUFF_ENTRY(sym, len) ((uint32_t)(sym) | ((uint32_t)(len) << 16))
+
+/* Version byte of fpng's fdEC chunk (FPNG_FDEC_VERSION in fpng.cpp) */
+#define FDEC_VERSION        0
+
+/* Primary table plus worst-case room for subtables */
+#define LITLEN_TABLE_SIZE   ((1 << LITLEN_TABLE_BITS) + (1 << 15))
+#define DIST_TABLE_SIZE     ((1 << DIST_TABLE_BITS) + (1 << 15))
+
+static const uint16_t s_length_base[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const uint8_t s_length_extra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static const uint16_t s_dist_base[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static const uint8_t s_dist_extra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+static const uint8_t s_precode_order[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+
+struct inflate_tables
+{
+    uint32_t litlen[LITLEN_TABLE_SIZE];
+    uint32_t dist[DIST_TABLE_SIZE];
+    uint32_t precode[1 << PRECODE_TABLE_BITS];
+};
+
+/* Build a decode table for canonical Huffman code lengths. Incomplete codes are allowed (unused entries
+ * stay zero and are rejected when decoded), over-subscribed codes are not. */
+static bool build_decode_table(const uint8_t *lens, uint32_t num_syms, uint32_t table_bits, uint32_t *table)
+{
+    uint32_t count[16], next_code[16];
+    uint16_t rev_codes[288];
+    uint8_t max_len[1 << LITLEN_TABLE_BITS];
+    const uint32_t table_size = 1u << table_bits, mask = table_size - 1;
+    uint32_t i, len, code, next_sub;
+    int left;
+
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < num_syms; i++)
+        count[lens[i]]++;
+    count[0] = 0;
+
+    left = 1;
+    for (len = 1; len <= 15; len++) {
+        left = (left << 1) - (int)count[len];
+        if (left < 0)
+            return false;
+    }
+
+    code = 0;
+    next_code[0] = 0;
+    for (len = 1; len <= 15; len++) {
+        code = (code + count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+
+    memset(table, 0, sizeof(uint32_t) * table_size);
+    memset(max_len, 0, table_size);
+
+    /* Deflate sends codes LSB first, so tables are indexed by the bit-reversed code */
+    for (i = 0; i < num_syms; i++) {
+        uint32_t c, r = 0, j;
+        len = lens[i];
+        if (!len)
+            continue;
+        c = next_code[len]++;
+        for (j = 0; j < len; j++, c >>= 1)
+            r = (r << 1) | (c & 1);
+        rev_codes[i] = (uint16_t)r;
+        if ((len > table_bits) && (len > max_len[r & mask]))
+            max_len[r & mask] = (uint8_t)len;
+    }
+
+    next_sub = table_size;
+    for (i = 0; i < table_size; i++) {
+        if (max_len[i]) {
+            uint32_t sub_bits = max_len[i] - table_bits;
+            table[i] = HUFF_ENTRY(next_sub, sub_bits) | HUFF_SUBTABLE;
+            memset(table + next_sub, 0, sizeof(uint32_t) << sub_bits);
+            next_sub += 1u << sub_bits;
+        }
+    }
+
+    for (i = 0; i < num_syms; i++) {
+        uint32_t r, k;
+        len = lens[i];
+        if (!len)
+            continue;
+        r = rev_codes[i];
+        if (len <= table_bits) {
+            for (k = r; k < table_size; k += 1u << len)
+                table[k] = HUFF_ENTRY(i, len);
+        }
+        else {
+            uint32_t sub = table[r & mask];
+            uint32_t sub_bits = (sub >> 16) & 31, base = sub & 0xFFFF;
+            for (k = r >> table_bits; k < (1u << sub_bits); k += 1u << (len - table_bits))
+                table[base + k] = HUFF_ENTRY(i, len);
+        }
+    }
+
+    return true;
+}
+
+#define REFILL_BITS() do { \
+    if (pos + 8 <= src_len) { \
+        uint64_t v; memcpy(&v, src + pos, 8); \
+        bit_buf |= v << bit_count; pos += (63 - bit_count) >> 3; bit_count |= 56; \
+    } else { \
+        while (bit_count <= 56) { \
+            if (pos < src_len) bit_buf |= (uint64_t)src[pos] << bit_count; \
+            pos++; bit_count += 8; \
+        } \
+    } \
+} while(0)
+
+#define CONSUME_BITS(n) do { bit_buf >>= (n); bit_count -= (n); } while(0)
+#define PEEK_BITS(n) ((uint32_t)bit_buf & ((1u << (n)) - 1))
+
+#define DECODE_SYM(table, table_bits, entry) do { \
+    entry = table[PEEK_BITS(table_bits)]; \
+    if (entry & HUFF_SUBTABLE) \
+        entry = table[(entry & 0xFFFF) + (((uint32_t)(bit_buf >> (table_bits))) & ((1u << ((entry >> 16) & 31)) - 1))]; \
+    if (!(entry >> 16)) goto fail; \
+    CONSUME_BITS((entry >> 16) & 31); \
+    entry &= 0xFFFF; \
+} while(0)
+
+bool png_inflate_raw(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_len, size_t *src_used, size_t *dst_written)
+{
+    inflate_tables *t = (inflate_tables*)malloc(sizeof(inflate_tables));
+    uint64_t bit_buf = 0;
+    uint32_t bit_count = 0;
+    size_t pos = 0, out = 0;
+    uint32_t bfinal, btype, i;
+    uint8_t lens[288 + 32];
+
+    if (!t)
+        return false;
+
+    for (;;) {
+        REFILL_BITS();
+        bfinal = PEEK_BITS(1);
+        btype = (uint32_t)(bit_buf >> 1) & 3;
+        CONSUME_BITS(3);
+
+        if (btype == 0) {
+            /* Stored block: drop to a byte boundary and return unread whole bytes to the source */
+            uint32_t len, nlen;
+            CONSUME_BITS(bit_count & 7);
+            pos -= bit_count >> 3;
+            bit_buf = 0;
+            bit_count = 0;
+            if (pos + 4 > src_len)
+                goto fail;
+            len = src[pos] | (src[pos + 1] << 8);
+            nlen = src[pos + 2] | (src[pos + 3] << 8);
+            pos += 4;
+            if ((len != (~nlen & 0xFFFF)) || (pos + len > src_len) || (out + len > dst_len))
+                goto fail;
+            memcpy(dst + out, src + pos, len);
+            pos += len;
+            out += len;
+        }
+        else if (btype == 1 || btype == 2) {
+            if (btype == 1) {
+                for (i = 0; i < 144; i++) lens[i] = 8;
+                for (; i < 256; i++) lens[i] = 9;
+                for (; i < 280; i++) lens[i] = 7;
+                for (; i < 288; i++) lens[i] = 8;
+                for (i = 0; i < 32; i++) lens[288 + i] = 5;
+                if (!build_decode_table(lens, 288, LITLEN_TABLE_BITS, t->litlen) || !build_decode_table(lens + 288, 32, DIST_TABLE_BITS, t->dist))
+                    goto fail;
+            }
+            else {
+                uint8_t precode_lens[19];
+                uint32_t hlit, hdist, hclen, n;
+
+                hlit = PEEK_BITS(5) + 257; CONSUME_BITS(5);
+                hdist = PEEK_BITS(5) + 1; CONSUME_BITS(5);
+                hclen = PEEK_BITS(4) + 4; CONSUME_BITS(4);
+                if (hlit > 286 || hdist > 30)
+                    goto fail;
+
+                memset(precode_lens, 0, sizeof(precode_lens));
+                for (i = 0; i < hclen; i++) {
+                    REFILL_BITS();
+                    precode_lens[s_precode_order[i]] = (uint8_t)PEEK_BITS(3);
+                    CONSUME_BITS(3);
+                }
+                if (!build_decode_table(precode_lens, 19, PRECODE_TABLE_BITS, t->precode))
+                    goto fail;
+
+                for (n = 0; n < hlit + hdist; ) {
+                    uint32_t sym, rep, val;
+                    REFILL_BITS();
+                    DECODE_SYM(t->precode, PRECODE_TABLE_BITS, sym);
+                    if (sym < 16) {
+                        lens[n++] = (uint8_t)sym;
+                        continue;
+                    }
+                    if (sym == 16) {
+                        if (!n) goto fail;
+                        val = lens[n - 1];
+                        rep = 3 + PEEK_BITS(2); CONSUME_BITS(2);
+                    }
+                    else if (sym == 17) {
+                        val = 0;
+                        rep = 3 + PEEK_BITS(3); CONSUME_BITS(3);
+                    }
+                    else {
+                        val = 0;
+                        rep = 11 + PEEK_BITS(7); CONSUME_BITS(7);
+                    }
+                    if (n + rep > hlit + hdist)
+                        goto fail;
+                    memset(lens + n, (int)val, rep);
+                    n += rep;
+                }
+                if (!lens[256])
+                    goto fail;
+
+                /* Distance lengths must start at index 288 for the table build below */
+                memmove(lens + 288, lens + hlit, hdist);
+                memset(lens + hlit, 0, 288 - hlit);
+                if (!build_decode_table(lens, 288, LITLEN_TABLE_BITS, t->litlen) || !build_decode_table(lens + 288, hdist, DIST_TABLE_BITS, t->dist))
+                    goto fail;
+            }
+
+            for (;;) {
+                uint32_t sym, len, dist;
+
+                REFILL_BITS();
+                DECODE_SYM(t->litlen, LITLEN_TABLE_BITS, sym);
+                if (sym < 256) {
+                    if (out >= dst_len)
+                        goto fail;
+                    dst[out++] = (uint8_t)sym;
+                    continue;
+                }
+                if (sym == 256)
+                    break;
+
+                sym -= 257;
+                if (sym >= 29)
+                    goto fail;
+                len = s_length_base[sym] + PEEK_BITS(s_length_extra[sym]);
+                CONSUME_BITS(s_length_extra[sym]);
+
+                DECODE_SYM(t->dist, DIST_TABLE_BITS, sym);
+                if (sym >= 30)
+                    goto fail;
+                dist = s_dist_base[sym] + PEEK_BITS(s_dist_extra[sym]);
+                CONSUME_BITS(s_dist_extra[sym]);
+
+                if ((dist > out) || (len > dst_len - out))
+                    goto fail;
+
+                {
+                    uint8_t *d = dst + out;
+                    const uint8_t *s = d - dist;
+                    if ((dist >= 8) && (dst_len - out >= (size_t)len + 8)) {
+                        /* Non-overlapping 8 byte steps; may write up to 7 bytes past len, which is still inside dst */
+                        uint8_t *e = d + len;
+                        do { memcpy(d, s, 8); d += 8; s += 8; } while (d < e);
+                    }
+                    else {
+                        for (i = 0; i < len; i++)
+                            d[i] = s[i];
+                    }
+                }
+                out += len;
+            }
+        }
+        else {
+            goto fail;
+        }
+
+        /* A full output ends the stream only where the input ends too (a stripe closed by a sync flush);
+         * otherwise empty blocks may still follow, up to the final one */
+        if (bfinal || ((out == dst_len) && (pos - (bit_count >> 3) >= src_len)))
+            break;
+    }
+
+    /* Whole bytes still in the bit buffer were not consumed */
+    pos -= bit_count >> 3;
+    if (pos > src_len)
+        goto fail;
+
+    free(t);
+    *src_used = pos;
+    *dst_written = out;
+    return true;
+
+fail:
+    free(t);
+    return false;
+}
+
+/* Inflate a zlib stream and verify its Adler-32 */
+static bool zlib_inflate(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_len)
+{
+    size_t used, written;
+
+    if ((src_len < 6) || ((src[0] & 15) != 8) || (((src[0] << 8) | src[1]) % 31) || (src[1] & 0x20))
+        return false;
+
+    if (!png_inflate_raw(src + 2, src_len - 2, dst, dst_len, &used, &written) || (written != dst_len) || (2 + used + 4 > src_len))
+        return false;
+
+    src += 2 + used;
+    return fpng::fpng_adler32(dst, dst_len) == (((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) | ((uint32_t)src[2] << 8) | src[3]);
+}
+
+static inline uint8_t paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if ((pa <= pb) && (pa <= pc)) return (uint8_t)a;
+    if (pb <= pc) return (uint8_t)b;
+    return (uint8_t)c;
+}
+
+bool png_unfilter(const uint8_t *raw, uint8_t *pix, size_t stride, uint32_t h, uint32_t bpp, const uint8_t *prev)
+{
+    uint32_t y;
+    size_t i;
+
+    /* In place, rows are compacted forward over their own filter bytes, so dst never overtakes src */
+    for (y = 0; y < h; y++) {
+        const uint8_t *src = raw + (size_t)y * (stride + 1) + 1;
+        uint8_t *dst = pix + (size_t)y * stride;
+        uint8_t filter = src[-1];
+
+        switch (filter) {
+        case 0:
+            memmove(dst, src, stride);
+            break;
+        case 1:
+            for (i = 0; i < bpp && i < stride; i++) dst[i] = src[i];
+            for (; i < stride; i++) dst[i] = (uint8_t)(src[i] + dst[i - bpp]);
+            break;
+        case 2:
+            if (prev) for (i = 0; i < stride; i++) dst[i] = (uint8_t)(src[i] + prev[i]);
+            else memmove(dst, src, stride);
+            break;
+        case 3:
+            if (prev) {
+                for (i = 0; i < bpp && i < stride; i++) dst[i] = (uint8_t)(src[i] + (prev[i] >> 1));
+                for (; i < stride; i++) dst[i] = (uint8_t)(src[i] + ((dst[i - bpp] + prev[i]) >> 1));
+            }
+            else {
+                for (i = 0; i < bpp && i < stride; i++) dst[i] = src[i];
+                for (; i < stride; i++) dst[i] = (uint8_t)(src[i] + (dst[i - bpp] >> 1));
+            }
+            break;
+        case 4:
+            if (prev) {
+                for (i = 0; i < bpp && i < stride; i++) dst[i] = (uint8_t)(src[i] + prev[i]);
+                for (; i < stride; i++) dst[i] = (uint8_t)(src[i] + paeth(dst[i - bpp], prev[i], prev[i - bpp]));
+            }
+            else {
+                for (i = 0; i < bpp && i < stride; i++) dst[i] = src[i];
+                for (; i < stride; i++) dst[i] = (uint8_t)(src[i] + dst[i - bpp]);
+            }
+            break;
+        default:
+            return false;
+        }
+
+        prev = dst;
+    }
+
+    return true;
+}
+
+static inline uint32_t read_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* Adler-32 of two concatenated buffers from the sums of each part (same as zlib's adler32_combine) */
+static uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2)
+{
+    const uint32_t BASE = 65521;
+    uint32_t rem = (uint32_t)(len2 % BASE);
+    uint64_t sum1 = adler1 & 0xFFFF;
+    uint64_t sum2 = (rem * sum1) % BASE;
+
+    sum1 += (adler2 & 0xFFFF) + BASE - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + BASE - rem;
+    if (sum1 >= BASE) sum1 -= BASE;
+    if (sum1 >= BASE) sum1 -= BASE;
+    if (sum2 >= ((uint64_t)BASE << 1)) sum2 -= ((uint64_t)BASE << 1);
+    if (sum2 >= BASE) sum2 -= BASE;
+    return (uint32_t)(sum1 | (sum2 << 16));
+}
+
+/* Inflate the zlib stream of a file with a stripe index (spIX chunk written by savepng) on parallel
+ * threads and unfilter it into pix (stride bytes per row). Returns false when the index does not
+ * describe the stream, in which case the caller decodes it serially. */
+static bool decode_stripes(const uint8_t *index, uint32_t index_len, const std::vector<uint8_t> &idat, uint8_t *raw,
+                           uint8_t *pix, size_t stride, uint32_t height, uint32_t bpp)
+{
+    uint32_t n, i, nthreads;
+    std::vector<size_t> ofs, row;
+    std::vector<uint32_t> adler;
+    std::vector<std::thread> workers;
+    std::atomic<bool> failed(false);
+    uint32_t total;
+
+    /* Version byte, stripe count, then 64-bit stream offset and first row per stripe */
+    if ((index_len < 5) || (index[0] != 0))
+        return false;
+    n = read_be32(index + 1);
+    if ((n < 2) || (n > (index_len - 5) / 12) || (index_len != 5 + 12 * n) || (idat.size() < 6))
+        return false;
+
+    ofs.resize(n + 1);
+    row.resize(n + 1);
+    for (i = 0; i < n; i++) {
+        const uint8_t *e = index + 5 + 12 * i;
+        ofs[i] = (size_t)(((uint64_t)read_be32(e) << 32) | read_be32(e + 4));
+        row[i] = read_be32(e + 8);
+        if (i ? ((ofs[i] <= ofs[i - 1]) || (row[i] <= row[i - 1]) || (row[i] >= height)) : ((ofs[0] != 2) || (row[0] != 0)))
+            return false;
+    }
+    ofs[n] = idat.size() - 4;
+    row[n] = height;
+    if (ofs[n - 1] >= ofs[n])
+        return false;
+
+    nthreads = std::thread::hardware_concurrency();
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > n) nthreads = n;
+
+    adler.resize(n);
+    for (i = 0; i < nthreads; i++) {
+        workers.push_back(std::thread([&, i]() {
+            for (uint32_t s = i; (s < n) && !failed; s += nthreads) {
+                size_t dst_len = (row[s + 1] - row[s]) * (stride + 1), used, written;
+                uint8_t *dst = raw + row[s] * (stride + 1);
+
+                /* The stripe must inflate to exactly its rows and end where the next one starts */
+                if (!png_inflate_raw(idat.data() + ofs[s], ofs[s + 1] - ofs[s], dst, dst_len, &used, &written) || (written != dst_len) ||
+                    (used != ofs[s + 1] - ofs[s])) {
+                    failed = true;
+                    break;
+                }
+                adler[s] = fpng::fpng_adler32(dst, dst_len);
+
+                /* The first row of a stripe must not depend on the row above */
+                if ((s && (dst[0] > 1)) || !png_unfilter(dst, pix + row[s] * stride, stride, (uint32_t)(row[s + 1] - row[s]), bpp, NULL)) {
+                    failed = true;
+                    break;
+                }
+            }
+        }));
+    }
+    for (i = 0; i < nthreads; i++)
+        workers[i].join();
+    if (failed)
+        return false;
+
+    total = adler[0];
+    for (i = 1; i < n; i++)
+        total = adler32_combine(total, adler[i], (row[i + 1] - row[i]) * (stride + 1));
+    return total == read_be32(idat.data() + idat.size() - 4);
+}
+
+/* Non-interlaced 8-bit images of any colour type, 1, 2 and 4-bit gray and palette images, and 16-bit images
+ * other than palette ones */
+static bool png_depth_supported(uint8_t color_type, uint8_t bit_depth)
+{
+    if (color_type == 3)
+        return (bit_depth == 1) || (bit_depth == 2) || (bit_depth == 4) || (bit_depth == 8);
+    if (color_type == 0)
+        return (bit_depth == 1) || (bit_depth == 2) || (bit_depth == 4) || (bit_depth == 8) || (bit_depth == 16);
+    return (bit_depth == 8) || (bit_depth == 16);
+}
+
+/* General (non-fpng) decode path */
+static int png_decode_generic(const uint8_t *p, size_t size, std::vector<uint8_t> &out, uint32_t &width, uint32_t &height, uint32_t &channels,
+                              uint32_t &depth)
+{
+    static const uint8_t s_png_sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    static const uint8_t s_channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    uint8_t bit_depth, color_type, interlace;
+    uint8_t palette[256 * 4];
+    uint32_t palette_size = 0, num_trns = 0, file_chans, bpp;
+    std::vector<uint8_t> idat, raw, pix;
+    const uint8_t *stripe_index = NULL;
+    uint32_t stripe_index_len = 0;
+    size_t ofs, stride, raw_len;
+    bool seen_iend = false;
+
+    if ((size < 8 + 25) || memcmp(p, s_png_sig, 8) || (read_be32(p + 8) != 13) || memcmp(p + 12, "IHDR", 4))
+        return PNG_DECODE_FAILED_NOT_PNG;
+
+    width = read_be32(p + 16);
+    height = read_be32(p + 20);
+    bit_depth = p[24];
+    color_type = p[25];
+    interlace = p[28];
+
+    if (!width || !height || (color_type > 6) || !s_channels[color_type] || p[26] || p[27] || (interlace > 1))
+        return PNG_DECODE_FAILED_NOT_PNG;
+    if (!png_depth_supported(color_type, bit_depth) || interlace)
+        return PNG_DECODE_FAILED_UNSUPPORTED;
+
+    /* Palette indices and gray samples of less than 8 bits are packed, leftmost pixel in the high-order bits */
+    file_chans = s_channels[color_type];
+    stride = ((size_t)width * file_chans * bit_depth + 7) / 8;
+    if (((uint64_t)width * height * 4 * ((bit_depth == 16) ? 2 : 1) > ((uint64_t)1 << 40)) || ((sizeof(size_t) == sizeof(uint32_t)) && ((uint64_t)(stride + 1) * height >= 0x80000000)))
+        return PNG_DECODE_FAILED_DIMENSIONS_TOO_LARGE;
+
+    /* Walk chunks; IDAT payloads (imwrite splits them into 8 KB pieces) are gathered into one stream */
+    for (ofs = 8; ofs + 12 <= size; ) {
+        uint32_t len = read_be32(p + ofs);
+        const uint8_t *type = p + ofs + 4, *data = p + ofs + 8;
+
+        if ((len > 0x7FFFFFFF) || (ofs + 12 + (size_t)len > size))
+            return PNG_DECODE_FAILED_CHUNK_PARSING;
+
+        if (!memcmp(type, "IDAT", 4)) {
+            idat.insert(idat.end(), data, data + len);
+        }
+        else {
+            if (fpng::fpng_crc32(type, 4 + (size_t)len) != read_be32(data + len))
+                return PNG_DECODE_FAILED_HEADER_CRC32;
+
+            if (!memcmp(type, "PLTE", 4)) {
+                if ((len % 3) || (len > 768))
+                    return PNG_DECODE_FAILED_CHUNK_PARSING;
+                palette_size = len / 3;
+                for (uint32_t i = 0; i < palette_size; i++) {
+                    palette[i * 4 + 0] = data[i * 3 + 0];
+                    palette[i * 4 + 1] = data[i * 3 + 1];
+                    palette[i * 4 + 2] = data[i * 3 + 2];
+                    palette[i * 4 + 3] = 255;
+                }
+            }
+            else if (!memcmp(type, "tRNS", 4) && (color_type == 3)) {
+                num_trns = (len < palette_size) ? len : palette_size;
+                for (uint32_t i = 0; i < num_trns; i++)
+                    palette[i * 4 + 3] = data[i];
+            }
+            else if (!memcmp(type, "spIX", 4)) {
+                stripe_index = data;
+                stripe_index_len = len;
+            }
+            else if (!memcmp(type, "IEND", 4)) {
+                seen_iend = true;
+                break;
+            }
+            else if (!(type[0] & 32) && memcmp(type, "IHDR", 4)) {
+                /* Unknown critical chunk */
+                return PNG_DECODE_FAILED_UNSUPPORTED;
+            }
+        }
+
+        ofs += 12 + (size_t)len;
+    }
+
+    if (!seen_iend || idat.empty() || ((color_type == 3) && !palette_size))
+        return PNG_DECODE_FAILED_CHUNK_PARSING;
+
+    raw_len = (stride + 1) * height;
+    raw.resize(raw_len);
+    bpp = (bit_depth == 16) ? file_chans * 2 : file_chans;
+
+    if (stripe_index && (height > 1)) {
+        /* Parallel stripes, unfiltered into a separate buffer */
+        pix.resize(stride * height);
+        if (decode_stripes(stripe_index, stripe_index_len, idat, raw.data(), pix.data(), stride, height, bpp))
+            raw.swap(pix);
+        else
+            stripe_index = NULL;
+        std::vector<uint8_t>().swap(pix);
+    }
+    else {
+        stripe_index = NULL;
+    }
+
+    if (!stripe_index) {
+        if (!zlib_inflate(idat.data(), idat.size(), raw.data(), raw_len))
+            return PNG_DECODE_FAILED_INFLATE;
+        if (!png_unfilter(raw.data(), raw.data(), stride, height, bpp, NULL))
+            return PNG_DECODE_FAILED_FILTER;
+    }
+    std::vector<uint8_t>().swap(idat);
+
+    if (color_type == 3) {
+        /* Expand palette indices */
+        uint32_t shift = 8 - bit_depth, mask = (1u << bit_depth) - 1, x, y;
+        channels = num_trns ? 4 : 3;
+        out.resize((size_t)width * height * channels);
+        for (y = 0; y < height; y++) {
+            const uint8_t *row = raw.data() + (size_t)y * stride;
+            uint8_t *dst = &out[(size_t)y * width * channels];
+            for (x = 0; x < width; x++, dst += channels) {
+                size_t bit = (size_t)x * bit_depth;
+                uint8_t idx = (uint8_t)((row[bit >> 3] >> (shift - (bit & 7))) & mask);
+                if (idx >= palette_size)
+                    idx = 0;
+                memcpy(dst, palette + idx * 4, channels);
+            }
+        }
+    }
+    else if (bit_depth < 8) {
+        /* Expand gray samples to 8 bits, 1 to 255 for masks */
+        uint32_t shift = 8 - bit_depth, mask = (1u << bit_depth) - 1, scale = 255 / mask, x, y;
+        channels = 1;
+        out.resize((size_t)width * height);
+        for (y = 0; y < height; y++) {
+            const uint8_t *row = raw.data() + (size_t)y * stride;
+            uint8_t *dst = &out[(size_t)y * width];
+            for (x = 0; x < width; x++) {
+                size_t bit = (size_t)x * bit_depth;
+                dst[x] = (uint8_t)(((row[bit >> 3] >> (shift - (bit & 7))) & mask) * scale);
+            }
+        }
+    }
+    else {
+        /* 8 and 16-bit samples are returned as stored, 16-bit ones big-endian */
+        channels = file_chans;
+        depth = (bit_depth == 16) ? 16 : 8;
+        raw.resize(stride * height);
+        out.swap(raw);
+    }
+
+    return PNG_DECODE_SUCCESS;
+}
+
+int png_parse_header(const uint8_t *p, size_t size, png_header &hdr, size_t *more_len)
+{
+    static const uint8_t s_png_sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    static const uint8_t s_channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+    uint32_t palette_size = 0;
+    bool has_trns = false;
+    size_t ofs;
+
+    if (more_len)
+        *more_len = 0;
+
+    if (size < 8 + 25) {
+        if (more_len) *more_len = 8 + 25;
+        return PNG_DECODE_FAILED_CHUNK_PARSING;
+    }
+    if (memcmp(p, s_png_sig, 8) || (read_be32(p + 8) != 13) || memcmp(p + 12, "IHDR", 4))
+        return PNG_DECODE_FAILED_NOT_PNG;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.width = read_be32(p + 16);
+    hdr.height = read_be32(p + 20);
+    hdr.bit_depth = p[24];
+    hdr.color_type = p[25];
+    hdr.interlace = p[28];
+
+    if (!hdr.width || !hdr.height || (hdr.color_type > 6) || !s_channels[hdr.color_type] || p[26] || p[27] || (hdr.interlace > 1))
+        return PNG_DECODE_FAILED_NOT_PNG;
+
+    /* Palette images expand to RGBA only when a non-empty tRNS follows PLTE */
+    for (ofs = 8 + 25; ; ) {
+        uint32_t len;
+        const uint8_t *type;
+
+        if (ofs + 8 > size) {
+            if (more_len) *more_len = ofs + 8;
+            return PNG_DECODE_FAILED_CHUNK_PARSING;
+        }
+        len = read_be32(p + ofs);
+        type = p + ofs + 4;
+        if (len > 0x7FFFFFFF)
+            return PNG_DECODE_FAILED_CHUNK_PARSING;
+
+        if (!memcmp(type, "IDAT", 4) || !memcmp(type, "IEND", 4))
+            break;
+        if (!memcmp(type, "PLTE", 4)) {
+            palette_size = len / 3;
+        }
+        else if (!memcmp(type, "tRNS", 4)) {
+            has_trns = (len > 0) && (palette_size > 0);
+        }
+        else if (!memcmp(type, "pHYs", 4) || !memcmp(type, "fdEC", 4) || !memcmp(type, "spIX", 4)) {
+            const uint8_t *data = p + ofs + 8;
+            size_t need = ofs + 8 + ((len < 9) ? len : 9);
+            if (need > size) {
+                if (more_len) *more_len = need;
+                return PNG_DECODE_FAILED_CHUNK_PARSING;
+            }
+            if ((type[0] == 'p') && (len == 9)) {
+                hdr.has_phys = true;
+                hdr.phys_x = read_be32(data);
+                hdr.phys_y = read_be32(data + 4);
+                hdr.phys_unit = data[8];
+            }
+            else if (type[0] == 'f') {
+                /* Same signature check as fpng_get_info() */
+                hdr.fpng = (len == 5) && (data[0] == 82) && (data[1] == 36) && (data[2] == 147) && (data[3] == 227) && (data[4] == FDEC_VERSION);
+            }
+            else if (type[0] == 's') {
+                hdr.striped = (len >= 5) && (data[0] == 0);
+            }
+        }
+
+        ofs += 12 + (size_t)len;
+    }
+
+    hdr.channels = (hdr.color_type == 3) ? (has_trns ? 4 : 3) : s_channels[hdr.color_type];
+
+    if (!png_depth_supported(hdr.color_type, hdr.bit_depth) || hdr.interlace)
+        return PNG_DECODE_FAILED_UNSUPPORTED;
+    return PNG_DECODE_SUCCESS;
+}
+
+int png_decode_memory(const void *pImage, size_t image_size, std::vector<uint8_t> &out, uint32_t &width, uint32_t &height, uint32_t &channels,
+                      uint32_t &bit_depth)
+{
+    int status = fpng::FPNG_DECODE_NOT_FPNG;
+
+    out.resize(0);
+    width = height = channels = 0;
+    bit_depth = 8;
+
+    /* fpng's decoder is limited to 32-bit file sizes; larger files go straight to the general path */
+    if (image_size <= UINT32_MAX) {
+        status = fpng::fpng_get_info(pImage, (uint32_t)image_size, width, height, channels);
+        if (status == fpng::FPNG_DECODE_SUCCESS)
+            status = fpng::fpng_decode_memory(pImage, (uint32_t)image_size, out, width, height, channels, channels);
+        if (status == fpng::FPNG_DECODE_SUCCESS)
+            return PNG_DECODE_SUCCESS;
+    }
+
+    return png_decode_generic((const uint8_t*)pImage, image_size, out, width, height, channels, bit_depth);
+}
+
+const char* png_decode_status_string(int status)
+{
+    switch (status) {
+    case PNG_DECODE_SUCCESS:                        return "Success.";
+    case PNG_DECODE_FAILED_NOT_PNG:                 return "File is not a PNG file.";
+    case PNG_DECODE_FAILED_HEADER_CRC32:            return "Chunk CRC check failed, file is likely corrupted.";
+    case PNG_DECODE_FAILED_CHUNK_PARSING:           return "Failed parsing PNG chunks, file is likely corrupted.";
+    case PNG_DECODE_FAILED_UNSUPPORTED:             return "Interlaced PNG files and 16-bit palette images are not supported.";
+    case PNG_DECODE_FAILED_DIMENSIONS_TOO_LARGE:    return "Image dimensions are too large.";
+    case PNG_DECODE_FAILED_INFLATE:                 return "Corrupt compressed image data.";
+    case PNG_DECODE_FAILED_FILTER:                  return "Invalid scanline filter type.";
+    }
+    return "Unknown error.";
+}
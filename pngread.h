@@ -0,0 +1,63 @@
+// General purpose PNG reader used when a file was not written by fpng.
+// Handles non-interlaced 8 and 16-bit grayscale, gray+alpha, RGB, RGBA, 1/2/4-bit grayscale and 1/2/4/8-bit
+// palette images with all five scanline filters. The zlib stream is decoded by a small table driven inflate.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+enum
+{
+    PNG_DECODE_SUCCESS = 0,
+    PNG_DECODE_FAILED_NOT_PNG,          // missing signature or IHDR
+    PNG_DECODE_FAILED_HEADER_CRC32,     // a chunk CRC-32 check failed
+    PNG_DECODE_FAILED_CHUNK_PARSING,    // truncated or malformed chunk sequence
+    PNG_DECODE_FAILED_UNSUPPORTED,      // valid PNG, but interlaced or an unsupported bit depth
+    PNG_DECODE_FAILED_DIMENSIONS_TOO_LARGE,
+    PNG_DECODE_FAILED_INFLATE,          // corrupt zlib stream or Adler-32 mismatch
+    PNG_DECODE_FAILED_FILTER            // invalid scanline filter type
+};
+
+/* Inflate a raw Deflate stream into dst. Decoding stops after the final block, or at a block boundary where
+ * both the input is used up and dst_len bytes have been produced (a stripe ending in a sync flush). Returns
+ * true on success; *src_used and *dst_written receive the number of bytes consumed/produced. */
+bool png_inflate_raw(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_len, size_t *src_used, size_t *dst_written);
+
+/* Undo scanline filtering. raw holds h rows of (1 + stride) bytes, pix receives h rows of stride bytes and
+ * may equal raw to unfilter in place. bpp is the filter byte distance (bytes per complete pixel, at least 1).
+ * prev is the unfiltered row above the first one, or NULL at the top of the image (or of a stripe). */
+bool png_unfilter(const uint8_t *raw, uint8_t *pix, size_t stride, uint32_t h, uint32_t bpp, const uint8_t *prev);
+
+/* Decode a PNG held in memory into row-major interleaved pixels of 8 or 16 bits.
+ * Files written by fpng take the fpng_decode_memory() fast path, everything else is decoded by the
+ * general reader, one thread per stripe when the file has a savepng stripe index. Palette images are expanded to RGB, or RGBA when a tRNS chunk is present.
+ * channels receives 1 (gray), 2 (gray+alpha), 3 (RGB) or 4 (RGBA).
+ * bit_depth receives 16 for 16-bit files, whose samples are left big-endian (2 bytes each, high byte first),
+ * and 8 for all others; 1, 2 and 4-bit gray samples are scaled to 8 bits.
+ * Returns PNG_DECODE_SUCCESS or one of the failure codes above. */
+int png_decode_memory(const void *pImage, size_t image_size, std::vector<uint8_t> &out, uint32_t &width, uint32_t &height, uint32_t &channels,
+                      uint32_t &bit_depth);
+
+/* Image properties known before the pixel data is decoded */
+typedef struct
+{
+    uint32_t width, height;
+    uint32_t channels;      // channels png_decode_memory() returns for this file
+    uint8_t bit_depth, color_type, interlace;
+    bool fpng;              // fdEC chunk present: written by fpng, decoded by its fast path
+    bool striped;           // spIX stripe index present: decoded one stripe per thread
+    bool has_phys;          // pHYs chunk present
+    uint8_t phys_unit;      // pHYs: 1 for pixels per meter, 0 for aspect ratio only
+    uint32_t phys_x, phys_y;
+} png_header;
+
+/* Read the image properties from the chunks preceding the first IDAT. p may hold just the leading bytes of
+ * the file; when they end before the first IDAT chunk header, PNG_DECODE_FAILED_CHUNK_PARSING is returned
+ * and *more_len (if not NULL) receives a larger prefix length to retry with, or 0 if the file is
+ * truncated. Chunk CRCs are not checked. The chunks before IDAT are walked by their lengths, only the
+ * small ones inspected here (PLTE, tRNS, pHYs, fdEC, spIX header) need their data within p. */
+int png_parse_header(const uint8_t *p, size_t size, png_header &hdr, size_t *more_len);
+
+/* Human readable description of a png_decode_memory() status code */
+const char* png_decode_status_string(int status);
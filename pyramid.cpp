@@ -0,0 +1,83 @@
+// Image pyramid support for savepng: thumbnails and Deep Zoom tile levels.
+//
+// Each level is the one before it halved with a 2x2 box filter, which for even sizes is the mean of the
+// 2^k by 2^k block of the image. Planes stay column-major, so a block's two rows are adjacent bytes of
+// two neighbouring columns. The SSE kernel loads 32 rows of both columns, sums adjacent byte pairs to
+// words with pmaddubsw against a vector of ones, adds the two columns, rounds and shifts, and packs the
+// 16 means of a column of the result back to bytes. A logical plane is negated on load, turning 1
+// into 255, as in the transpose kernels.
+//
+#include "pyramid.h"
+#include "fpng.h"
+
+#ifndef FPNG_NO_SSE
+    #define FPNG_NO_SSE (0)
+#endif
+
+#if (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)) && !FPNG_NO_SSE
+    #define PYRAMID_SSE (1)
+    #include <emmintrin.h>      // SSE2
+    #include <tmmintrin.h>      // SSSE3
+#else
+    #define PYRAMID_SSE (0)
+#endif
+
+/* Scalar halving of output rows [y0,oh) of output column x, from source columns a and b */
+template <typename T>
+static void halve_column_scalar(const T *a, const T *b, uint32_t h, uint32_t y0, uint32_t scale, T *dst)
+{
+    uint32_t oh = halved_size(h), y;
+
+    for (y = y0; y < oh; y++) {
+        uint32_t y1 = (2*y + 1 < h) ? 2*y + 1 : 2*y;
+        uint32_t sum = ((uint32_t)a[2*y] + a[y1] + b[2*y] + b[y1]) * scale;
+        dst[y] = (T)((sum + 2) >> 2);
+    }
+}
+
+void halve_plane(const uint8_t *src, uint32_t h, uint32_t w, bool logical, uint8_t *dst)
+{
+    uint32_t oh = halved_size(h), ow = halved_size(w), x;
+
+    for (x = 0; x < ow; x++) {
+        const uint8_t *a = src + (size_t)(2*x)*h;
+        const uint8_t *b = (2*x + 1 < w) ? a + h : a;
+        uint8_t *d = dst + (size_t)x*oh;
+        uint32_t y = 0;
+#if PYRAMID_SSE
+        if (fpng::fpng_cpu_supports_sse41()) {
+            const __m128i ones = _mm_set1_epi8(1), round = _mm_set1_epi16(2), zero = _mm_setzero_si128();
+            for (; 2*y + 32 <= h; y += 16) {
+                __m128i a0 = _mm_loadu_si128((const __m128i *)(a + 2*y));
+                __m128i a1 = _mm_loadu_si128((const __m128i *)(a + 2*y + 16));
+                __m128i b0 = _mm_loadu_si128((const __m128i *)(b + 2*y));
+                __m128i b1 = _mm_loadu_si128((const __m128i *)(b + 2*y + 16));
+                __m128i s0, s1;
+                if (logical) {
+                    a0 = _mm_sub_epi8(zero, a0);
+                    a1 = _mm_sub_epi8(zero, a1);
+                    b0 = _mm_sub_epi8(zero, b0);
+                    b1 = _mm_sub_epi8(zero, b1);
+                }
+                s0 = _mm_add_epi16(_mm_maddubs_epi16(a0, ones), _mm_maddubs_epi16(b0, ones));
+                s1 = _mm_add_epi16(_mm_maddubs_epi16(a1, ones), _mm_maddubs_epi16(b1, ones));
+                s0 = _mm_srli_epi16(_mm_add_epi16(s0, round), 2);
+                s1 = _mm_srli_epi16(_mm_add_epi16(s1, round), 2);
+                _mm_storeu_si128((__m128i *)(d + y), _mm_packus_epi16(s0, s1));
+            }
+        }
+#endif
+        halve_column_scalar(a, b, h, y, logical ? 255 : 1, d);
+    }
+}
+
+void halve_plane16(const uint16_t *src, uint32_t h, uint32_t w, uint16_t *dst)
+{
+    uint32_t oh = halved_size(h), ow = halved_size(w), x;
+
+    for (x = 0; x < ow; x++) {
+        const uint16_t *a = src + (size_t)(2*x)*h;
+        const uint16_t *b = (2*x + 1 < w) ? a + h : a;
+        halve_column_scalar(a, b, h, 0, 1, dst + (size_t)x*oh);
+    }
+}
@@ -0,0 +1,21 @@
+// Downscaled copies of MATLAB images for savepng: halving planes by averaging 2x2 blocks, the step of
+// each level of a thumbnail or tile pyramid.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Rows or columns of a plane with n of them once halved; an odd last one stays on its own */
+inline uint32_t halved_size(uint32_t n)
+{
+    return (n + 1) / 2;
+}
+
+/* Halve a plane of h*w bytes, element (y,x) at src[x*h + y], into halved_size(h) by halved_size(w) bytes
+ * at dst, each the rounded mean of a 2x2 block. The odd last row or column (if any) is averaged with
+ * itself, so its pixels take the mean of the samples there are. logical: src holds 0 or 1 (a MATLAB
+ * logical matrix), taken as 0 and 255. */
+void halve_plane(const uint8_t *src, uint32_t h, uint32_t w, bool logical, uint8_t *dst);
+
+/* The same for a plane of 16-bit samples */
+void halve_plane16(const uint16_t *src, uint32_t h, uint32_t w, uint16_t *dst);
@@ -0,0 +1,635 @@
+// Lossy palette quantization for savepng.
+//
+// The palette is built from a histogram of a sample of the pixels with the low bits of each channel
+// dropped, so it stays at a few tens of thousands of entries whatever the image size; each entry keeps
+// the exact sum of the colours that fell into it. Median cut splits the box with the largest squared
+// error at the weighted median of its widest channel until there are enough boxes, then a few k-means
+// passes over the histogram move every entry to the mean of the colours nearest to it.
+//
+// Mapping looks for the entry at the smallest squared distance. Colours already seen are found in a small
+// direct-mapped cache, which catches nearly every pixel of a plot. Otherwise the colour's cell in a coarse
+// grid (16 levels of R, G and B, 8 of alpha) lists the few entries that can be nearest to anything in the
+// cell, so only those are compared. The lists are built when a cell is first used: the SSE pass keeps the
+// palette as interleaved 16-bit R,G and B,A pairs, so two pmaddwd give the smallest and largest distances
+// from four entries to the cell at once, and an entry is a candidate when its smallest distance does not
+// exceed the smallest largest distance of any entry. With dithering the error of each pixel is spread
+// to its neighbours (7/16 to the right, 3/16, 5/16 and 1/16 on the next row) before they are mapped.
+// Rows are mapped in bands on parallel threads, and the error diffusion restarts at the top of each band.
+//
+#include "quantize.h"
+#include "imgtranspose.h"
+#include "fpng.h"
+
+#include <string.h>
+#include <limits.h>
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+#ifndef FPNG_NO_SSE
+    #define FPNG_NO_SSE (0)
+#endif
+
+#if (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)) && !FPNG_NO_SSE
+    #define QUANTIZE_SSE (1)
+    #include <emmintrin.h>      // SSE2
+    #include <tmmintrin.h>      // SSSE3
+    #include <smmintrin.h>      // SSE4.1
+#else
+    #define QUANTIZE_SSE (0)
+#endif
+
+/* Rows interleaved at a time when mapping */
+#define QUANT_BAND_ROWS 16
+
+/* Entries of the nearest colour cache, a power of two */
+#define QUANT_CACHE_BITS 12
+
+/* Cells of the candidate grid: 16 levels of R, G and B by 8 of alpha */
+#define QUANT_GRID_CELLS (16 * 16 * 16 * 8)
+
+/* Fewest rows handed to a mapping thread */
+#define QUANT_MIN_THREAD_ROWS 64
+
+/* Coordinate of the padding entries: far from every colour, yet four squared differences fit in 31 bits */
+#define QUANT_FAR 16383
+
+/* int16 values per group of 4 candidates: R,G and B,A interleaved as in image_quantizer, then the 4 indices */
+#define QUANT_GROUP_LEN 20
+
+/* Sampling step for each speed setting; odd so the samples do not keep to the same rows */
+static const uint32_t s_sample_step[QUANTIZE_SPEED_MAX] = { 1, 1, 1, 3, 3, 3, 7, 7, 7, 13 };
+
+typedef struct {
+    uint32_t key;           /* reduced colour + 1, 0 for an empty slot */
+    uint32_t count;
+    uint64_t sum[4];        /* exact channel sums of the colours counted */
+} hist_entry;
+
+typedef struct {
+    std::vector<hist_entry> slots;
+    size_t used;
+} color_histogram;
+
+typedef struct {
+    float mean[4];
+    float weight;
+} color_point;
+
+typedef struct {
+    uint32_t begin, end;    /* range of points */
+    double err;             /* weighted squared error about the mean */
+    uint32_t axis;          /* channel with the largest variance */
+} color_box;
+
+/* Nearest colour search state, one per thread: a direct-mapped cache of exact colours in front of a grid
+ * whose cells list the only palette entries that can be nearest to a colour inside them */
+typedef struct {
+    uint32_t key[1 << QUANT_CACHE_BITS];
+    uint16_t idx[1 << QUANT_CACHE_BITS];    /* palette index + 1, 0 for an empty entry */
+    std::vector<int32_t> cell;              /* offset of each cell's list in cand, -1 until first needed */
+    std::vector<int16_t> cand;              /* group count followed by the groups of candidates, per cell */
+} nearest_search;
+
+static void nearest_search_init(nearest_search *s)
+{
+    memset(s->idx, 0, sizeof(s->idx));
+    s->cell.assign(QUANT_GRID_CELLS, -1);
+    s->cand.clear();
+}
+
+static inline uint32_t hist_hash(uint32_t key, size_t mask)
+{
+    return (uint32_t)((key * 0x9E3779B1u) & mask);
+}
+
+static void hist_insert(color_histogram *hist, uint32_t key, const uint8_t *px, uint32_t nchan, uint32_t count)
+{
+    size_t mask = hist->slots.size() - 1, i = hist_hash(key, mask);
+    hist_entry *e;
+    uint32_t c;
+
+    while (hist->slots[i].key && (hist->slots[i].key != key))
+        i = (i + 1) & mask;
+    e = &hist->slots[i];
+    if (!e->key) {
+        e->key = key;
+        hist->used++;
+    }
+    e->count += count;
+    for (c = 0; c < nchan; c++)
+        e->sum[c] += (uint64_t)px[c] * count;
+}
+
+/* Double the table once it is half full */
+static void hist_grow(color_histogram *hist)
+{
+    std::vector<hist_entry> old;
+    size_t i, mask;
+
+    old.swap(hist->slots);
+    hist->slots.assign(old.size() * 2, hist_entry());
+    mask = hist->slots.size() - 1;
+    for (i = 0; i < old.size(); i++) {
+        size_t j;
+        if (!old[i].key)
+            continue;
+        j = hist_hash(old[i].key, mask);
+        while (hist->slots[j].key)
+            j = (j + 1) & mask;
+        hist->slots[j] = old[i];
+    }
+}
+
+/* Weighted mean and squared error of a box, and the channel to split it along */
+static void box_measure(const color_point *pts, uint32_t nchan, color_box *b)
+{
+    double w = 0, s[4] = { 0 }, s2[4] = { 0 }, best = -1;
+    uint32_t i, c;
+
+    for (i = b->begin; i < b->end; i++) {
+        w += pts[i].weight;
+        for (c = 0; c < nchan; c++) {
+            s[c] += pts[i].weight * pts[i].mean[c];
+            s2[c] += pts[i].weight * pts[i].mean[c] * pts[i].mean[c];
+        }
+    }
+    b->err = 0;
+    b->axis = 0;
+    for (c = 0; c < nchan; c++) {
+        double var = s2[c] - s[c] * s[c] / w;
+        b->err += var;
+        if (var > best) {
+            best = var;
+            b->axis = c;
+        }
+    }
+    if (b->end - b->begin < 2)
+        b->err = 0;
+}
+
+static void box_mean(const color_point *pts, uint32_t nchan, const color_box *b, float *mean)
+{
+    double w = 0, s[4] = { 0 };
+    uint32_t i, c;
+
+    for (i = b->begin; i < b->end; i++) {
+        w += pts[i].weight;
+        for (c = 0; c < nchan; c++)
+            s[c] += pts[i].weight * pts[i].mean[c];
+    }
+    for (c = 0; c < nchan; c++)
+        mean[c] = (float)(s[c] / w);
+}
+
+/* Set the palette entries and the interleaved copies the search works on */
+static void quantizer_set_entries(image_quantizer *q, const uint8_t *rgba, uint32_t ncolors)
+{
+    uint32_t i;
+
+    q->pal.ncolors = ncolors;
+    memcpy(q->pal.rgba, rgba, 4 * ncolors);
+    q->nvec = (ncolors + 3) / 4;
+    for (i = 0; i < 4 * q->nvec; i++) {
+        const uint8_t *e = q->pal.rgba + 4 * i;
+        bool pad = (i >= ncolors);
+        q->rg[2*i] = pad ? QUANT_FAR : e[0];
+        q->rg[2*i + 1] = pad ? QUANT_FAR : e[1];
+        q->ba[2*i] = pad ? QUANT_FAR : e[2];
+        q->ba[2*i + 1] = pad ? QUANT_FAR : e[3];
+    }
+}
+
+/* Cell of the candidate grid holding a colour (alpha 255 for RGB) */
+static inline uint32_t grid_cell(const uint8_t *px)
+{
+    return (px[0] >> 4) | ((px[1] >> 4) << 4) | ((px[2] >> 4) << 8) | ((uint32_t)(px[3] >> 5) << 12);
+}
+
+/* List the palette entries that can be nearest to some colour of a cell: those whose smallest distance to
+ * the cell is no more than the smallest largest distance of any entry */
+static void build_cell(const image_quantizer *q, nearest_search *s, uint32_t cell)
+{
+    int32_t lo[4], hi[4], dmin[PALETTE_MAX_COLORS], dmax[PALETTE_MAX_COLORS], m = INT_MAX;
+    uint32_t i, c, n = 0;
+    size_t start;
+
+    for (c = 0; c < 3; c++) {
+        lo[c] = ((cell >> (4*c)) & 15) << 4;
+        hi[c] = lo[c] + 15;
+    }
+    lo[3] = (cell >> 12) << 5;
+    hi[3] = lo[3] + 31;
+    if (q->pal.nchan == 3)
+        lo[3] = hi[3] = 255;
+
+#if QUANTIZE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        const __m128i lo_rg = _mm_set1_epi32(lo[0] | (lo[1] << 16)), hi_rg = _mm_set1_epi32(hi[0] | (hi[1] << 16));
+        const __m128i lo_ba = _mm_set1_epi32(lo[2] | (lo[3] << 16)), hi_ba = _mm_set1_epi32(hi[2] | (hi[3] << 16));
+        const __m128i zero = _mm_setzero_si128();
+        uint32_t v;
+
+        for (v = 0; v < q->nvec; v++) {
+            __m128i rg = _mm_loadu_si128((const __m128i*)(q->rg + 8*v)), ba = _mm_loadu_si128((const __m128i*)(q->ba + 8*v));
+            __m128i below_rg = _mm_sub_epi16(lo_rg, rg), above_rg = _mm_sub_epi16(rg, hi_rg);
+            __m128i below_ba = _mm_sub_epi16(lo_ba, ba), above_ba = _mm_sub_epi16(ba, hi_ba);
+            __m128i in_rg = _mm_max_epi16(_mm_max_epi16(below_rg, above_rg), zero);
+            __m128i in_ba = _mm_max_epi16(_mm_max_epi16(below_ba, above_ba), zero);
+            __m128i out_rg = _mm_max_epi16(_mm_abs_epi16(below_rg), _mm_abs_epi16(above_rg));
+            __m128i out_ba = _mm_max_epi16(_mm_abs_epi16(below_ba), _mm_abs_epi16(above_ba));
+            _mm_storeu_si128((__m128i*)(dmin + 4*v), _mm_add_epi32(_mm_madd_epi16(in_rg, in_rg), _mm_madd_epi16(in_ba, in_ba)));
+            _mm_storeu_si128((__m128i*)(dmax + 4*v), _mm_add_epi32(_mm_madd_epi16(out_rg, out_rg), _mm_madd_epi16(out_ba, out_ba)));
+        }
+    }
+    else
+#endif
+    {
+        for (i = 0; i < q->pal.ncolors; i++) {
+            const uint8_t *e = q->pal.rgba + 4 * i;
+            dmin[i] = dmax[i] = 0;
+            for (c = 0; c < 4; c++) {
+                int32_t below = lo[c] - e[c], above = e[c] - hi[c];
+                int32_t in = (below > 0) ? below : (above > 0) ? above : 0;
+                int32_t out = (e[c] - lo[c] > hi[c] - e[c]) ? e[c] - lo[c] : hi[c] - e[c];
+                dmin[i] += in * in;
+                dmax[i] += out * out;
+            }
+        }
+    }
+
+    for (i = 0; i < q->pal.ncolors; i++)
+        if (dmax[i] < m)
+            m = dmax[i];
+
+    /* The candidates' indices take the place of dmin as it is read */
+    for (i = 0; i < q->pal.ncolors; i++)
+        if (dmin[i] <= m)
+            dmin[n++] = (int32_t)i;
+
+    /* The last group is padded with far away entries, carrying the last candidate's index */
+    start = s->cand.size();
+    s->cand.resize(start + 1 + QUANT_GROUP_LEN * ((n + 3) / 4));
+    s->cand[start] = (int16_t)((n + 3) / 4);
+    for (i = 0; i < 4 * ((n + 3) / 4); i++) {
+        int16_t *g = s->cand.data() + start + 1 + QUANT_GROUP_LEN * (i / 4);
+        uint32_t e = (uint32_t)dmin[(i < n) ? i : n - 1], l = i & 3;
+        for (c = 0; c < 2; c++) {
+            g[2*l + c] = (i < n) ? q->rg[2*e + c] : QUANT_FAR;
+            g[8 + 2*l + c] = (i < n) ? q->ba[2*e + c] : QUANT_FAR;
+        }
+        g[16 + l] = (int16_t)e;
+    }
+    s->cell[cell] = (int32_t)start;
+}
+
+/* Palette index nearest to a colour (alpha 255 for RGB), the lowest one among equally near entries */
+static uint32_t nearest(const image_quantizer *q, nearest_search *s, const uint8_t *px)
+{
+    uint32_t key = px[0] | (px[1] << 8) | (px[2] << 16) | ((uint32_t)px[3] << 24);
+    uint32_t h = (key * 0x9E3779B1u) >> (32 - QUANT_CACHE_BITS), cell = grid_cell(px), i, l, n, best_idx = 0;
+    const int16_t *g;
+    int32_t best = INT_MAX;
+
+    if (s->idx[h] && (s->key[h] == key))
+        return s->idx[h] - 1;
+
+    if (s->cell[cell] < 0)
+        build_cell(q, s, cell);
+    g = s->cand.data() + s->cell[cell];
+    n = (uint16_t)*g++;
+
+#if QUANTIZE_SSE
+    if (fpng::fpng_cpu_supports_sse41()) {
+        /* Four candidates per pmaddwd pair; each lane keeps its first nearest, so its lowest index */
+        const __m128i p_rg = _mm_set1_epi32(px[0] | (px[1] << 16)), p_ba = _mm_set1_epi32(px[2] | (px[3] << 16));
+        __m128i best_d = _mm_set1_epi32(INT_MAX), best_i = _mm_setzero_si128();
+        int32_t d[4], e[4];
+
+        for (i = 0; i < n; i++, g += QUANT_GROUP_LEN) {
+            __m128i rg = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)g), p_rg);
+            __m128i ba = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(g + 8)), p_ba);
+            __m128i dist = _mm_add_epi32(_mm_madd_epi16(rg, rg), _mm_madd_epi16(ba, ba));
+            __m128i nearer = _mm_cmplt_epi32(dist, best_d);
+            best_d = _mm_min_epi32(dist, best_d);
+            best_i = _mm_blendv_epi8(best_i, _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(g + 16))), nearer);
+        }
+        _mm_storeu_si128((__m128i*)d, best_d);
+        _mm_storeu_si128((__m128i*)e, best_i);
+        for (l = 0; l < 4; l++) {
+            if ((d[l] < best) || ((d[l] == best) && ((uint32_t)e[l] < best_idx))) {
+                best = d[l];
+                best_idx = (uint32_t)e[l];
+            }
+        }
+    }
+    else
+#endif
+    {
+        for (i = 0; i < n; i++, g += QUANT_GROUP_LEN) {
+            for (l = 0; l < 4; l++) {
+                int32_t d0 = g[2*l] - px[0], d1 = g[2*l + 1] - px[1], d2 = g[8 + 2*l] - px[2], d3 = g[9 + 2*l] - px[3];
+                int32_t d = d0*d0 + d1*d1 + d2*d2 + d3*d3;
+                if (d < best) {
+                    best = d;
+                    best_idx = (uint16_t)g[16 + l];
+                }
+            }
+        }
+    }
+
+    s->key[h] = key;
+    s->idx[h] = (uint16_t)(best_idx + 1);
+    return best_idx;
+}
+
+void quantize_palette(const uint8_t *src, const alpha_plane *alpha, uint32_t w, uint32_t h, uint32_t nchan, uint32_t max_colors, uint32_t speed,
+                      bool dither, bool clear_transparent, image_quantizer *q)
+{
+    const size_t n = (size_t)w*h;
+    const uint32_t shift = (speed <= 3) ? 2 : 3;                /* low bits dropped from histogram keys */
+    const uint32_t passes = QUANTIZE_SPEED_MAX - speed;         /* k-means passes */
+    const size_t step = s_sample_step[speed - 1];
+    color_histogram hist;
+    std::vector<color_point> pts;
+    std::vector<color_box> boxes;
+    uint8_t rgba[PALETTE_MAX_COLORS * 4], last[4] = { 0, 0, 0, 255 }, px[4] = { 0, 0, 0, 255 };
+    uint32_t run = 0, c, k, pass;
+    const uint8_t *plane[4];
+    bool mask = false;
+    size_t i;
+
+    memset(q, 0, sizeof(*q));
+    q->pal.nchan = nchan;
+    q->pal.clear_transparent = clear_transparent && (nchan == 4);
+    q->dither = dither;
+
+    for (c = 0; c < nchan; c++)
+        plane[c] = src + c*n;
+    if (alpha && (nchan == 4)) {
+        plane[3] = alpha->data;
+        mask = alpha->logical;
+    }
+
+    /* Histogram of the sampled pixels, runs of one colour added at once */
+    hist.slots.assign(4096, hist_entry());
+    hist.used = 0;
+    for (i = 0; i < n; i += step) {
+        for (c = 0; c < nchan; c++)
+            px[c] = plane[c][i];
+        if (mask)
+            px[3] = (uint8_t)-px[3];   /* logical alpha 1 is 255 */
+        if (q->pal.clear_transparent && !px[3])
+            px[0] = px[1] = px[2] = 0;
+
+        if (run && !memcmp(px, last, 4)) {
+            run++;
+            continue;
+        }
+        if (run) {
+            uint32_t key = 1;
+            for (c = 0; c < nchan; c++)
+                key += (uint32_t)(last[c] >> shift) << (8*c);
+            hist_insert(&hist, key, last, nchan, run);
+            if (2 * hist.used > hist.slots.size())
+                hist_grow(&hist);
+        }
+        memcpy(last, px, 4);
+        run = 1;
+    }
+    if (run) {
+        uint32_t key = 1;
+        for (c = 0; c < nchan; c++)
+            key += (uint32_t)(last[c] >> shift) << (8*c);
+        hist_insert(&hist, key, last, nchan, run);
+    }
+
+    for (i = 0; i < hist.slots.size(); i++) {
+        const hist_entry &e = hist.slots[i];
+        color_point p;
+        if (!e.key)
+            continue;
+        for (c = 0; c < 4; c++)
+            p.mean[c] = (c < nchan) ? (float)e.sum[c] / e.count : 255.0f;
+        p.weight = (float)e.count;
+        pts.push_back(p);
+    }
+
+    /* An empty image still gets one (black) entry */
+    if (pts.empty()) {
+        color_point p = { { 0, 0, 0, 255.0f }, 1.0f };
+        pts.push_back(p);
+    }
+
+    /* Median cut */
+    {
+        color_box b = { 0, (uint32_t)pts.size(), 0, 0 };
+        box_measure(pts.data(), nchan, &b);
+        boxes.push_back(b);
+    }
+    while (boxes.size() < max_colors) {
+        uint32_t worst = 0, split, axis;
+        double half = 0, acc = 0;
+        color_box a, b;
+
+        for (k = 1; k < boxes.size(); k++)
+            if (boxes[k].err > boxes[worst].err)
+                worst = k;
+        if (boxes[worst].err <= 0)
+            break;
+
+        a = boxes[worst];
+        axis = a.axis;
+        std::sort(pts.begin() + a.begin, pts.begin() + a.end,
+                  [axis](const color_point &l, const color_point &r) { return l.mean[axis] < r.mean[axis]; });
+        for (k = a.begin; k < a.end; k++)
+            half += pts[k].weight;
+        half /= 2;
+        for (split = a.begin; split < a.end - 1; split++) {
+            acc += pts[split].weight;
+            if (acc >= half)
+                break;
+        }
+        split = (split + 1 < a.end) ? split + 1 : a.end - 1;
+
+        b = a;
+        a.end = split;
+        b.begin = split;
+        box_measure(pts.data(), nchan, &a);
+        box_measure(pts.data(), nchan, &b);
+        boxes[worst] = a;
+        boxes.push_back(b);
+    }
+
+    for (k = 0; k < boxes.size(); k++) {
+        float mean[4] = { 0, 0, 0, 255.0f };
+        box_mean(pts.data(), nchan, &boxes[k], mean);
+        for (c = 0; c < 4; c++)
+            rgba[4*k + c] = (uint8_t)(mean[c] + 0.5f);
+    }
+    quantizer_set_entries(q, rgba, (uint32_t)boxes.size());
+
+    /* K-means refinement over the histogram */
+    std::vector<nearest_search> search(1);
+    for (pass = 0; pass < passes; pass++) {
+        std::vector<double> sum(4 * q->pal.ncolors, 0.0), weight(q->pal.ncolors, 0.0);
+        bool moved = false;
+
+        nearest_search_init(search.data());
+
+        for (i = 0; i < pts.size(); i++) {
+            uint8_t p[4];
+            for (c = 0; c < 4; c++)
+                p[c] = (uint8_t)(pts[i].mean[c] + 0.5f);
+            k = nearest(q, search.data(), p);
+            weight[k] += pts[i].weight;
+            for (c = 0; c < 4; c++)
+                sum[4*k + c] += pts[i].weight * pts[i].mean[c];
+        }
+        for (k = 0; k < q->pal.ncolors; k++) {
+            if (weight[k] <= 0)
+                continue;
+            for (c = 0; c < 4; c++) {
+                uint8_t v = (uint8_t)(sum[4*k + c] / weight[k] + 0.5);
+                moved |= (v != rgba[4*k + c]);
+                rgba[4*k + c] = v;
+            }
+        }
+        quantizer_set_entries(q, rgba, q->pal.ncolors);
+        if (!moved)
+            break;
+    }
+
+    /* Translucent entries first, so tRNS can stop after the last of them */
+    {
+        uint8_t ordered[PALETTE_MAX_COLORS * 4];
+        uint32_t m = 0;
+        for (pass = 0; pass < 2; pass++) {
+            for (k = 0; k < q->pal.ncolors; k++) {
+                if ((rgba[4*k + 3] < 0xFF) != (pass == 0))
+                    continue;
+                memcpy(ordered + 4*m, rgba + 4*k, 4);
+                m++;
+                if (pass == 0)
+                    q->pal.ntrans = m;
+            }
+        }
+        quantizer_set_entries(q, ordered, m);
+    }
+}
+
+/* Map one row of interleaved pixels to palette indices, diffusing the error into err_cur (this row) and
+ * err_next (the next one) when they are given. Errors are in 1/16ths, pixel x at (x+1)*4. */
+static void map_row(const image_quantizer *q, nearest_search *search, const uint8_t *p, uint32_t w, uint32_t nchan,
+                    int32_t *err_cur, int32_t *err_next, uint8_t *idx)
+{
+    uint8_t px[4] = { 0, 0, 0, 255 };
+    uint32_t x, c;
+
+    for (x = 0; x < w; x++, p += nchan) {
+        int32_t *e, *f;
+        const uint8_t *pe;
+
+        if (!err_cur) {
+            for (c = 0; c < nchan; c++)
+                px[c] = p[c];
+            idx[x] = (uint8_t)nearest(q, search, px);
+            continue;
+        }
+
+        e = err_cur + (x + 1) * 4;
+        f = err_next + x * 4;
+        for (c = 0; c < nchan; c++) {
+            int32_t v = p[c] + e[c] / 16;
+            px[c] = (uint8_t)((v < 0) ? 0 : (v > 255) ? 255 : v);
+        }
+        idx[x] = (uint8_t)nearest(q, search, px);
+
+        pe = q->pal.rgba + 4 * idx[x];
+        for (c = 0; c < nchan; c++) {
+            int32_t d = px[c] - pe[c];
+            e[4 + c] += 7 * d;
+            f[c] += 3 * d;
+            f[4 + c] += 5 * d;
+            f[8 + c] += d;
+        }
+    }
+}
+
+/* Pack 8-bit indices into bits-wide fields, leftmost pixel in the high-order bits */
+static void pack_indices(const uint8_t *idx, uint32_t w, uint32_t bits, uint8_t *dst)
+{
+    uint32_t acc = 0, nbits = 0, x;
+
+    if (bits == 8) {
+        memcpy(dst, idx, w);
+        return;
+    }
+    for (x = 0; x < w; x++) {
+        acc = (acc << bits) | idx[x];
+        nbits += bits;
+        if (nbits == 8) {
+            *dst++ = (uint8_t)acc;
+            acc = nbits = 0;
+        }
+    }
+    if (nbits)
+        *dst = (uint8_t)(acc << (8 - nbits));
+}
+
+void quantize_index_from_planar(const uint8_t *src, const alpha_plane *alpha, uint32_t w, uint32_t h, const image_quantizer *q,
+                                uint32_t y0, uint32_t y1, uint8_t *dst, size_t dst_stride)
+{
+    const uint32_t nchan = q->pal.nchan, bits = palette_index_bits(&q->pal);
+    const size_t row_len = (size_t)w * nchan;
+    std::vector<uint8_t> band(row_len * QUANT_BAND_ROWS), idx(w);
+    std::vector<int32_t> err0, err1;
+    std::vector<nearest_search> search(1);
+    int32_t *cur = NULL, *next = NULL;
+    uint32_t r0, r1, y;
+
+    nearest_search_init(search.data());
+    if (q->dither) {
+        err0.assign((size_t)(w + 2) * 4, 0);
+        err1.assign((size_t)(w + 2) * 4, 0);
+        cur = err0.data();
+        next = err1.data();
+    }
+
+    for (r0 = y0; r0 < y1; r0 = r1) {
+        r1 = (y1 - r0 > QUANT_BAND_ROWS) ? r0 + QUANT_BAND_ROWS : y1;
+        interleave_with_alpha(src, alpha, w, h, nchan, r0, r1, band.data(), row_len, q->pal.clear_transparent);
+
+        for (y = r0; y < r1; y++) {
+            map_row(q, search.data(), band.data() + (y - r0) * row_len, w, nchan, cur, next, idx.data());
+            pack_indices(idx.data(), w, bits, dst + (size_t)(y - y0) * dst_stride);
+            if (cur) {
+                std::swap(cur, next);
+                memset(next, 0, (size_t)(w + 2) * 4 * sizeof(int32_t));
+            }
+        }
+    }
+}
+
+void quantize_index_image(const uint8_t *src, const alpha_plane *alpha, uint32_t w, uint32_t h, const image_quantizer *q,
+                          uint8_t *dst, size_t dst_stride, uint32_t nthreads)
+{
+    std::vector<std::thread> workers;
+    uint32_t t;
+
+    if (!nthreads)
+        nthreads = std::thread::hardware_concurrency();
+    if (nthreads > h / QUANT_MIN_THREAD_ROWS)
+        nthreads = h / QUANT_MIN_THREAD_ROWS;
+    if (nthreads <= 1) {
+        quantize_index_from_planar(src, alpha, w, h, q, 0, h, dst, dst_stride);
+        return;
+    }
+
+    for (t = 0; t < nthreads; t++) {
+        uint32_t y0 = (uint32_t)((uint64_t)h * t / nthreads), y1 = (uint32_t)((uint64_t)h * (t + 1) / nthreads);
+        workers.push_back(std::thread(quantize_index_from_planar, src, alpha, w, h, q, y0, y1, dst + (size_t)y0 * dst_stride, dst_stride));
+    }
+    for (t = 0; t < nthreads; t++)
+        workers[t].join();
+}
@@ -0,0 +1,38 @@
+// Lossy palette quantization for savepng: reducing an RGB or RGBA image of any number of colours to at
+// most 256 and mapping its pixels to the nearest palette entry, optionally with Floyd-Steinberg dithering.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "palette.h"
+
+#define QUANTIZE_SPEED_MIN      1
+#define QUANTIZE_SPEED_MAX      10
+#define QUANTIZE_SPEED_DEFAULT  4
+
+typedef struct {
+    image_palette pal;                      /* entries in PNG order, translucent first; keys unused */
+    bool dither;                            /* Floyd-Steinberg error diffusion when mapping */
+    uint32_t nvec;                          /* groups of 4 entries in rg and ba */
+    int16_t rg[PALETTE_MAX_COLORS * 2];     /* R,G of each entry, interleaved for pmaddwd; padding is far away */
+    int16_t ba[PALETTE_MAX_COLORS * 2];     /* B,A likewise (A is 255 for RGB images) */
+} image_quantizer;
+
+/* Build a palette of at most max_colors (2 to 256) entries for a MATLAB RGB or RGBA uint8 image
+ * src:   nchan planes of h*w bytes, element (y,x) of plane c at src[c*w*h + x*h + y]
+ * alpha: alpha plane of an RGBA image kept apart from src (see interleave_with_alpha()), or NULL
+ * speed: QUANTIZE_SPEED_MIN (best palette) to QUANTIZE_SPEED_MAX (fastest); sets the sampling rate and
+ *        precision of the histogram and the number of k-means passes refining the median cut
+ * clear_transparent: pixels with alpha 0 are taken as all zero, as by interleave_from_planar() */
+void quantize_palette(const uint8_t *src, const alpha_plane *alpha, uint32_t w, uint32_t h, uint32_t nchan, uint32_t max_colors, uint32_t speed,
+                      bool dither, bool clear_transparent, image_quantizer *q);
+
+/* Map rows [y0,y1) of the image to packed indices of palette_index_bits(&q->pal) bits each, leftmost pixel
+ * in the high-order bits of a byte. Row y goes to dst + (y-y0)*dst_stride. Dithering starts afresh at y0. */
+void quantize_index_from_planar(const uint8_t *src, const alpha_plane *alpha, uint32_t w, uint32_t h, const image_quantizer *q,
+                                uint32_t y0, uint32_t y1, uint8_t *dst, size_t dst_stride);
+
+/* Map the whole image on up to nthreads threads (0 for one per core), each taking a band of rows */
+void quantize_index_image(const uint8_t *src, const alpha_plane *alpha, uint32_t w, uint32_t h, const image_quantizer *q,
+                          uint8_t *dst, size_t dst_stride, uint32_t nthreads);
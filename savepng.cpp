@@ -2,7 +2,22 @@
 // %   Very fast PNG image compression routine.
 // %
 // %   Input syntax is:
-// %   savepng(CDATA,filename[,Compression]);
+// %   savepng(CDATA,filename[,Compression[,Resolution]][,Name,Value,...]);
+// %   savepng({CDATA1,CDATA2,...},{filename1,filename2,...}[,...]);
+// %   savepng(Z,map,filename[,Compression[,Resolution]][,Name,Value,...]);
+// %   STATS = savepng(...);
+// %
+// %   CDATA is an MxN (grayscale), MxNx2 (grayscale+alpha), MxNx3 (RGB) or
+// %   MxNx4 (RGBA) matrix of uint8, uint16, single or double. uint16 images
+// %   are saved as 16-bit PNG files. single and double images hold values
+// %   in [0,1] and are saved at 8 bits, scaled as by im2uint8. An MxN
+// %   logical matrix (a mask) is saved as a 1-bit grayscale PNG file.
+// %
+// %   Z is an MxN matrix of uint8, uint16, single or double shown with the
+// %   colormap map (Kx3 of values in [0,1], K at most 256), which is saved
+// %   as an indexed colour image without an RGB copy. Z holds indices into
+// %   map as for image and ind2rgb (1-based for single and double, 0-based
+// %   for integers), or is scaled over CLim as imagesc does.
 // %
 // %   Optional parameters:
 // %       Compression     A number between 0 and 14 controlling the amount of 
@@ -14,6 +29,107 @@
 // %                       being saved. Resolution is expressed in Dots-Per-Inch 
 // %                       (DPI). Default resolution is 96 DPI.
 // %
+// %   Optional name/value pairs (after the positional parameters):
+// %       'SkipUnchanged' When true, a hash of the image data and encoding
+// %                       parameters is embedded in the file. If the existing
+// %                       file already carries the same hash it is left
+// %                       untouched and nothing is encoded. Default is false.
+// %       'Stripes'       Number of row stripes compressed independently, on
+// %                       parallel threads. The file stays a standard PNG and
+// %                       carries a stripe index so loadpng can also decode
+// %                       the stripes in parallel. Costs a little compression.
+// %                       Levels 0-2 are written at level 3 when striped.
+// %                       Default is 1.
+// %       'IO'            How the file is written: 'stdio' (default),
+// %                       'mmap', which maps the output file and compresses
+// %                       straight into it, saving a heap buffer and a copy
+// %                       of the file, 'posix', which preallocates the file
+// %                       and writes it with one writev() call, or 'direct',
+// %                       which also bypasses the page cache (O_DIRECT).
+// %                       Modes not available on a platform fall back to
+// %                       'posix' or 'stdio'.
+// %       'Palette'       When true, RGB and RGBA images of uint8 with at
+// %                       most 256 colours (typical of plots) are saved as
+// %                       indexed colour with 1, 2, 4 or 8-bit indices,
+// %                       which is usually several times smaller and faster
+// %                       to compress. Levels 1-2 use libdeflate level 1 for
+// %                       such images; level 0 never uses a palette.
+// %                       Default is true.
+// %       'Reduce'        When true, images are written in the smallest
+// %                       lossless layout: a fully opaque alpha channel is
+// %                       dropped, RGB(A) with equal channels is written as
+// %                       grayscale(+alpha) and uint16 data holding 8-bit
+// %                       values (multiples of 257) is written at 8 bits.
+// %                       loadpng then returns the reduced channels. Level 0
+// %                       never reduces. Default is true.
+// %       'Alpha'         MxN matrix of uint8 or logical (true is opaque)
+// %                       used as the alpha channel of an MxN or MxNx3 image
+// %                       of uint8, single or double, in place of
+// %                       cat(3,CDATA,A), which copies the whole image. Not
+// %                       for batch saves or colormaps.
+// %       'CleanAlpha'    When true, fully transparent pixels (alpha 0) of
+// %                       grayscale+alpha and RGBA images are written as
+// %                       all zero, whatever their colour. The image looks
+// %                       the same but compresses better; the colour of
+// %                       those pixels is lost. Default is false.
+// %       'Quantize'      Number of colours (2 to 256) to reduce RGB and RGBA
+// %                       uint8 images with more colours to, saving them as
+// %                       indexed colour. Lossy, usually several times
+// %                       smaller. Images with few enough colours keep their
+// %                       exact palette. 0 (default) turns it off; level 0
+// %                       never quantizes.
+// %       'Dither'        When true (default), quantized images are
+// %                       Floyd-Steinberg dithered.
+// %       'QuantizeSpeed' 1 (best palette) to 10 (fastest). Default is 4.
+// %       'MaxError'      Near-lossless mode: uint8 samples written as
+// %                       grayscale or truecolour may differ from the image
+// %                       by up to this many levels (1 to 32), rounded so
+// %                       that the PNG Up filter leaves few distinct values,
+// %                       which compresses much better. Alpha is kept exact
+// %                       and palette images are never rounded. 0 (default)
+// %                       is lossless; level 0 never rounds.
+// %       'CLim'          [lo hi] for Z with a colormap: values from lo to hi
+// %                       are spread evenly over the colormap entries and
+// %                       values outside are clamped, as imagesc(Z,[lo hi]).
+// %       'ROI'           [row col height width] region of the image to save,
+// %                       as CDATA(row:row+height-1,col:col+width-1,:) but
+// %                       without the copy; only the region is read. Also
+// %                       applies to Z and to the Alpha matrix.
+// %       'Step'          Save every Step-th row and column of the image (or
+// %                       of its ROI), starting with the first, as
+// %                       CDATA(1:Step:end,1:Step:end,:). Default is 1.
+// %                       ROI and Step do not apply to batch saves.
+// %       'Thumbnails'    Cell array of file names, each given a copy of the
+// %                       image half the size of the one before (2x, 4x,
+// %                       ...), every pixel the mean of a 2x2 block. They
+// %                       are saved with the same options, on other threads
+// %                       while the image is encoded. Logical masks give
+// %                       grayscale thumbnails. Not for batch saves or
+// %                       colormaps.
+// %       'Tiles'         Tile size: write a Deep Zoom (DZI) tile pyramid
+// %                       instead of a single PNG. filename is the .dzi
+// %                       descriptor; the tiles go to <name>_files/<level>/
+// %                       <column>_<row>.png, each level half the size of
+// %                       the one above, down to 1x1. Not for batch saves,
+// %                       colormaps, Thumbnails or Streaming.
+// %       'TileOverlap'   Pixels shared by neighbouring tiles, at most Tiles.
+// %                       Default is 1.
+// %       'Streaming'     When true, the image is transposed and compressed
+// %                       a band of rows at a time and written out as a
+// %                       series of fixed size IDAT chunks, so memory use
+// %                       stays at a few MB beyond the image itself however
+// %                       large it is. Levels 0-2 use libdeflate level 1;
+// %                       Stripes and IO do not apply. Default is false.
+// %
+// %   STATS is an optional struct (a struct array shaped like the cell of
+// %   images for batch saves, the image followed by its Thumbnails, or one
+// %   element per tile from the top level down with Tiles) with fields
+// %   FileSize, ColorType ('grayscale', 'truecolor', 'indexed',
+// %   'grayscale-alpha' or 'truecolor-alpha'),
+// %   BitDepth, Reduction (comma-separated 'alpha', 'gray', '8bit',
+// %   'quantize' and 'maxerror', or empty) and Skipped, which is true when
+// %   SkipUnchanged left the file untouched; the other fields are then empty.
+// %
 // %   Example 1:
 // %       img     = getframe(gcf);
 // %       savepng(img.cdata,'example.png');
@@ -22,6 +138,17 @@
 // %       img     = getframe(gcf);
 // %       savepng(img.cdata,'exampleHighRes.png',10,300);
 // %
+// %   Batch saves take cell arrays of images and file names. Images are
+// %   encoded on all cores while finished files are written in the
+// %   background (io_uring on Linux, writer threads elsewhere); the IO
+// %   option does not apply to them.
+// %
+// %   Example 3:
+// %       savepng(img.cdata,'figure1.png',4,96,'SkipUnchanged',true);
+// %
+// %   Example 4:
+// %       savepng(frames,compose('frame%05d.png',1:numel(frames)),1);
+// %
 // %   PNG encoding routine based on fpng (levels 0-2) and libdeflate (3-14):
 // %   https://github.com/richgel999/fpng
 // %   https://github.com/ebiggers/libdeflate
@@ -39,17 +166,68 @@
 // %   08/04/2014, Added option to command image resolution in DPI
 // %   11/25/2016, Added support for alpha channel
 // %   11/21/2025, Complete re-write to use fpng and libdeflate for faster compression
+// %   10/18/2026, Added name/value options and SkipUnchanged content hash chunk
+// %   10/18/2026, Added Stripes option for parallel compression and decoding
+// %   10/18/2026, Added IO option with memory-mapped output
+// %   10/18/2026, Added posix and direct IO modes, file write errors are reported
+// %   10/18/2026, Added batch saves with asynchronous (io_uring) file writing
+// %   10/18/2026, Added Streaming option for bounded-memory encoding of large images
+// %   10/18/2026, Full 32-bit image dimensions, IDAT split for streams over 1 GB
+// %   10/18/2026, Added grayscale (MxN) and grayscale+alpha (MxNx2) images
+// %   10/18/2026, Added 16-bit images from uint16 input
+// %   10/18/2026, Automatic palette encoding of images with up to 256 colours
+// %   10/18/2026, Added Reduce option for lossless channel and bit depth reduction, STATS output
+// %   10/18/2026, Added CleanAlpha option to zero the colour of fully transparent pixels
+// %   10/18/2026, Added Quantize, Dither and QuantizeSpeed options for lossy palette images
+// %   10/18/2026, Added MaxError option for near-lossless compression
+// %   10/18/2026, Accept single and double images in [0,1] without conversion
+// %   10/18/2026, Scalar fields saved with a colormap as indexed colour, CLim option
+// %   10/19/2026, Logical masks saved as 1-bit grayscale
+// %   10/19/2026, Added Alpha option for an alpha matrix passed separately
+// %   10/19/2026, Added ROI and Step options for cropped and subsampled saving
+// %   10/19/2026, Added Thumbnails option for downscaled copies saved in the same call
+// %   10/19/2026, Added Tiles and TileOverlap options for Deep Zoom tile pyramids
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <errno.h>
+    #include <sys/mman.h>
+    #include <sys/uio.h>
+    #include <sys/stat.h>
+    #define SAVEPNG_POSIX (1)
+#else
+    #include <direct.h>
+    #include <errno.h>
+    #define SAVEPNG_POSIX (0)
+#endif
+
+#if SAVEPNG_POSIX && defined(O_DIRECT)
+    #define SAVEPNG_DIRECT (1)
+#else
+    #define SAVEPNG_DIRECT (0)
+#endif
+
 #include "mex.h"
 #include "matrix.h"
 
 #include "fpng.h"
 #include "libdeflate_amalgamated.h"
+#include "asyncwrite.h"
+#include "imgtranspose.h"
+#include "palette.h"
+#include "quantize.h"
+#include "nearlossless.h"
+#include "pyramid.h"
 
 static uint8_t fpng_initialized = false;
 
@@ -68,67 +246,262 @@ uint32_t htonl(uint32_t x) {
            ((x & 0xFF000000) >> 24);
 }
 
+/* Private ancillary chunk listing independently decodable stripes of the zlib stream: "spIX" followed by
+ * a version byte, the stripe count and, per stripe, the 64-bit offset of its first byte within the zlib
+ * stream and its first row. Every stripe starts on a byte boundary, uses no back-references into the
+ * previous stripe, and its first scanline does not reference the row above. */
+#define STRIPE_INDEX_VERSION 0
+#define STRIPE_INDEX_LEN(n)  (12 + 5 + 12*(n))
+
+/* Two byte zlib stream header with the same FLEVEL libdeflate would use */
+void write_zlib_header(int level, uint8_t *out)
+{
+    uint32_t zhdr = (0x78 << 8) | ((level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6);
+    zhdr += 31 - (zhdr % 31);
+    out[0] = (uint8_t)(zhdr >> 8);
+    out[1] = (uint8_t)zhdr;
+}
+
+/* Compress filtered scanlines into a zlib stream made of independently compressed stripes, written to
+ * out together with the complete spIX chunk in index_chunk. Stripes are compressed on parallel threads.
+ * Returns the length of the zlib stream, or 0 on failure. */
+size_t compress_stripes(const uint8_t *raw_buf, size_t row_len, uint32_t h, int level, uint32_t nstripes, uint8_t *out, size_t out_avail, uint8_t *index_chunk)
+{
+    std::vector< std::vector<uint8_t> > parts(nstripes);
+    std::vector<std::thread> workers;
+    std::atomic<bool> failed(false);
+    uint32_t nthreads = std::thread::hardware_concurrency();
+    uint32_t i, adler;
+    size_t ofs;
+    
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > nstripes) nthreads = nstripes;
+    
+    for (i = 0; i < nthreads; i++) {
+        workers.push_back(std::thread([&, i]() {
+            struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(level);
+            if (!compressor) {
+                failed = true;
+                return;
+            }
+            for (uint32_t s = i; (s < nstripes) && !failed; s += nthreads) {
+                size_t r0 = (size_t)h * s / nstripes, r1 = (size_t)h * (s + 1) / nstripes;
+                size_t len = (r1 - r0) * row_len, size;
+                
+                // All but the last stripe end with a sync flush instead of a final block
+                parts[s].resize(libdeflate_deflate_compress_bound(NULL, len) + 6);
+                if (s + 1 < nstripes)
+                    size = libdeflate_deflate_compress_sync(compressor, raw_buf + r0 * row_len, len, parts[s].data(), parts[s].size());
+                else
+                    size = libdeflate_deflate_compress(compressor, raw_buf + r0 * row_len, len, parts[s].data(), parts[s].size());
+                if (!size) failed = true;
+                parts[s].resize(size);
+            }
+            libdeflate_free_compressor(compressor);
+        }));
+    }
+    
+    // Adler-32 of the whole stream is computed while the stripes compress
+    adler = libdeflate_adler32(1, raw_buf, row_len * h);
+    
+    for (i = 0; i < nthreads; i++)
+        workers[i].join();
+    if (failed) return 0;
+    
+    write_zlib_header(level, out);
+    
+    *(uint32_t*)(index_chunk) = htonl(STRIPE_INDEX_LEN(nstripes) - 12);
+    memcpy(index_chunk + 4, "spIX", 4);
+    index_chunk[8] = STRIPE_INDEX_VERSION;
+    *(uint32_t*)(index_chunk + 9) = htonl(nstripes);
+    
+    ofs = 2;
+    for (i = 0; i < nstripes; i++) {
+        uint8_t *entry = index_chunk + 13 + 12*i;
+        if (ofs + parts[i].size() + 4 > out_avail) return 0;
+        *(uint32_t*)(entry) = htonl((uint32_t)((uint64_t)ofs >> 32));
+        *(uint32_t*)(entry + 4) = htonl((uint32_t)ofs);
+        *(uint32_t*)(entry + 8) = htonl((uint32_t)((size_t)h * i / nstripes));
+        memcpy(out + ofs, parts[i].data(), parts[i].size());
+        ofs += parts[i].size();
+    }
+    *(uint32_t*)(index_chunk + STRIPE_INDEX_LEN(nstripes) - 4) = htonl(libdeflate_crc32(0, index_chunk + 4, STRIPE_INDEX_LEN(nstripes) - 8));
+    
+    *(uint32_t*)(out + ofs) = htonl(adler);
+    return ofs + 4;
+}
+
+/* Largest PNG image dimension */
+#define PNG_MAX_DIM         0x7FFFFFFF
+
+/* A PNG chunk holds at most 2^31-1 bytes, so zlib streams longer than this are split into IDAT chunks of
+ * this size */
+#define MAX_IDAT_LEN        ((size_t)1 << 30)
+
+/* Number of stripes actually written for an image of h rows */
+uint32_t stripe_count(uint32_t h, uint32_t nstripes)
+{
+    return (nstripes > h) ? h : nstripes;
+}
+
+/* Colour type of indexed (palette) images */
+#define PNG_COLOR_INDEXED   3
+
+/* PNG colour type of an image with 1 to 4 channels */
+uint8_t png_color_type(uint32_t nchan)
+{
+    static const uint8_t chans[] = { 0x00, 0x00, 0x04, 0x02, 0x06 };
+    return chans[nchan];
+}
+
+/* Samples per pixel of a PNG colour type */
+uint32_t png_channels(uint8_t color_type)
+{
+    static const uint8_t samples[] = { 1, 0, 3, 1, 2, 0, 4 };
+    return samples[color_type];
+}
+
+/* Bytes per scanline, without the filter type byte */
+size_t png_row_bytes(uint32_t w, uint8_t color_type, uint32_t bit_depth)
+{
+    return ((size_t)w * png_channels(color_type) * bit_depth + 7) / 8;
+}
+
+/* Upper bound of the zlib stream compressed by write_png_to_buffer(), for any compression level */
+size_t zlib_stream_bound(uint32_t w, uint32_t h, uint8_t color_type, uint32_t bit_depth, uint32_t nstripes)
+{
+    size_t row_len = 1 + png_row_bytes(w, color_type, bit_depth);
+    size_t bound;
+    
+    nstripes = stripe_count(h, nstripes);
+    if (nstripes > 1) {
+        bound = 6;
+        for (uint32_t s = 0; s < nstripes; s++)
+            bound += libdeflate_deflate_compress_bound(NULL, ((size_t)h * (s + 1) / nstripes - (size_t)h * s / nstripes) * row_len) + 6;
+    }
+    else {
+        bound = libdeflate_zlib_compress_bound(NULL, row_len * h);
+    }
+    return bound;
+}
+
+/* Upper bound of the file size written by write_png_to_buffer(), for any compression level */
+size_t png_file_bound(uint32_t w, uint32_t h, uint8_t color_type, uint32_t bit_depth, uint32_t nstripes, uint32_t extra_len)
+{
+    size_t bound = zlib_stream_bound(w, h, color_type, bit_depth, nstripes);
+    
+    nstripes = stripe_count(h, nstripes);
+    if (nstripes > 1)
+        bound += STRIPE_INDEX_LEN(nstripes);
+    
+    // Overhead: 62 (Header) + 4 (IDAT CRC) + 12 (IEND Chunk) = 78 bytes, plus 12 per additional IDAT chunk
+    return 78 + extra_len + bound + 12 * ((bound - 1) / MAX_IDAT_LEN);
+}
+
+/* Encoder state a thread keeps across the images it encodes, so that a batch of small images (tiles,
+ * thumbnails) does not set it up again for each one. Release with encoder_state_free(). */
+typedef struct {
+    struct libdeflate_compressor *compressor;
+    int level;                      /* of compressor */
+    std::vector<uint8_t> fpng_out;  /* fpng output, grown to the largest image so far */
+    std::vector<uint8_t> region;    /* planes of an image cut from larger ones */
+} encoder_state;
+
+/* libdeflate compressor of the given level, allocated once per level change */
+struct libdeflate_compressor* encoder_compressor(encoder_state *es, int level)
+{
+    if (es->compressor && (es->level != level)) {
+        libdeflate_free_compressor(es->compressor);
+        es->compressor = NULL;
+    }
+    if (!es->compressor) {
+        es->compressor = libdeflate_alloc_compressor(level);
+        es->level = level;
+    }
+    return es->compressor;
+}
+
+void encoder_state_free(encoder_state *es)
+{
+    if (es->compressor) libdeflate_free_compressor(es->compressor);
+    es->compressor = NULL;
+}
+
 /* Simple PNG writer function by Alex Evans, 2011. Released into the public domain: https://gist.github.com/908299
- * This is actually a modification to support libdeflate */
-uint8_t* write_image_to_png_file_in_memory(void *img, int32_t w, int32_t h, int32_t numchans, int8_t level, uint32_t dpm, uint32_t &len_out) 
+ * This is actually a modification to support libdeflate. The PNG is written to out, which must hold
+ * png_file_bound() bytes; returns the file length or 0 on failure. With nl the 8-bit samples of img are
+ * rounded in place by the near-lossless mode as they are filtered. The compressor is taken from es when
+ * it is not NULL. */
+size_t write_png_to_buffer(void *img, uint32_t w, uint32_t h, uint8_t color_type, uint32_t bit_depth, int8_t level, uint32_t dpm, uint32_t nstripes, const near_lossless_table *nl, const uint8_t *extra, uint32_t extra_len, uint8_t *out, encoder_state *es) 
 {
-    // Scan line length
-    int32_t p = w * numchans;
+    // Scan line length; 16-bit samples are already in PNG (big-endian) byte order, indices below 8 bits packed
+    size_t p = png_row_bytes(w, color_type, bit_depth);
     
     // Prepare the raw data buffer
-    size_t raw_len = (size_t)(1 + p) * h;
+    size_t raw_len = (1 + p) * h;
     uint8_t *raw_buf = (uint8_t*)malloc(raw_len);
     if (!raw_buf) return 0;
 
-    for (int32_t y = 0; y < h; ++y) {
-        raw_buf[y * (1 + p)] = 0; // Filter type 0 (None)
-        memcpy(raw_buf + y * (1 + p) + 1, ((uint8_t*)img) + y * p, p);
+    // Any extra ancillary chunks and the stripe index are placed between IHDR and pHYs
+    size_t bound = zlib_stream_bound(w, h, color_type, bit_depth, nstripes);
+    nstripes = stripe_count(h, nstripes);
+
+    for (size_t y = 0, s = 0, stripe_start = 0; y < h; ++y) {
+        uint8_t *row = ((uint8_t*)img) + y * p;
+        if (!nl) {
+            raw_buf[y * (1 + p)] = 0; // Filter type 0 (None)
+            memcpy(raw_buf + y * (1 + p) + 1, row, p);
+            continue;
+        }
+        // Near-lossless rows are rounded in place and filtered with Up (2), except that the first row of
+        // each stripe is predicted from zero, which is the same as None
+        bool first = (y == stripe_start);
+        if (first)
+            stripe_start = (size_t)h * ++s / nstripes;
+        raw_buf[y * (1 + p)] = first ? 0 : 2;
+        near_lossless_row(nl, row, first ? NULL : row - p, p, png_channels(color_type), row, raw_buf + y * (1 + p) + 1);
     }
 
     // Set up libdeflate compressor
-    struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(level);
+    struct libdeflate_compressor *compressor = es ? encoder_compressor(es, level) : libdeflate_alloc_compressor(level);
     if (!compressor) {
         free(raw_buf);
         return 0;
     }
-
-    // Calculate bound and allocate output buffer
-    // Overhead: 62 (Header) + 4 (IDAT CRC) + 12 (IEND Chunk) = 78 bytes
-    size_t bound = libdeflate_zlib_compress_bound(compressor, raw_len);
-    uint8_t *zbuf = (uint8_t*)malloc(78 + bound); 
-    if (!zbuf) {
-        libdeflate_free_compressor(compressor);
-        free(raw_buf);
-        return 0;
-    }
+    uint32_t index_len = (nstripes > 1) ? STRIPE_INDEX_LEN(nstripes) : 0;
+    uint32_t hdr_len = 62 + extra_len + index_len;
+    uint8_t *zbuf = out;
 
     // Compress
-    // Output writes to zbuf + 62, leaving room for the PNG header
-    size_t compressed_size = libdeflate_zlib_compress(compressor, raw_buf, raw_len, zbuf + 62, bound);
+    // Output writes to zbuf + hdr_len, leaving room for the PNG header
+    size_t compressed_size;
+    if (nstripes > 1)
+        compressed_size = compress_stripes(raw_buf, 1 + p, h, level, nstripes, zbuf + hdr_len, bound, zbuf + 33 + extra_len);
+    else
+        compressed_size = libdeflate_zlib_compress(compressor, raw_buf, raw_len, zbuf + hdr_len, bound);
     
-    libdeflate_free_compressor(compressor);
+    if (!es) libdeflate_free_compressor(compressor);
     free(raw_buf);
 
-    if (compressed_size == 0) {
-        free(zbuf);
+    if (compressed_size == 0)
         return 0;
-    }
 
-    len_out = (uint32_t)compressed_size;
+    // Streams that do not fit one chunk continue in further IDAT chunks of MAX_IDAT_LEN bytes
+    size_t nchunks = (compressed_size + MAX_IDAT_LEN - 1) / MAX_IDAT_LEN;
+    uint32_t len_out = (uint32_t)((nchunks > 1) ? MAX_IDAT_LEN : compressed_size);
 
     // Construct PNG Header (IHDR + IDAT start)
-    static const uint8_t chans[] = { 0x00, 0x00, 0x04, 0x02, 0x06 };
     uint8_t pnghdr[62] = { 0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, // PNG signature
                 /*  8 */   0x00, 0x00, 0x00, 0x0d,    // IHDR chunk size
                 /* 12 */   0x49, 0x48, 0x44, 0x52,    // IHDR
-                /* 16 */   0x00, 0x00, (uint8_t)(w>>8), (uint8_t)w, //
-                           0x00, 0x00, (uint8_t)(h>>8), (uint8_t)h, // dimensions field
-                           0x08, chans[numchans], 0x00, 0x00, 0x00, //
+                /* 16 */   (uint8_t)(w>>24), (uint8_t)(w>>16), (uint8_t)(w>>8), (uint8_t)w, //
+                           (uint8_t)(h>>24), (uint8_t)(h>>16), (uint8_t)(h>>8), (uint8_t)h, // dimensions field
+                           (uint8_t)bit_depth, color_type, 0x00, 0x00, 0x00, //
                 /* 29 */   0x00, 0x00, 0x00, 0x00,    // CRC
                 /* 33 */   0x00, 0x00, 0x00, 0x09,    // pHYs chunk size
                 /* 37 */   0x70, 0x48, 0x59, 0x73,    // pHYs
-                /* 41 */   0x00, 0x00, (uint8_t)(dpm>>8), (uint8_t)dpm, // Pixels per unit, X axis
-                           0x00, 0x00, (uint8_t)(dpm>>8), (uint8_t)dpm, // Pixels per unit, Y axis
+                /* 41 */   (uint8_t)(dpm>>24), (uint8_t)(dpm>>16), (uint8_t)(dpm>>8), (uint8_t)dpm, // Pixels per unit, X axis
+                           (uint8_t)(dpm>>24), (uint8_t)(dpm>>16), (uint8_t)(dpm>>8), (uint8_t)dpm, // Pixels per unit, Y axis
                            0x01,  // Unit specifier (meters)
                 /* 50 */   0x00, 0x00, 0x00, 0x00,    // CRC
                 /* 54 */   (uint8_t)(len_out>>24), (uint8_t)(len_out>>16) ,(uint8_t)(len_out>>8), (uint8_t)len_out, // IDAT chunk size
@@ -138,22 +511,1293 @@ uint8_t* write_image_to_png_file_in_memory(void *img, int32_t w, int32_t h, int3
     *(uint32_t*)(pnghdr+29) = htonl(libdeflate_crc32(0, pnghdr+12, 17));
     *(uint32_t*)(pnghdr+50) = htonl(libdeflate_crc32(0, pnghdr+37, 13));
     
-    memcpy(zbuf, pnghdr, 62);
+    memcpy(zbuf, pnghdr, 33);
+    if (extra_len) memcpy(zbuf + 33, extra, extra_len);
+    memcpy(zbuf + 33 + extra_len + index_len, pnghdr + 33, 29);
+
+    // Open up 12 bytes after each full chunk for its CRC and the header of the next chunk, moving the
+    // later pieces first. png_file_bound() leaves room for this.
+    for (size_t i = nchunks - 1; i > 0; i--) {
+        size_t piece = (i + 1 < nchunks) ? MAX_IDAT_LEN : compressed_size - i * MAX_IDAT_LEN;
+        uint8_t *dst = zbuf + hdr_len + i * (MAX_IDAT_LEN + 12);
+        memmove(dst, zbuf + hdr_len + i * MAX_IDAT_LEN, piece);
+        *(uint32_t*)(dst - 8) = htonl((uint32_t)piece);
+        memcpy(dst - 4, "IDAT", 4);
+    }
 
-    // Calculate CRC for IDAT chunk
+    // Calculate CRC for each IDAT chunk
     // CRC includes chunk type "IDAT" (4 bytes) + Compressed Data
-    // "IDAT" is located at zbuf + 58
-    *(uint32_t*)(zbuf + 62 + len_out) = htonl(libdeflate_crc32(0, zbuf + 62 - 4, 4 + len_out));;
+    // "IDAT" of the first chunk is located at zbuf + hdr_len - 4
+    for (size_t i = 0; i < nchunks; i++) {
+        size_t piece = (i + 1 < nchunks) ? MAX_IDAT_LEN : compressed_size - i * MAX_IDAT_LEN;
+        uint8_t *data = zbuf + hdr_len + i * (MAX_IDAT_LEN + 12);
+        *(uint32_t*)(data + piece) = htonl(libdeflate_crc32(0, data - 4, 4 + piece));
+    }
+    uint8_t *end = zbuf + hdr_len + compressed_size + 12 * (nchunks - 1) + 4;
 
     // Append IEND chunk (Length 0, "IEND", CRC)
     // Fixed: Explicitly writing the 4-byte length (0) which was uninitialized in the original gist
     uint8_t footer[12] = { 0x00, 0x00, 0x00, 0x00, 
                            0x49, 0x45, 0x4e, 0x44,     // IEND
                            0xae, 0x42, 0x60, 0x82 };   // CRC
-    memcpy(zbuf + 62 + len_out + 4, footer, 12);
+    memcpy(end, footer, 12);
+
+    return (size_t)(end - zbuf) + 12;
+}
 
-    len_out += 78;
-    return zbuf;
+/* Raw (filtered) bytes per band of the streaming encoder, and payload of each IDAT chunk it writes */
+#define STREAM_BAND_BYTES   (4 << 20)
+#define STREAM_IDAT_LEN     (256 << 10)
+
+/* Output state of the streaming encoder: compressed bytes are gathered into fixed size IDAT chunks */
+typedef struct {
+    FILE *file;
+    uint8_t *chunk;         /* 8 byte chunk header followed by STREAM_IDAT_LEN bytes of payload */
+    size_t fill;
+    bool ok;
+} idat_stream;
+
+/* Write out the gathered IDAT chunk */
+void idat_stream_flush(idat_stream *st)
+{
+    uint32_t crc;
+    
+    if (!st->fill) return;
+    *(uint32_t*)(st->chunk) = htonl((uint32_t)st->fill);
+    memcpy(st->chunk + 4, "IDAT", 4);
+    crc = htonl(libdeflate_crc32(0, st->chunk + 4, 4 + st->fill));
+    if ((fwrite(st->chunk, 1, 8 + st->fill, st->file) != 8 + st->fill) || (fwrite(&crc, 1, 4, st->file) != 4))
+        st->ok = false;
+    st->fill = 0;
+}
+
+/* Append zlib stream bytes, writing every IDAT chunk as soon as it fills */
+void idat_stream_write(idat_stream *st, const uint8_t *data, size_t len)
+{
+    while (len) {
+        size_t n = (len < STREAM_IDAT_LEN - st->fill) ? len : STREAM_IDAT_LEN - st->fill;
+        memcpy(st->chunk + 8 + st->fill, data, n);
+        st->fill += n;
+        data += n;
+        len -= n;
+        if (st->fill == STREAM_IDAT_LEN)
+            idat_stream_flush(st);
+    }
+}
+
+/* Encode a MATLAB image band by band straight to file, never holding more than one band of pixels and
+ * its compressed form. Each band of rows is transposed into filtered scanlines (palette indices when pal is
+ * given, mapped to the nearest colours when quant is, rounded and filtered with Up when nl is) and compressed
+ * as part of one zlib stream; all bands but the last end with a sync flush, so a band starts with an empty
+ * window. Returns false on failure. */
+bool write_png_streaming(FILE *file, const uint8_t *indata, const alpha_plane *alpha, uint32_t w, uint32_t h, uint32_t numchans, uint32_t bit_depth, const image_palette *pal, const image_quantizer *quant, bool clean_alpha, const near_lossless_table *nl, int level, uint32_t dpm, const uint8_t *extra, uint32_t extra_len)
+{
+    static const uint8_t footer[12] = { 0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82 };   // IEND
+    uint8_t color_type = pal ? PNG_COLOR_INDEXED : png_color_type(numchans);
+    uint32_t png_depth = pal ? palette_index_bits(pal) : bit_depth;
+    size_t row_len = 1 + png_row_bytes(w, color_type, png_depth);
+    uint32_t band_rows = (uint32_t)((STREAM_BAND_BYTES / row_len) ? (STREAM_BAND_BYTES / row_len) : 1);
+    uint32_t r0, r1, y, adler = 1;
+    uint8_t hdr[33 + 21], zhdr[2];
+    idat_stream st;
+    
+    struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(level);
+    uint8_t *raw_buf = (uint8_t*)malloc(row_len * band_rows);
+    size_t cbuf_len = libdeflate_deflate_compress_bound(compressor, row_len * band_rows) + 6;
+    uint8_t *cbuf = (uint8_t*)malloc(cbuf_len);
+    uint8_t *prev_row = nl ? (uint8_t*)malloc(row_len - 1) : NULL;    /* last row written, after rounding */
+    
+    st.file = file;
+    st.chunk = (uint8_t*)malloc(8 + STREAM_IDAT_LEN);
+    st.fill = 0;
+    st.ok = (compressor && raw_buf && cbuf && st.chunk && (prev_row || !nl));
+    
+    // Signature, IHDR, extra chunks and pHYs
+    if (st.ok) {
+        memcpy(hdr, "\x89PNG\r\n\x1a\n\x00\x00\x00\x0dIHDR", 16);
+        *(uint32_t*)(hdr + 16) = htonl(w);
+        *(uint32_t*)(hdr + 20) = htonl(h);
+        hdr[24] = (uint8_t)png_depth; hdr[25] = color_type; hdr[26] = 0; hdr[27] = 0; hdr[28] = 0;
+        *(uint32_t*)(hdr + 29) = htonl(libdeflate_crc32(0, hdr + 12, 17));
+        memcpy(hdr + 33, "\x00\x00\x00\x09pHYs", 8);
+        *(uint32_t*)(hdr + 41) = htonl(dpm);
+        *(uint32_t*)(hdr + 45) = htonl(dpm);
+        hdr[49] = 1;
+        *(uint32_t*)(hdr + 50) = htonl(libdeflate_crc32(0, hdr + 37, 13));
+        
+        if ((fwrite(hdr, 1, 33, file) != 33) || (extra_len && (fwrite(extra, 1, extra_len, file) != extra_len)) || (fwrite(hdr + 33, 1, 21, file) != 21))
+            st.ok = false;
+        
+        write_zlib_header(level, zhdr);
+        idat_stream_write(&st, zhdr, 2);
+    }
+    
+    for (r0 = 0; st.ok && (r0 < h); r0 = r1) {
+        size_t raw_len, size;
+        r1 = (h - r0 > band_rows) ? r0 + band_rows : h;
+        raw_len = (r1 - r0) * row_len;
+        
+        // Transpose the band into scanlines with filter type 0 (None)
+        for (y = r0; y < r1; y++)
+            raw_buf[(y - r0) * row_len] = 0;
+        if (quant)
+            quantize_index_from_planar(indata, alpha, w, h, quant, r0, r1, raw_buf + 1, row_len);
+        else if (pal)
+            palette_index_from_planar(indata, alpha, w, h, pal, r0, r1, raw_buf + 1, row_len);
+        else if (bit_depth == 1)
+            pack_bits_from_planar(indata, w, h, r0, r1, raw_buf + 1, row_len);
+        else if (bit_depth == 16)
+            interleave_from_planar16((const uint16_t*)indata, w, h, numchans, r0, r1, raw_buf + 1, row_len, clean_alpha);
+        else
+            interleave_with_alpha(indata, alpha, w, h, numchans, r0, r1, raw_buf + 1, row_len, clean_alpha);
+        if (nl) {
+            for (y = r0; y < r1; y++) {
+                uint8_t *row = raw_buf + (y - r0) * row_len;
+                row[0] = y ? 2 : 0;
+                near_lossless_row(nl, row + 1, y ? prev_row : NULL, row_len - 1, numchans, prev_row, row + 1);
+            }
+        }
+        adler = libdeflate_adler32(adler, raw_buf, raw_len);
+        
+        if (r1 < h)
+            size = libdeflate_deflate_compress_sync(compressor, raw_buf, raw_len, cbuf, cbuf_len);
+        else
+            size = libdeflate_deflate_compress(compressor, raw_buf, raw_len, cbuf, cbuf_len);
+        if (!size) {
+            st.ok = false;
+            break;
+        }
+        idat_stream_write(&st, cbuf, size);
+    }
+    
+    if (st.ok) {
+        adler = htonl(adler);
+        idat_stream_write(&st, (const uint8_t*)&adler, 4);
+        idat_stream_flush(&st);
+        if (fwrite(footer, 1, 12, file) != 12)
+            st.ok = false;
+    }
+    
+    if (compressor) libdeflate_free_compressor(compressor);
+    free(raw_buf);
+    free(cbuf);
+    free(prev_row);
+    free(st.chunk);
+    return st.ok;
+}
+
+/* Longest PLTE and tRNS chunks written for a palette */
+#define PALETTE_CHUNKS_LEN  (12 + 3*PALETTE_MAX_COLORS + 12 + PALETTE_MAX_COLORS)
+
+/* Write the complete PLTE chunk of a palette, followed by tRNS when it has translucent entries or was
+ * built from an RGBA image (so that readers still return an alpha channel). Returns the number of bytes
+ * written. */
+uint32_t make_palette_chunks(const image_palette *pal, uint8_t *out)
+{
+    uint32_t len = 3*pal->ncolors, ntrans = pal->ntrans, i;
+    
+    if ((pal->nchan == 4) && !ntrans)
+        ntrans = 1;
+    
+    *(uint32_t*)(out) = htonl(len);
+    memcpy(out + 4, "PLTE", 4);
+    for (i = 0; i < pal->ncolors; i++)
+        memcpy(out + 8 + 3*i, pal->rgba + 4*i, 3);
+    *(uint32_t*)(out + 8 + len) = htonl(libdeflate_crc32(0, out + 4, 4 + len));
+    out += 12 + len;
+    if (!ntrans)
+        return 12 + len;
+    
+    *(uint32_t*)(out) = htonl(ntrans);
+    memcpy(out + 4, "tRNS", 4);
+    for (i = 0; i < ntrans; i++)
+        out[8 + i] = pal->rgba[4*i + 3];
+    *(uint32_t*)(out + 8 + ntrans) = htonl(libdeflate_crc32(0, out + 4, 4 + ntrans));
+    return 24 + len + ntrans;
+}
+
+/* Private ancillary chunk used by SkipUnchanged: "spHS" followed by a version byte,
+ * CRC-32 and Adler-32 of the input image data and CRC-32 of the encoding parameters */
+#define STAMP_DATA_LEN  13
+#define STAMP_CHUNK_LEN (12 + STAMP_DATA_LEN)
+#define STAMP_VERSION   0
+
+/* Number of leading bytes read from an existing file when looking for the stamp */
+#define STAMP_PROBE_LEN 512
+
+/* Encoding parameters that affect the written file; hashed into the stamp */
+typedef struct {
+    uint32_t width, height, nchan;
+    uint32_t classid;
+    uint32_t comp_level;
+    uint32_t dpm;
+    uint32_t nstripes;
+    uint32_t palette;
+    uint32_t reduce;
+    uint32_t clean_alpha;
+    uint32_t quantize, quantize_speed, dither;
+    uint32_t max_error;
+    uint32_t colormap;          /* CRC-32 of the colormap entries, 0 without one */
+    uint32_t alpha;             /* 1 for a separate Alpha matrix, 2 for a logical one, else 0 */
+} savepng_params;
+
+/* Build the complete spHS chunk (length, type, data, CRC) for the given input and parameters */
+void make_stamp_chunk(const uint8_t *data, size_t data_len, const uint8_t *alpha, size_t alpha_len, const savepng_params *params, uint8_t *chunk)
+{
+    uint8_t *p = chunk + 8;
+    uint32_t crc = libdeflate_crc32(0, data, data_len), adler = libdeflate_adler32(1, data, data_len);
+    
+    *(uint32_t*)(chunk) = htonl(STAMP_DATA_LEN);
+    memcpy(chunk + 4, "spHS", 4);
+    
+    /* A separate alpha plane is hashed as if it followed the colour planes */
+    if (alpha) {
+        crc = libdeflate_crc32(crc, alpha, alpha_len);
+        adler = libdeflate_adler32(adler, alpha, alpha_len);
+    }
+    p[0] = STAMP_VERSION;
+    *(uint32_t*)(p+1) = htonl(crc);
+    *(uint32_t*)(p+5) = htonl(adler);
+    *(uint32_t*)(p+9) = htonl(libdeflate_crc32(0, params, sizeof(savepng_params)));
+    
+    *(uint32_t*)(chunk + 8 + STAMP_DATA_LEN) = htonl(libdeflate_crc32(0, chunk + 4, 4 + STAMP_DATA_LEN));
+}
+
+/* Check whether an existing, complete PNG file already carries an identical spHS chunk.
+ * Only the leading STAMP_PROBE_LEN bytes and the 12 byte IEND trailer are read. */
+bool file_has_stamp(const char *filename, const uint8_t *chunk)
+{
+    static const uint8_t iend[12] = { 0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82 };
+    uint8_t head[STAMP_PROBE_LEN];
+    uint8_t tail[12];
+    size_t head_len, ofs;
+    uint32_t chunk_len;
+    bool found = false;
+    
+    FILE *file = fopen(filename, "rb");
+    if (!file) return false;
+    
+    head_len = fread(head, 1, STAMP_PROBE_LEN, file);
+    
+    /* A partially written file must not be mistaken for an up-to-date one */
+    if ((fseek(file, -12, SEEK_END) != 0) || (fread(tail, 1, 12, file) != 12) || memcmp(tail, iend, 12)) {
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+    
+    /* Walk the chunks following the signature until the first IDAT */
+    ofs = 8;
+    while (ofs + 8 <= head_len) {
+        chunk_len = htonl(*(uint32_t*)(head + ofs));
+        if (!memcmp(head + ofs + 4, "IDAT", 4)) break;
+        if (!memcmp(head + ofs + 4, "spHS", 4)) {
+            found = (ofs + STAMP_CHUNK_LEN <= head_len) && !memcmp(head + ofs, chunk, STAMP_CHUNK_LEN);
+            break;
+        }
+        ofs += 12 + (size_t)chunk_len;
+    }
+    
+    return found;
+}
+
+/* Output file I/O modes */
+enum { IO_STDIO, IO_MMAP, IO_POSIX, IO_DIRECT };
+
+/* A piece of the output file; pieces are written back to back */
+typedef struct {
+    const void *data;
+    size_t len;
+} out_piece;
+
+/* Buffer and file length granularity for O_DIRECT writes */
+#define DIRECT_IO_ALIGN 4096
+
+/* Round up to whole O_DIRECT blocks */
+size_t direct_io_round(size_t len)
+{
+    return (len + DIRECT_IO_ALIGN - 1) & ~(size_t)(DIRECT_IO_ALIGN - 1);
+}
+
+/* Allocate an output buffer of len bytes. For IO_DIRECT it is block aligned and padded to whole blocks.
+ * Release with free() either way. */
+uint8_t* alloc_output_buffer(size_t len, int io_mode)
+{
+#if SAVEPNG_DIRECT
+    if (io_mode == IO_DIRECT) {
+        void *buf;
+        return posix_memalign(&buf, DIRECT_IO_ALIGN, direct_io_round(len)) ? NULL : (uint8_t*)buf;
+    }
+#endif
+    return (uint8_t*)malloc(len);
+}
+
+/* Write pieces through stdio */
+bool write_file_stdio(const char *filename, const out_piece *pieces, int npieces)
+{
+    FILE *file = fopen(filename, "wb");
+    bool ok = (file != NULL);
+    int i;
+    
+    if (!file) return false;
+    for (i = 0; i < npieces; i++) {
+        if (pieces[i].len && (fwrite(pieces[i].data, 1, pieces[i].len, file) != pieces[i].len))
+            ok = false;
+    }
+    return (fclose(file) == 0) && ok;
+}
+
+#if SAVEPNG_POSIX
+/* Write pieces straight from their buffers with writev(), after reserving the file's blocks */
+bool write_file_posix(const char *filename, const out_piece *pieces, int npieces)
+{
+    struct iovec iov[8];
+    size_t total = 0;
+    int fd, i, k, n;
+    bool ok = true;
+    
+    for (i = 0; i < npieces; i++)
+        total += pieces[i].len;
+    
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) return false;
+    
+#if defined(__linux__)
+    /* Best effort; file systems without fallocate support still get written */
+    posix_fallocate(fd, 0, (off_t)total);
+#endif
+    
+    /* Pieces go out in groups of up to 8 vectors */
+    i = 0;
+    while (ok && (i < npieces)) {
+        for (n = 0; (i < npieces) && (n < 8); i++) {
+            if (!pieces[i].len) continue;
+            iov[n].iov_base = (void*)pieces[i].data;
+            iov[n].iov_len = pieces[i].len;
+            n++;
+        }
+        
+        /* writev() may return short; advance through the vectors until the group is written */
+        k = 0;
+        while (ok && (k < n)) {
+            ssize_t written = writev(fd, iov + k, n - k);
+            if (written < 0) {
+                if (errno != EINTR) ok = false;
+                continue;
+            }
+            while ((k < n) && ((size_t)written >= iov[k].iov_len)) {
+                written -= iov[k].iov_len;
+                k++;
+            }
+            if (k < n) {
+                iov[k].iov_base = (uint8_t*)iov[k].iov_base + written;
+                iov[k].iov_len -= written;
+            }
+        }
+    }
+    
+    return (close(fd) == 0) && ok;
+}
+#endif
+
+#if SAVEPNG_DIRECT
+/* Write a buffer from alloc_output_buffer(..., IO_DIRECT) with O_DIRECT, bypassing the page cache. The
+ * write is padded to whole blocks and the file truncated back afterwards. File systems that refuse
+ * O_DIRECT (tmpfs, some network mounts) get a regular write instead. */
+bool write_file_direct(const char *filename, uint8_t *buf, size_t len)
+{
+    size_t padded = direct_io_round(len), done = 0;
+    bool ok = true;
+    int fd;
+    
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0666);
+    if ((fd < 0) && (errno == EINVAL)) {
+        out_piece piece = { buf, len };
+        return write_file_posix(filename, &piece, 1);
+    }
+    if (fd < 0) return false;
+    
+    memset(buf + len, 0, padded - len);
+#if defined(__linux__)
+    posix_fallocate(fd, 0, (off_t)padded);
+#endif
+    
+    while (ok && (done < padded)) {
+        ssize_t written = write(fd, buf + done, padded - done);
+        if (written < 0) {
+            if (errno != EINTR) ok = false;
+            continue;
+        }
+        done += written;
+    }
+    
+    ok = ok && (ftruncate(fd, (off_t)len) == 0);
+    return (close(fd) == 0) && ok;
+}
+#endif
+
+/* Write the output file in the given I/O mode (other than IO_MMAP) */
+bool write_output_file(const char *filename, int io_mode, const out_piece *pieces, int npieces)
+{
+#if SAVEPNG_DIRECT
+    if (io_mode == IO_DIRECT) {
+        /* Gather into one aligned buffer */
+        size_t total = 0, ofs = 0;
+        uint8_t *buf;
+        bool ok;
+        int i;
+        
+        for (i = 0; i < npieces; i++)
+            total += pieces[i].len;
+        buf = alloc_output_buffer(total, IO_DIRECT);
+        if (!buf) return false;
+        for (i = 0; i < npieces; i++) {
+            if (pieces[i].len) memcpy(buf + ofs, pieces[i].data, pieces[i].len);
+            ofs += pieces[i].len;
+        }
+        ok = write_file_direct(filename, buf, total);
+        free(buf);
+        return ok;
+    }
+#endif
+#if SAVEPNG_POSIX
+    if ((io_mode == IO_POSIX) || (io_mode == IO_DIRECT))
+        return write_file_posix(filename, pieces, npieces);
+#endif
+    return write_file_stdio(filename, pieces, npieces);
+}
+
+/* Output file mapped into memory so the PNG is encoded straight into the page cache */
+typedef struct {
+    int fd;
+    uint8_t *data;
+    size_t len;
+} mapped_file;
+
+#if SAVEPNG_POSIX
+/* Create (or truncate) filename, size it to len bytes and map it for writing. Blocks are allocated up
+ * front where possible, so running out of disk space fails here instead of faulting on a page write. */
+bool map_output_file(const char *filename, size_t len, mapped_file *m)
+{
+    m->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (m->fd < 0) return false;
+    
+#if defined(__linux__)
+    if (posix_fallocate(m->fd, 0, (off_t)len) != 0) {
+#else
+    if (ftruncate(m->fd, (off_t)len) != 0) {
+#endif
+        close(m->fd);
+        return false;
+    }
+    
+    m->data = (uint8_t*)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    if (m->data == MAP_FAILED) {
+        close(m->fd);
+        return false;
+    }
+    m->len = len;
+    return true;
+}
+
+/* Unmap and truncate the file to the final PNG length */
+bool unmap_output_file(mapped_file *m, size_t final_len)
+{
+    bool ok = (munmap(m->data, m->len) == 0);
+    ok = (ftruncate(m->fd, (off_t)final_len) == 0) && ok;
+    ok = (close(m->fd) == 0) && ok;
+    return ok;
+}
+#endif
+
+/* Case-insensitive comparison of option names */
+bool option_is(const char *name, const char *option)
+{
+    while (*name && *option) {
+        char a = *name++, b = *option++;
+        if (a>='A' && a<='Z') a += 'a'-'A';
+        if (b>='A' && b<='Z') b += 'a'-'A';
+        if (a!=b) return false;
+    }
+    return (*name==*option);
+}
+
+/* Number of channels of a MATLAB image: MxN (grayscale), MxNx2 (grayscale+alpha), MxNx3 or MxNx4 matrix of
+ * uint8, uint16, single or double, or MxN logical matrix (a mask). Returns 0 for anything else. */
+uint32_t image_channels(const mxArray *img)
+{
+    if (!img || !(mxIsUint8(img) || mxIsUint16(img) || mxIsSingle(img) || mxIsDouble(img) || mxIsLogical(img)) || mxIsComplex(img))
+        return 0;
+    if (mxGetNumberOfDimensions(img)==2)
+        return 1;
+    if (mxIsLogical(img))
+        return 0;
+    if ((mxGetNumberOfDimensions(img)==3) && (mxGetDimensions(img)[2]>=2) && (mxGetDimensions(img)[2]<=4))
+        return (uint32_t)mxGetDimensions(img)[2];
+    return 0;
+}
+
+/* Palette of a MATLAB image when indexed colour applies: RGB and RGBA uint8 images of at most 256 colours,
+ * counting all transparent pixels as one colour with clean_alpha. Grayscale images stay grayscale, since
+ * readers expand palettes to RGB. Returns pal, or NULL to save the samples as they are. */
+const image_palette* find_image_palette(const uint8_t *indata, const alpha_plane *alpha, uint32_t width, uint32_t height, uint32_t nchan, uint32_t bit_depth, bool clean_alpha, image_palette *pal)
+{
+    if ((bit_depth != 8) || (nchan < 3) || !palette_from_planar(indata, alpha, width, height, nchan, clean_alpha, pal))
+        return NULL;
+    return pal;
+}
+
+/* Bits per sample of a MATLAB image accepted by image_channels(); floating point images are written at 8
+ * and logical masks at 1 */
+uint32_t image_bit_depth(const mxArray *img)
+{
+    if (mxIsLogical(img))
+        return 1;
+    return mxIsUint16(img) ? 16 : 8;
+}
+
+/* 8-bit planes of the n samples of a double or single image, scaled from [0,1] as im2uint8 does, so that
+ * MATLAB need not make a converted copy. Returns a newly allocated buffer or NULL. */
+uint8_t* scale_float_image(const void *data, size_t n, uint32_t classid)
+{
+    uint8_t *out = (uint8_t *)malloc(n ? n : 1);
+    
+    if (!out) return NULL;
+    
+    if (classid == mxDOUBLE_CLASS)
+        unit_to_uint8((const double *)data, n, out);
+    else
+        unit_to_uint8f((const float *)data, n, out);
+    return out;
+}
+
+/* Palette of a colormap: a Kx3 double matrix of values in [0,1] with K at most 256, scaled to 8 bits as
+ * im2uint8 does. Returns false when map is not such a matrix. */
+bool colormap_palette(const mxArray *map, image_palette *pal)
+{
+    uint8_t rgb[3 * PALETTE_MAX_COLORS];
+    const double *m;
+    size_t n, k, c;
+    
+    if (!mxIsDouble(map) || mxIsComplex(map) || (mxGetNumberOfDimensions(map) != 2) || (mxGetN(map) != 3) || (mxGetM(map) < 1) || (mxGetM(map) > PALETTE_MAX_COLORS))
+        return false;
+    n = mxGetM(map);
+    m = mxGetPr(map);
+    for (k = 0; k < n; k++) {
+        for (c = 0; c < 3; c++) {
+            double v = m[c*n + k];
+            if (!(v >= 0) || (v > 1))
+                return false;
+            rgb[3*k + c] = (uint8_t)(v * 255.0 + 0.5);
+        }
+    }
+    palette_from_colormap(rgb, (uint32_t)n, pal);
+    return true;
+}
+
+/* Plane of colormap indices (one byte per pixel, column-major) of the n samples of an MxN matrix of uint8,
+ * uint16, single or double, see colormap_indices(). Returns a newly allocated buffer or NULL. */
+uint8_t* colormap_image(const void *data, size_t n, uint32_t classid, const double *clim, uint32_t ncolors)
+{
+    uint8_t *out = (uint8_t *)malloc(n ? n : 1);
+    
+    if (!out) return NULL;
+    
+    if (classid == mxDOUBLE_CLASS)
+        colormap_indices((const double *)data, n, clim, ncolors, out);
+    else if (classid == mxSINGLE_CLASS)
+        colormap_indicesf((const float *)data, n, clim, ncolors, out);
+    else if (classid == mxUINT16_CLASS)
+        colormap_indices16((const uint16_t *)data, n, clim, ncolors, out);
+    else
+        colormap_indices8((const uint8_t *)data, n, clim, ncolors, out);
+    return out;
+}
+
+/* Convert MATLAB image to raw pixels, returns a newly allocated buffer or NULL */
+/* indata format: RRRRRR..., GGGGGG..., BBBBBB..., and AAAAAA... unless alpha is given */
+/* outdata format: RGB, RGB, RGB, ... with 16-bit samples most significant byte first, and fully
+ * transparent pixels as all zero with clean_alpha; logical masks are packed 8 pixels to a byte */
+uint8_t* interleave_image(const uint8_t *indata, const alpha_plane *alpha, uint32_t width, uint32_t height, uint32_t nchan, uint32_t bit_depth, bool clean_alpha)
+{
+    size_t row_len = png_row_bytes(width, png_color_type(nchan), bit_depth);
+    uint8_t *imgdata = (uint8_t *)malloc(row_len * height);
+    
+    if (!imgdata) return NULL;
+    
+    if (bit_depth == 1)
+        pack_bits_from_planar(indata, width, height, 0, height, imgdata, row_len);
+    else if (bit_depth == 16)
+        interleave_from_planar16((const uint16_t *)indata, width, height, nchan, 0, height, imgdata, row_len, clean_alpha);
+    else
+        interleave_with_alpha(indata, alpha, width, height, nchan, 0, height, imgdata, row_len, clean_alpha);
+    return imgdata;
+}
+
+/* Convert MATLAB image to packed palette indices, returns a newly allocated buffer or NULL */
+uint8_t* index_image(const uint8_t *indata, const alpha_plane *alpha, uint32_t width, uint32_t height, const image_palette *pal)
+{
+    size_t row_len = png_row_bytes(width, PNG_COLOR_INDEXED, palette_index_bits(pal));
+    uint8_t *imgdata = (uint8_t *)malloc(row_len * height);
+    
+    if (!imgdata) return NULL;
+    
+    palette_index_from_planar(indata, alpha, width, height, pal, 0, height, imgdata, row_len);
+    return imgdata;
+}
+
+/* Lossy palette quantization settings; colors is 0 when off */
+typedef struct {
+    uint32_t colors;
+    uint32_t speed;
+    bool dither;
+} quantize_options;
+
+/* Quantized palette of a MATLAB image when Quantize applies: RGB and RGBA uint8 images with more colours
+ * than asked for. An exact palette (from find_image_palette) that is small enough is kept instead, as it
+ * loses nothing. Returns q, or NULL. */
+const image_quantizer* find_image_quantizer(const uint8_t *indata, const alpha_plane *alpha, uint32_t width, uint32_t height, uint32_t nchan, uint32_t bit_depth, const image_palette *exact,
+                                            const quantize_options *opts, bool clean_alpha, image_quantizer *q)
+{
+    if (!opts->colors || (bit_depth != 8) || (nchan < 3) || (exact && (exact->ncolors <= opts->colors)))
+        return NULL;
+    quantize_palette(indata, alpha, width, height, nchan, opts->colors, opts->speed, opts->dither, clean_alpha, q);
+    return q;
+}
+
+/* Convert MATLAB image to packed indices of the nearest quantized colours on nthreads threads (0 for one per
+ * core), returns a newly allocated buffer or NULL */
+uint8_t* quantize_image(const uint8_t *indata, const alpha_plane *alpha, uint32_t width, uint32_t height, const image_quantizer *q, uint32_t nthreads)
+{
+    size_t row_len = png_row_bytes(width, PNG_COLOR_INDEXED, palette_index_bits(&q->pal));
+    uint8_t *imgdata = (uint8_t *)malloc(row_len * height);
+    
+    if (!imgdata) return NULL;
+    
+    quantize_index_image(indata, alpha, width, height, q, imgdata, row_len, nthreads);
+    return imgdata;
+}
+
+/* Lossless reductions of an image */
+#define REDUCE_ALPHA    1       /* fully opaque alpha channel dropped */
+#define REDUCE_GRAY     2       /* equal R, G and B written as grayscale */
+#define REDUCE_8BIT     4       /* 16-bit samples that are 8-bit values scaled by 257 written at 8 bits */
+#define REDUCE_QUANTIZE 8       /* colours quantized to a palette (lossy) */
+#define REDUCE_MAXERROR 16      /* samples rounded by the near-lossless mode (lossy) */
+
+/* Image to encode after reductions, column-major planes like the MATLAB input */
+typedef struct {
+    const uint8_t *data;
+    const alpha_plane *alpha;   /* alpha plane apart from data, or NULL */
+    uint32_t nchan, bit_depth;
+    uint32_t reductions;        /* REDUCE_* flags applied */
+    uint8_t *buf;               /* planes allocated for the reduced image, or NULL */
+} reduced_image;
+
+/* Find the smallest lossless layout of a MATLAB image: opaque alpha is dropped, gray RGB becomes grayscale
+ * and 16-bit data holding 8-bit values becomes 8-bit. Without reduce the image is taken as is; without
+ * allow_copy only reductions that select planes of the input are made. An alpha plane given apart from
+ * indata stays apart (r->alpha). Returns false when out of memory; r->buf must be freed either way. */
+bool reduce_image(const uint8_t *indata, const alpha_plane *alpha, uint32_t width, uint32_t height, uint32_t nchan, uint32_t bit_depth,
+                  bool reduce, bool allow_copy, reduced_image *r)
+{
+    size_t n = (size_t)width * height, plane;
+    bool opaque;
+    
+    r->data = indata;
+    r->alpha = alpha;
+    r->nchan = nchan;
+    r->bit_depth = bit_depth;
+    r->reductions = 0;
+    r->buf = NULL;
+    if (!reduce) return true;
+    
+    /* Checking and narrowing the samples is one pass, abandoned at the first sample with distinct bytes */
+    if ((bit_depth == 16) && allow_copy) {
+        r->buf = (uint8_t *)malloc(n * nchan);
+        if (!r->buf) return false;
+        if (narrow_samples16((const uint16_t *)indata, n * nchan, r->buf)) {
+            r->data = r->buf;
+            r->bit_depth = 8;
+            r->reductions |= REDUCE_8BIT;
+        }
+        else {
+            free(r->buf);
+            r->buf = NULL;
+        }
+    }
+    plane = n * (r->bit_depth / 8);
+    
+    /* A logical alpha plane is opaque when it holds no zero */
+    if (alpha)
+        opaque = alpha->logical ? !memchr(alpha->data, 0, n) : bytes_all_ff(alpha->data, n);
+    else
+        opaque = ((nchan == 2) || (nchan == 4)) && bytes_all_ff(r->data + (nchan - 1) * plane, plane);
+    if (opaque) {
+        r->alpha = NULL;
+        r->nchan--;
+        r->reductions |= REDUCE_ALPHA;
+    }
+    
+    if ((r->nchan >= 3) && !memcmp(r->data, r->data + plane, plane) && !memcmp(r->data, r->data + 2 * plane, plane)) {
+        if ((r->nchan == 3) || r->alpha) {
+            /* A separate alpha plane stays where it is */
+            r->nchan -= 2;
+            r->reductions |= REDUCE_GRAY;
+        }
+        else if (r->buf || allow_copy) {
+            /* Gray and alpha planes next to each other */
+            if (!r->buf) {
+                r->buf = (uint8_t *)malloc(2 * plane);
+                if (!r->buf) return false;
+                memcpy(r->buf, r->data, plane);
+            }
+            memmove(r->buf + plane, r->data + 3 * plane, plane);
+            r->data = r->buf;
+            r->nchan = 2;
+            r->reductions |= REDUCE_GRAY;
+        }
+    }
+    return true;
+}
+
+/* Outcome of saving one image, for the optional STATS output */
+typedef struct {
+    bool skipped;               /* SkipUnchanged found the file up to date */
+    uint8_t color_type;
+    uint32_t bit_depth;
+    uint32_t reductions;        /* REDUCE_* flags */
+    uint64_t file_size;
+} save_stats;
+
+const char* color_type_string(uint8_t color_type)
+{
+    switch (color_type) {
+    case 0: return "grayscale";
+    case 2: return "truecolor";
+    case 3: return "indexed";
+    case 4: return "grayscale-alpha";
+    case 6: return "truecolor-alpha";
+    }
+    return "";
+}
+
+/* STATS output: struct array of the given dimensions, one element per image */
+mxArray* create_stats(mwSize ndim, const mwSize *dims, const save_stats *st)
+{
+    static const char *fields[] = { "FileSize", "ColorType", "BitDepth", "Reduction", "Skipped" };
+    mxArray *s = mxCreateStructArray(ndim, dims, sizeof(fields)/sizeof(fields[0]), fields);
+    size_t n = mxGetNumberOfElements(s), i;
+    
+    for (i = 0; i < n; i++) {
+        char reduction[48] = "";
+        
+        mxSetField(s, i, "Skipped", mxCreateLogicalScalar(st[i].skipped));
+        if (st[i].skipped) continue;
+        
+        if (st[i].reductions & REDUCE_ALPHA) strcat(reduction, ",alpha");
+        if (st[i].reductions & REDUCE_GRAY) strcat(reduction, ",gray");
+        if (st[i].reductions & REDUCE_8BIT) strcat(reduction, ",8bit");
+        if (st[i].reductions & REDUCE_QUANTIZE) strcat(reduction, ",quantize");
+        if (st[i].reductions & REDUCE_MAXERROR) strcat(reduction, ",maxerror");
+        mxSetField(s, i, "FileSize", mxCreateDoubleScalar((double)st[i].file_size));
+        mxSetField(s, i, "ColorType", mxCreateString(color_type_string(st[i].color_type)));
+        mxSetField(s, i, "BitDepth", mxCreateDoubleScalar(st[i].bit_depth));
+        mxSetField(s, i, "Reduction", mxCreateString(reduction + (reduction[0] ? 1 : 0)));
+    }
+    return s;
+}
+
+/* Stamp chunk of an image and the parameters it is saved with */
+void make_image_stamp(const uint8_t *indata, const alpha_plane *alpha, uint32_t width, uint32_t height, uint32_t nchan, uint32_t bit_depth, uint32_t classid,
+                      uint32_t comp_level, uint32_t dpm, uint32_t nstripes, bool use_palette, bool reduce, bool clean_alpha,
+                      const quantize_options *quant, uint32_t max_error, const image_palette *colormap, uint8_t *stamp)
+{
+    savepng_params params;
+    
+    memset(&params, 0, sizeof(params));
+    params.width = width;
+    params.height = height;
+    params.nchan = nchan;
+    params.classid = classid;
+    params.comp_level = comp_level;
+    params.dpm = dpm;
+    params.nstripes = nstripes;
+    params.palette = use_palette;
+    params.reduce = reduce;
+    params.clean_alpha = clean_alpha;
+    params.quantize = quant->colors;
+    if (quant->colors) {
+        params.quantize_speed = quant->speed;
+        params.dither = quant->dither;
+    }
+    params.max_error = max_error;
+    if (colormap)
+        params.colormap = libdeflate_crc32(0, colormap->rgba, 4 * colormap->ncolors);
+    if (alpha)
+        params.alpha = alpha->logical ? 2 : 1;
+    make_stamp_chunk(indata, (size_t)width*height*(nchan - (alpha ? 1 : 0))*((bit_depth+7)/8),
+                     alpha ? alpha->data : NULL, (size_t)width*height, &params, stamp);
+}
+
+/* fpng writes a single stream with 32-bit offsets, no palette and no samples below 8 bits; striped, indexed,
+ * 1-bit and too large images are written by libdeflate at level 1 instead */
+uint8_t fpng_effective_level(uint8_t comp_level, uint32_t width, uint32_t height, uint8_t color_type, uint32_t bit_depth, uint32_t nstripes)
+{
+    if ((comp_level<=2) && (((nstripes>1) && (height>1)) || (color_type==PNG_COLOR_INDEXED) || (bit_depth<8) || ((png_row_bytes(width, color_type, bit_depth) + 1) * height > fpng::FPNG_MAX_RAW_SIZE)))
+        return 3;
+    return comp_level;
+}
+
+/* Encode raw pixels into a newly allocated PNG file image, returns NULL on failure. With nl the pixels are
+ * rounded in place by the near-lossless mode first. es is the calling thread's encoder state, or NULL. */
+uint8_t* encode_png_in_memory(uint8_t *imgdata, uint32_t width, uint32_t height, uint8_t color_type, uint32_t bit_depth, uint8_t comp_level,
+                              uint32_t dpm, uint32_t nstripes, const near_lossless_table *nl, const uint8_t *extra, uint32_t extra_len, encoder_state *es, size_t &len_out)
+{
+    uint8_t *outdata;
+    
+    comp_level = fpng_effective_level(comp_level, width, height, color_type, bit_depth, nstripes);
+    
+    if (comp_level<=2) {
+        uint32_t fpng_flags = (bit_depth==16) ? fpng::FPNG_SAMPLES_16BIT : 0;
+        std::vector<uint8_t> own_out;
+        std::vector<uint8_t> &fpng_out = es ? es->fpng_out : own_out;
+        if (comp_level==0)
+            fpng_flags |= fpng::FPNG_FORCE_UNCOMPRESSED;
+        else if (comp_level==2)
+            fpng_flags |= fpng::FPNG_ENCODE_SLOWER;
+        if (nl)
+            near_lossless_image(nl, imgdata, png_row_bytes(width, color_type, bit_depth), height, png_channels(color_type));
+        
+        if (!fpng::fpng_encode_image_to_memory(imgdata, width, height, png_channels(color_type), fpng_out, fpng_flags))
+            return NULL;
+        
+        /* Extra chunks (if any) follow IHDR */
+        len_out = fpng_out.size() + extra_len;
+        outdata = (uint8_t *)malloc(len_out);
+        if (!outdata) return NULL;
+        memcpy(outdata, fpng_out.data(), 33);
+        if (extra_len) memcpy(outdata + 33, extra, extra_len);
+        memcpy(outdata + 33 + extra_len, fpng_out.data() + 33, fpng_out.size() - 33);
+        return outdata;
+    }
+    
+    outdata = (uint8_t *)malloc(png_file_bound(width, height, color_type, bit_depth, nstripes, extra_len));
+    if (!outdata) return NULL;
+    len_out = write_png_to_buffer((void *)imgdata, width, height, color_type, bit_depth, comp_level-2, dpm, nstripes, nl, extra, extra_len, outdata, es);
+    if (!len_out) {
+        free(outdata);
+        return NULL;
+    }
+    return outdata;
+}
+
+/* Encoded files queued for writing at most, per encoding thread */
+#define BATCH_PENDING_PER_THREAD 4
+
+/* One image of a batch save. A region (a tile) of larger planes has src_height and src_width set, and
+ * its top left pixel at row y0, column x0 of them. */
+typedef struct {
+    const uint8_t *indata;
+    uint32_t width, height, nchan, bit_depth;
+    uint32_t classid;
+    std::string filename;
+    const alpha_plane *alpha;       /* alpha plane apart from indata (counted in nchan), or NULL */
+    uint32_t src_height, src_width; /* 0 unless the image is a region */
+    uint32_t y0, x0;
+} batch_image;
+
+/* Encode a batch of images on a pool of threads and hand them to an asynchronous writer, so encoding
+ * overlaps with opening, writing and closing files. nl (NULL unless MaxError is set) is shared by the
+ * threads. The outcome for each image goes to stats. Returns false with the error identifier and message
+ * filled in on failure. */
+bool encode_batch(const std::vector<batch_image> &batch, uint8_t comp_level, uint32_t dpm, uint32_t nstripes,
+                  bool skip_unchanged, bool use_palette, bool reduce, bool clean_alpha, const quantize_options *quant_opts, const near_lossless_table *nl,
+                  std::vector<save_stats> &stats,
+                  const char **errid, char *errmsg, size_t errmsg_len)
+{
+    size_t n = batch.size(), i;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> next(0), encode_failures(0);
+    std::string first_failed;
+    async_writer *writer;
+    uint32_t nthreads;
+    
+    stats.assign(n, save_stats());
+    
+    nthreads = std::thread::hardware_concurrency();
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > n) nthreads = (uint32_t)n;
+    writer = async_writer_create(nthreads * BATCH_PENDING_PER_THREAD);
+    
+    for (i = 0; i < nthreads; i++) {
+        workers.push_back(std::thread([&]() {
+            encoder_state es;
+            size_t k;
+            es.compressor = NULL;
+            es.level = 0;
+            while ((k = next++) < n) {
+                const batch_image &b = batch[k];
+                save_stats &st = stats[k];
+                uint8_t extra[STAMP_CHUNK_LEN + PALETTE_CHUNKS_LEN], *imgdata = NULL, *outdata = NULL;
+                uint8_t color_type;
+                uint32_t bit_depth, extra_len = 0;
+                image_palette pal;
+                const image_palette *p = NULL;
+                image_quantizer quantizer;
+                const image_quantizer *quant = NULL;
+                const near_lossless_table *img_nl = NULL;
+                const uint8_t *indata = b.indata;
+                const alpha_plane *alpha = b.alpha;
+                alpha_plane region_alpha;
+                uint8_t *scaled = NULL;
+                reduced_image r;
+                size_t len;
+                
+                /* Regions are gathered into the thread's own planes first */
+                if (b.src_height) {
+                    uint32_t esize = (b.classid == mxDOUBLE_CLASS) ? 8 : (b.classid == mxSINGLE_CLASS) ? 4 : (b.bit_depth == 16) ? 2 : 1;
+                    uint32_t nplanes = b.nchan - (alpha ? 1 : 0);
+                    size_t npix = (size_t)b.width*b.height;
+                    es.region.resize(npix*nplanes*esize + (alpha ? npix : 0));
+                    crop_planes(b.indata, b.src_height, b.src_width, nplanes, esize, b.y0, b.x0, b.height, b.width, 1, es.region.data());
+                    if (alpha) {
+                        region_alpha.data = es.region.data() + npix*nplanes*esize;
+                        region_alpha.logical = alpha->logical;
+                        crop_planes(alpha->data, b.src_height, b.src_width, 1, 1, b.y0, b.x0, b.height, b.width, 1, es.region.data() + npix*nplanes*esize);
+                        alpha = &region_alpha;
+                    }
+                    indata = es.region.data();
+                }
+                
+                if ((b.classid == mxDOUBLE_CLASS) || (b.classid == mxSINGLE_CLASS)) {
+                    scaled = scale_float_image(indata, (size_t)b.width * b.height * (b.nchan - (alpha ? 1 : 0)), b.classid);
+                    if (!scaled) {
+                        encode_failures++;
+                        continue;
+                    }
+                    indata = scaled;
+                }
+                
+                if (skip_unchanged) {
+                    make_image_stamp(indata, alpha, b.width, b.height, b.nchan, b.bit_depth, b.classid, comp_level, dpm, nstripes, use_palette, reduce, clean_alpha, quant_opts, nl ? nl->max_error : 0, NULL, extra);
+                    if (file_has_stamp(b.filename.c_str(), extra)) {
+                        st.skipped = true;
+                        free(scaled);
+                        continue;
+                    }
+                    extra_len = STAMP_CHUNK_LEN;
+                }
+                
+                if (reduce_image(indata, alpha, b.width, b.height, b.nchan, b.bit_depth, reduce, true, &r)) {
+                    color_type = png_color_type(r.nchan);
+                    bit_depth = r.bit_depth;
+                    if (use_palette || quant_opts->colors)
+                        p = find_image_palette(r.data, r.alpha, b.width, b.height, r.nchan, r.bit_depth, clean_alpha, &pal);
+                    quant = find_image_quantizer(r.data, r.alpha, b.width, b.height, r.nchan, r.bit_depth, p, quant_opts, clean_alpha, &quantizer);
+                    if (quant) {
+                        p = &quant->pal;
+                        r.reductions |= REDUCE_QUANTIZE;
+                    }
+                    if (p) {
+                        extra_len += make_palette_chunks(p, extra + extra_len);
+                        color_type = PNG_COLOR_INDEXED;
+                        bit_depth = palette_index_bits(p);
+                        /* Images are already spread over the threads of the batch */
+                        imgdata = quant ? quantize_image(r.data, r.alpha, b.width, b.height, quant, 1) : index_image(r.data, r.alpha, b.width, b.height, p);
+                    }
+                    else {
+                        imgdata = interleave_image(r.data, r.alpha, b.width, b.height, r.nchan, r.bit_depth, clean_alpha);
+                        if (nl && (bit_depth == 8)) {
+                            img_nl = nl;
+                            r.reductions |= REDUCE_MAXERROR;
+                        }
+                    }
+                }
+                free(r.buf);
+                free(scaled);
+                if (imgdata)
+                    outdata = encode_png_in_memory(imgdata, b.width, b.height, color_type, bit_depth, comp_level, dpm, nstripes, img_nl, extra, extra_len, &es, len);
+                free(imgdata);
+                
+                if (!outdata) {
+                    encode_failures++;
+                    continue;
+                }
+                st.color_type = color_type;
+                st.bit_depth = bit_depth;
+                st.reductions = r.reductions;
+                st.file_size = len;
+                async_writer_submit(writer, b.filename.c_str(), outdata, len);
+            }
+            encoder_state_free(&es);
+        }));
+    }
+    for (i = 0; i < nthreads; i++)
+        workers[i].join();
+    
+    if (async_writer_finish(writer, &first_failed)) {
+        *errid = "savepng:write";
+        snprintf(errmsg, errmsg_len, "Could not write PNG file '%s'.", first_failed.c_str());
+        return false;
+    }
+    if (encode_failures) {
+        *errid = "savepng:encode";
+        snprintf(errmsg, errmsg_len, "Could not encode %u image(s).", (unsigned)encode_failures);
+        return false;
+    }
+    return true;
+}
+
+/* Save a cell array of images to a cell array of file names, see encode_batch() */
+bool save_batch(const mxArray *images, const mxArray *files, uint8_t comp_level, uint32_t dpm, uint32_t nstripes,
+                bool skip_unchanged, bool use_palette, bool reduce, bool clean_alpha, const quantize_options *quant_opts, const near_lossless_table *nl,
+                std::vector<save_stats> &stats,
+                const char **errid, char *errmsg, size_t errmsg_len)
+{
+    size_t n = mxGetNumberOfElements(images), i;
+    std::vector<batch_image> batch(n);
+    
+    if (!mxIsCell(files) || (mxGetNumberOfElements(files) != n)) {
+        *errid = "savepng:nrhs";
+        snprintf(errmsg, errmsg_len, "A cell array of images needs a cell array of as many file names.");
+        return false;
+    }
+    
+    for (i = 0; i < n; i++) {
+        const mxArray *img = mxGetCell(images, i), *f = mxGetCell(files, i);
+        const mwSize *dim_array;
+        char *filename;
+        
+        if (!image_channels(img)) {
+            *errid = "savepng:nrhs";
+            snprintf(errmsg, errmsg_len, "Input must in the image data format of MxN, MxNx2, MxNx3 or MxNx4 matrix of uint8, uint16, single or double, or an MxN logical matrix.");
+            return false;
+        }
+        if (!f || !mxIsChar(f)) {
+            *errid = "savepng:nrhs";
+            snprintf(errmsg, errmsg_len, "File names must be given as a cell array of strings.");
+            return false;
+        }
+        
+        dim_array = mxGetDimensions(img);
+        if ((dim_array[0] > PNG_MAX_DIM) || (dim_array[1] > PNG_MAX_DIM)) {
+            *errid = "savepng:nrhs";
+            snprintf(errmsg, errmsg_len, "Image dimensions must not exceed %u pixels.", (unsigned)PNG_MAX_DIM);
+            return false;
+        }
+        batch[i].indata = (const uint8_t *)mxGetData(img);
+        batch[i].height = dim_array[0];
+        batch[i].width = dim_array[1];
+        batch[i].nchan = image_channels(img);
+        batch[i].bit_depth = image_bit_depth(img);
+        batch[i].classid = mxGetClassID(img);
+        filename = mxArrayToString(f);
+        batch[i].filename = filename;
+        mxFree(filename);
+    }
+    
+    return encode_batch(batch, comp_level, dpm, nstripes, skip_unchanged, use_palette, reduce, clean_alpha, quant_opts, nl,
+                        stats, errid, errmsg, errmsg_len);
+}
+
+/* Halve an image of nchan planes of h*w samples (see halve_plane()), the last plane taken from alpha when it
+ * is not NULL. dst gets nchan planes of halved_size(h)*halved_size(w) samples of 16 bits for a 16-bit
+ * image and 8 bits otherwise, so a logical mask (bit_depth 1) becomes grayscale. */
+void halve_image(const uint8_t *src, const alpha_plane *alpha, uint32_t w, uint32_t h, uint32_t nchan, uint32_t bit_depth, uint8_t *dst)
+{
+    uint32_t esize = (bit_depth == 16) ? 2 : 1, c;
+    size_t plane = (size_t)halved_size(h)*halved_size(w)*esize;
+    
+    for (c = 0; c < nchan; c++) {
+        if (alpha && (c == nchan-1))
+            halve_plane(alpha->data, h, w, alpha->logical, dst + c*plane);
+        else if (esize == 2)
+            halve_plane16((const uint16_t *)src + (size_t)c*h*w, h, w, (uint16_t *)(dst + c*plane));
+        else
+            halve_plane(src + (size_t)c*h*w, h, w, bit_depth == 1, dst + c*plane);
+    }
+}
+
+/* Thumbnails of an image, one per file name in files, each halved from the one before (see halve_plane()).
+ * The image has nchan planes of 8 or 16-bit samples, or is a logical mask (bit_depth 1); the last plane
+ * is taken from alpha when it is not NULL. The thumbnails are written to one buffer, returned for the
+ * caller to free, and described in thumbs as images of a batch with 8 or 16-bit samples and the alpha
+ * plane last. Returns NULL when out of memory. */
+uint8_t* make_thumbnails(const uint8_t *indata, const alpha_plane *alpha, uint32_t width, uint32_t height, uint32_t nchan, uint32_t bit_depth,
+                         const mxArray *files, std::vector<batch_image> &thumbs)
+{
+    size_t n = mxGetNumberOfElements(files), total = 0, i;
+    uint32_t esize = (bit_depth == 16) ? 2 : 1, h = height, w = width;
+    const uint8_t *prev = indata;
+    uint8_t *levels, *level;
+    
+    for (i = 0; i < n; i++) {
+        h = halved_size(h);
+        w = halved_size(w);
+        total += (size_t)h*w*nchan*esize;
+    }
+    levels = (uint8_t *)malloc(total ? total : 1);
+    if (!levels) return NULL;
+    
+    thumbs.resize(n);
+    level = levels;
+    h = height;
+    w = width;
+    for (i = 0; i < n; i++) {
+        uint32_t lh = halved_size(h), lw = halved_size(w);
+        char *filename;
+        
+        if (i == 0)
+            halve_image(indata, alpha, w, h, nchan, bit_depth, level);
+        else
+            halve_image(prev, NULL, w, h, nchan, (esize == 2) ? 16 : 8, level);
+        thumbs[i].indata = level;
+        thumbs[i].height = lh;
+        thumbs[i].width = lw;
+        thumbs[i].nchan = nchan;
+        thumbs[i].bit_depth = (esize == 2) ? 16 : 8;
+        thumbs[i].classid = (esize == 2) ? mxUINT16_CLASS : mxUINT8_CLASS;
+        filename = mxArrayToString(mxGetCell(files, i));
+        thumbs[i].filename = filename;
+        mxFree(filename);
+        
+        prev = level;
+        level += (size_t)lh*lw*nchan*esize;
+        h = lh;
+        w = lw;
+    }
+    return levels;
+}
+
+/* Create a directory, which may exist already */
+bool make_directory(const char *path)
+{
+#if SAVEPNG_POSIX
+    return (mkdir(path, 0777) == 0) || (errno == EEXIST);
+#else
+    return (_mkdir(path) == 0) || (errno == EEXIST);
+#endif
+}
+
+/* Deep Zoom (DZI) tile pyramid of an image: the descriptor written to filename and, in the directory
+ * named after it with "_files" in place of its extension, a directory per level holding the tiles as
+ * <column>_<row>.png. The top level is the image, each level below it the one above halved (see
+ * halve_image()), down to a single pixel at level 0. Tiles are tile_size pixels square plus overlap
+ * pixels on each side that has a neighbour. Each level is saved as a batch of regions of its planes,
+ * which the encoding threads cut out themselves, and the level below is halved from it once its tiles
+ * are written, so at most two levels are held at a time. The outcome for each tile goes to stats, level
+ * by level from the top and column by column. Returns false with the error identifier and message
+ * filled in on failure. */
+bool save_tiles(const uint8_t *indata, const alpha_plane *alpha, uint32_t width, uint32_t height, uint32_t nchan, uint32_t bit_depth,
+                const char *filename, uint32_t tile_size, uint32_t overlap,
+                uint8_t comp_level, uint32_t dpm, bool skip_unchanged, bool use_palette, bool reduce, bool clean_alpha,
+                const quantize_options *quant_opts, const near_lossless_table *nl,
+                std::vector<save_stats> &stats,
+                const char **errid, char *errmsg, size_t errmsg_len)
+{
+    std::string base(filename), dir;
+    size_t dot = base.find_last_of('.'), sep = base.find_last_of("/\\");
+    uint32_t max_level = 0, level, w = width, h = height, side = (width > height) ? width : height;
+    const uint8_t *planes = indata;
+    uint8_t *owned = NULL;          /* planes of the current level below the top */
+    bool ok = true;
+    FILE *file;
+    
+    if ((dot != std::string::npos) && ((sep == std::string::npos) || (dot > sep)))
+        base.erase(dot);
+    dir = base + "_files";
+    while (((uint64_t)1 << max_level) < side)
+        max_level++;
+    
+    stats.clear();
+    if (!make_directory(dir.c_str())) {
+        *errid = "savepng:write";
+        snprintf(errmsg, errmsg_len, "Could not create directory '%s'.", dir.c_str());
+        return false;
+    }
+    
+    for (level = max_level; ; level--) {
+        std::string level_dir = dir + "/" + std::to_string(level);
+        uint32_t cols = (uint32_t)(((uint64_t)w + tile_size - 1) / tile_size), rows = (uint32_t)(((uint64_t)h + tile_size - 1) / tile_size), c, r;
+        std::vector<batch_image> tiles((size_t)cols*rows);
+        std::vector<save_stats> level_stats;
+        uint8_t *next;
+        
+        if (!make_directory(level_dir.c_str())) {
+            *errid = "savepng:write";
+            snprintf(errmsg, errmsg_len, "Could not create directory '%s'.", level_dir.c_str());
+            ok = false;
+            break;
+        }
+        for (c = 0; c < cols; c++) {
+            for (r = 0; r < rows; r++) {
+                batch_image &t = tiles[(size_t)c*rows + r];
+                uint64_t x0 = (uint64_t)c*tile_size - (c ? overlap : 0), y0 = (uint64_t)r*tile_size - (r ? overlap : 0);
+                uint64_t x1 = (uint64_t)(c+1)*tile_size + overlap, y1 = (uint64_t)(r+1)*tile_size + overlap;
+                t.indata = planes;
+                t.alpha = alpha;
+                t.src_height = h;
+                t.src_width = w;
+                t.y0 = (uint32_t)y0;
+                t.x0 = (uint32_t)x0;
+                t.height = (uint32_t)(((y1 < h) ? y1 : h) - y0);
+                t.width = (uint32_t)(((x1 < w) ? x1 : w) - x0);
+                t.nchan = nchan;
+                t.bit_depth = bit_depth;
+                t.classid = (bit_depth == 16) ? mxUINT16_CLASS : (bit_depth == 1) ? mxLOGICAL_CLASS : mxUINT8_CLASS;
+                t.filename = level_dir + "/" + std::to_string(c) + "_" + std::to_string(r) + ".png";
+            }
+        }
+        ok = encode_batch(tiles, comp_level, dpm, 1, skip_unchanged, use_palette, reduce, clean_alpha, quant_opts, nl,
+                          level_stats, errid, errmsg, errmsg_len);
+        stats.insert(stats.end(), level_stats.begin(), level_stats.end());
+        if (!ok || (level == 0)) break;
+        
+        next = (uint8_t *)malloc((size_t)halved_size(w)*halved_size(h)*nchan*((bit_depth == 16) ? 2 : 1));
+        if (!next) {
+            *errid = "savepng:memory";
+            snprintf(errmsg, errmsg_len, "Out of memory.");
+            ok = false;
+            break;
+        }
+        halve_image(planes, alpha, w, h, nchan, bit_depth, next);
+        free(owned);
+        owned = next;
+        planes = next;
+        alpha = NULL;
+        if (bit_depth == 1) bit_depth = 8;
+        w = halved_size(w);
+        h = halved_size(h);
+    }
+    free(owned);
+    if (!ok) return false;
+    
+    /* The descriptor goes last, so a viewer never finds it before the tiles */
+    file = fopen(filename, "w");
+    if (file) {
+        ok = fprintf(file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                           "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"png\" Overlap=\"%u\" TileSize=\"%u\">\n"
+                           "  <Size Width=\"%u\" Height=\"%u\"/>\n"
+                           "</Image>\n", (unsigned)overlap, (unsigned)tile_size, (unsigned)width, (unsigned)height) > 0;
+        ok = (fclose(file) == 0) && ok;
+    }
+    if (!file || !ok) {
+        *errid = "savepng:write";
+        snprintf(errmsg, errmsg_len, "Could not write file '%s'.", filename);
+        return false;
+    }
+    return true;
+}
+
+/* STATS output of one image: the image first, then its thumbnails in order */
+mxArray* create_image_stats(const save_stats *st, const std::vector<save_stats> &thumb_stats)
+{
+    std::vector<save_stats> all(1, *st);
+    mwSize dims[2] = { 1, (mwSize)(1 + thumb_stats.size()) };
+    
+    all.insert(all.end(), thumb_stats.begin(), thumb_stats.end());
+    return create_stats(2, dims, all.data());
 }
 
 /* The gateway function */
@@ -161,17 +1805,60 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
     uint8_t *imgdata = NULL;  /* packed raw pixel matrix */
     uint8_t *indata;          /* input image data matrix */
+    uint8_t *scaled = NULL;   /* 8-bit planes of a floating point image, or colormap indices */
     uint32_t width, height, nchan;  /* size of matrix */
+    uint32_t bit_depth;       /* bits per sample, 8 or 16 */
+    uint8_t color_type;       /* PNG colour type written */
     uint8_t comp_level;       /* compression level */
     const mwSize *dim_array; 
-    uint32_t x, y, idx;
     uint32_t dpm;             /* dots per meter */
-    FILE* file;
+    int iarg;
     
     char *filename = NULL;
     size_t filenamelen;
-    //size_t filelen;
-    uint32_t filelen;
+    
+    bool skip_unchanged = false;    /* embed and check content hash chunk */
+    bool use_palette = true;        /* indexed colour for images with few colours */
+    bool reduce = true;             /* lossless channel and bit depth reductions */
+    bool clean_alpha = false;       /* write fully transparent pixels as all zero */
+    reduced_image r;
+    save_stats stats;               /* optional output */
+    image_palette pal;
+    const image_palette *p = NULL;
+    quantize_options quant_opts = { 0, QUANTIZE_SPEED_DEFAULT, true };  /* lossy palette, off by default */
+    image_quantizer quantizer;
+    const image_quantizer *quant = NULL;
+    uint32_t max_error = 0;         /* near-lossless rounding, off by default */
+    near_lossless_table nl_table;
+    const near_lossless_table *nl = NULL;
+    const mxArray *cmap = NULL;     /* colormap of a scalar field, saved as the palette */
+    const mxArray *alpha_arg = NULL;    /* alpha matrix passed apart from the image */
+    const uint8_t *alpha_src = NULL;
+    alpha_plane alpha_data;
+    const alpha_plane *alpha = NULL;
+    const mxArray *fname_arg;
+    double clim[2];
+    bool has_clim = false;
+    double roi[4];                  /* [row col height width] of the region saved, 1-based */
+    bool has_roi = false;
+    uint32_t step = 1;              /* every step-th row and column of the region is saved */
+    uint8_t *cropped = NULL;        /* region gathered from the input */
+    const mxArray *thumb_arg = NULL;    /* file names of the thumbnails, each half the size of the last */
+    std::vector<batch_image> thumbs;
+    std::vector<save_stats> thumb_stats;
+    uint8_t *thumb_levels = NULL;   /* pixels of the thumbnails */
+    std::thread thumb_worker;       /* encodes the thumbnails while the image is encoded */
+    bool thumbs_ok = true;
+    uint32_t tile_size = 0;         /* Deep Zoom tiles instead of a single file when not 0 */
+    uint32_t tile_overlap = 1;
+    uint8_t extra[STAMP_CHUNK_LEN + PALETTE_CHUNKS_LEN];    /* stamp, PLTE and tRNS chunks */
+    uint32_t extra_len = 0;
+    uint32_t nstripes = 1;          /* independently decodable stripes */
+    int io_mode = IO_STDIO;         /* how the output file is written */
+    bool streaming = false;         /* encode band by band in bounded memory */
+    bool write_failed = false;
+    const char *errid = NULL;
+    char errmsg[1024];
     
     /* Default number of probes */
     comp_level = 4;
@@ -183,15 +1870,162 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     if(nrhs<2) {
         mexErrMsgIdAndTxt("savepng:nrhs","At least two inputs required.");
     }
+    if(nlhs>1) {
+        mexErrMsgIdAndTxt("savepng:nlhs","At most one output (STATS) is returned.");
+    }
+    
+    /* savepng(Z,map,filename,...) saves a scalar field through a colormap */
+    if ((nrhs>2) && !mxIsCell(prhs[0]) && mxIsDouble(prhs[1])) {
+        cmap = prhs[1];
+    }
+    fname_arg = prhs[cmap ? 2 : 1];
     
     /* Check if compression level is commanded */
-    if(nrhs>=3) {
-        comp_level = mxGetScalar(prhs[2]);
+    iarg = cmap ? 3 : 2;
+    if((nrhs>iarg) && !mxIsChar(prhs[iarg])) {
+        comp_level = mxGetScalar(prhs[iarg++]);
     }
     
     /* Check if image resolution is commanded and convert to DPI to DPM */
-    if(nrhs>=4) {
-        dpm = ((double)mxGetScalar(prhs[3])*39.36996);
+    if((nrhs>iarg) && !mxIsChar(prhs[iarg])) {
+        dpm = ((double)mxGetScalar(prhs[iarg++])*39.36996);
+    }
+    
+    /* Remaining arguments are name/value pairs */
+    for(; iarg<nrhs; iarg+=2) {
+        char name[32];
+        if(!mxIsChar(prhs[iarg]) || (iarg+1>=nrhs)) {
+            mexErrMsgIdAndTxt("savepng:nrhs","Optional parameters must be given as name/value pairs.");
+        }
+        mxGetString(prhs[iarg], name, sizeof(name));
+        if(option_is(name,"SkipUnchanged")) {
+            skip_unchanged = (mxGetScalar(prhs[iarg+1])!=0);
+        }
+        else if(option_is(name,"Stripes")) {
+            double n = mxGetScalar(prhs[iarg+1]);
+            if(!(n>=1) || (n>65536)) {
+                mexErrMsgIdAndTxt("savepng:nrhs","Stripes must be between 1 and 65536.");
+            }
+            nstripes = (uint32_t)n;
+        }
+        else if(option_is(name,"Palette")) {
+            use_palette = (mxGetScalar(prhs[iarg+1])!=0);
+        }
+        else if(option_is(name,"Reduce")) {
+            reduce = (mxGetScalar(prhs[iarg+1])!=0);
+        }
+        else if(option_is(name,"CleanAlpha")) {
+            clean_alpha = (mxGetScalar(prhs[iarg+1])!=0);
+        }
+        else if(option_is(name,"Quantize")) {
+            double n = mxGetScalar(prhs[iarg+1]);
+            if(!((n==0) || ((n>=2) && (n<=PALETTE_MAX_COLORS)))) {
+                mexErrMsgIdAndTxt("savepng:nrhs","Quantize must be 0 or between 2 and %u.",(unsigned)PALETTE_MAX_COLORS);
+            }
+            quant_opts.colors = (uint32_t)n;
+        }
+        else if(option_is(name,"QuantizeSpeed")) {
+            double n = mxGetScalar(prhs[iarg+1]);
+            if(!(n>=QUANTIZE_SPEED_MIN) || (n>QUANTIZE_SPEED_MAX)) {
+                mexErrMsgIdAndTxt("savepng:nrhs","QuantizeSpeed must be between %u and %u.",(unsigned)QUANTIZE_SPEED_MIN,(unsigned)QUANTIZE_SPEED_MAX);
+            }
+            quant_opts.speed = (uint32_t)n;
+        }
+        else if(option_is(name,"Dither")) {
+            quant_opts.dither = (mxGetScalar(prhs[iarg+1])!=0);
+        }
+        else if(option_is(name,"MaxError")) {
+            double n = mxGetScalar(prhs[iarg+1]);
+            if(!(n>=0) || (n>NEAR_LOSSLESS_MAX_ERROR)) {
+                mexErrMsgIdAndTxt("savepng:nrhs","MaxError must be between 0 and %u.",(unsigned)NEAR_LOSSLESS_MAX_ERROR);
+            }
+            max_error = (uint32_t)n;
+        }
+        else if(option_is(name,"CLim")) {
+            const mxArray *v = prhs[iarg+1];
+            if(!mxIsDouble(v) || (mxGetNumberOfElements(v)!=2) || !(mxGetPr(v)[0]<mxGetPr(v)[1])) {
+                mexErrMsgIdAndTxt("savepng:nrhs","CLim must be a vector [lo hi] with lo < hi.");
+            }
+            clim[0] = mxGetPr(v)[0];
+            clim[1] = mxGetPr(v)[1];
+            has_clim = true;
+        }
+        else if(option_is(name,"ROI")) {
+            const mxArray *v = prhs[iarg+1];
+            uint32_t k;
+            if(!mxIsDouble(v) || (mxGetNumberOfElements(v)!=4)) {
+                mexErrMsgIdAndTxt("savepng:nrhs","ROI must be a vector [row col height width] of positive integers.");
+            }
+            for (k = 0; k < 4; k++) {
+                roi[k] = mxGetPr(v)[k];
+                if(!(roi[k]>=1) || (roi[k]>PNG_MAX_DIM) || (roi[k]!=(double)(uint32_t)roi[k])) {
+                    mexErrMsgIdAndTxt("savepng:nrhs","ROI must be a vector [row col height width] of positive integers.");
+                }
+            }
+            has_roi = true;
+        }
+        else if(option_is(name,"Step")) {
+            double n = mxGetScalar(prhs[iarg+1]);
+            if(!(n>=1) || (n>PNG_MAX_DIM) || (n!=(double)(uint32_t)n)) {
+                mexErrMsgIdAndTxt("savepng:nrhs","Step must be a positive integer.");
+            }
+            step = (uint32_t)n;
+        }
+        else if(option_is(name,"Thumbnails")) {
+            const mxArray *v = prhs[iarg+1];
+            size_t k;
+            if(!mxIsCell(v) || !mxGetNumberOfElements(v)) {
+                mexErrMsgIdAndTxt("savepng:nrhs","Thumbnails must be a cell array of file names.");
+            }
+            for (k = 0; k < mxGetNumberOfElements(v); k++) {
+                if(!mxGetCell(v,k) || !mxIsChar(mxGetCell(v,k))) {
+                    mexErrMsgIdAndTxt("savepng:nrhs","Thumbnails must be a cell array of file names.");
+                }
+            }
+            thumb_arg = v;
+        }
+        else if(option_is(name,"Tiles")) {
+            double n = mxGetScalar(prhs[iarg+1]);
+            if(!(n>=1) || (n>PNG_MAX_DIM) || (n!=(double)(uint32_t)n)) {
+                mexErrMsgIdAndTxt("savepng:nrhs","Tiles must be a positive integer tile size.");
+            }
+            tile_size = (uint32_t)n;
+        }
+        else if(option_is(name,"TileOverlap")) {
+            double n = mxGetScalar(prhs[iarg+1]);
+            if(!(n>=0) || (n>PNG_MAX_DIM) || (n!=(double)(uint32_t)n)) {
+                mexErrMsgIdAndTxt("savepng:nrhs","TileOverlap must be a non-negative integer.");
+            }
+            tile_overlap = (uint32_t)n;
+        }
+        else if(option_is(name,"Alpha")) {
+            alpha_arg = prhs[iarg+1];
+        }
+        else if(option_is(name,"Streaming")) {
+            streaming = (mxGetScalar(prhs[iarg+1])!=0);
+        }
+        else if(option_is(name,"IO")) {
+            char mode[16];
+            if(!mxIsChar(prhs[iarg+1])) {
+                mexErrMsgIdAndTxt("savepng:nrhs","IO must be 'stdio', 'mmap', 'posix' or 'direct'.");
+            }
+            mxGetString(prhs[iarg+1], mode, sizeof(mode));
+            /* Modes that are not available on this platform fall back to stdio */
+            if(option_is(mode,"stdio"))
+                io_mode = IO_STDIO;
+            else if(option_is(mode,"mmap"))
+                io_mode = SAVEPNG_POSIX ? IO_MMAP : IO_STDIO;
+            else if(option_is(mode,"posix"))
+                io_mode = SAVEPNG_POSIX ? IO_POSIX : IO_STDIO;
+            else if(option_is(mode,"direct"))
+                io_mode = SAVEPNG_DIRECT ? IO_DIRECT : SAVEPNG_POSIX ? IO_POSIX : IO_STDIO;
+            else {
+                mexErrMsgIdAndTxt("savepng:nrhs","IO must be 'stdio', 'mmap', 'posix' or 'direct'.");
+            }
+        }
+        else {
+            mexErrMsgIdAndTxt("savepng:nrhs","Unknown parameter '%s'.",name);
+        }
     }
     
     /* Check probes range */
@@ -199,76 +2033,400 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         mexErrMsgIdAndTxt("savepng:nrhs","Compression level must be between 0 and 14.");
     }
     
-    /* Get the number of dimensions in the input argument. */
-    dim_array = mxGetDimensions(prhs[0]);
+    if (has_clim && !cmap) {
+        mexErrMsgIdAndTxt("savepng:nrhs","CLim only applies to images saved with a colormap.");
+    }
     
-    if((!mxIsUint8(prhs[0])) || (mxGetNumberOfDimensions(prhs[0])!=3) || !(dim_array[2]==3 || dim_array[2]==4)) {
-        mexErrMsgIdAndTxt("savepng:nrhs","Input must in the image data format of MxNx3 or MxNx4 matrix of uint8.");
+    if (alpha_arg && (cmap || mxIsCell(prhs[0]))) {
+        mexErrMsgIdAndTxt("savepng:nrhs","Alpha does not apply to batch saves or images saved with a colormap.");
+    }
+    
+    if (thumb_arg && (cmap || mxIsCell(prhs[0]))) {
+        mexErrMsgIdAndTxt("savepng:nrhs","Thumbnails do not apply to batch saves or images saved with a colormap.");
+    }
+    
+    if (tile_size && (cmap || mxIsCell(prhs[0]))) {
+        mexErrMsgIdAndTxt("savepng:nrhs","Tiles do not apply to batch saves or images saved with a colormap.");
+    }
+    
+    if (tile_size && (thumb_arg || streaming)) {
+        mexErrMsgIdAndTxt("savepng:nrhs","Tiles cannot be combined with Thumbnails or Streaming.");
+    }
+    
+    if (tile_size && (tile_overlap > tile_size)) {
+        mexErrMsgIdAndTxt("savepng:nrhs","TileOverlap must not exceed the tile size.");
+    }
+    
+    if ((has_roi || (step>1)) && mxIsCell(prhs[0])) {
+        mexErrMsgIdAndTxt("savepng:nrhs","ROI and Step do not apply to batch saves.");
+    }
+    
+    /* Colormap indices are written as they are */
+    if (cmap) {
+        use_palette = false;
+        reduce = false;
+        quant_opts.colors = 0;
+        max_error = 0;
+    }
+    
+    /* Level 0 stores the pixels as they are */
+    if (comp_level==0) {
+        use_palette = false;
+        reduce = false;
+        quant_opts.colors = 0;
+        max_error = 0;
     }
     
     if (~fpng_initialized) {
         fpng::fpng_init();
         fpng_initialized = 1;
     }
+    
+    /* Rounding table for MaxError, shared with the threads of a batch or of the thumbnails */
+    if (max_error)
+        near_lossless_init(max_error, &nl_table);
+    
+    /* Batch of images, written asynchronously */
+    if (mxIsCell(prhs[0])) {
+        std::vector<save_stats> batch_stats;
+        if (max_error)
+            nl = &nl_table;
+        if (!save_batch(prhs[0], prhs[1], comp_level, dpm, nstripes, skip_unchanged, use_palette, reduce, clean_alpha, &quant_opts, nl, batch_stats, &errid, errmsg, sizeof(errmsg))) {
+            mexErrMsgIdAndTxt(errid, "%s", errmsg);
+        }
+        if (nlhs>0)
+            plhs[0] = create_stats(mxGetNumberOfDimensions(prhs[0]), mxGetDimensions(prhs[0]), batch_stats.data());
+        return;
+    }
+    
+    /* Get the number of dimensions in the input argument. */
+    dim_array = mxGetDimensions(prhs[0]);
+    
+    if (cmap) {
+        if ((mxGetNumberOfDimensions(prhs[0])!=2) || (image_channels(prhs[0])!=1)) {
+            mexErrMsgIdAndTxt("savepng:nrhs","With a colormap, the input must be an MxN matrix of uint8, uint16, single or double.");
+        }
+        if (!colormap_palette(cmap, &pal)) {
+            mexErrMsgIdAndTxt("savepng:nrhs","The colormap must be a Kx3 matrix of values between 0 and 1 with at most %u rows.",(unsigned)PALETTE_MAX_COLORS);
+        }
+    }
+    else if(!image_channels(prhs[0])) {
+        mexErrMsgIdAndTxt("savepng:nrhs","Input must in the image data format of MxN, MxNx2, MxNx3 or MxNx4 matrix of uint8, uint16, single or double, or an MxN logical matrix.");
+    }
+
+    if((dim_array[0]>PNG_MAX_DIM) || (dim_array[1]>PNG_MAX_DIM)) {
+        mexErrMsgIdAndTxt("savepng:nrhs","Image dimensions must not exceed %u pixels.",(unsigned)PNG_MAX_DIM);
+    }
+    
+    if (alpha_arg) {
+        if (!(image_channels(prhs[0]) & 1) || (image_bit_depth(prhs[0]) != 8)) {
+            mexErrMsgIdAndTxt("savepng:nrhs","Alpha applies to MxN and MxNx3 images of uint8, single or double.");
+        }
+        if (!(mxIsUint8(alpha_arg) || mxIsLogical(alpha_arg)) || (mxGetNumberOfDimensions(alpha_arg)!=2) ||
+            (mxGetM(alpha_arg)!=dim_array[0]) || (mxGetN(alpha_arg)!=dim_array[1])) {
+            mexErrMsgIdAndTxt("savepng:nrhs","Alpha must be an MxN matrix of uint8 or logical the size of the image.");
+        }
+    }
 
     /* Pointer to image input data */
     indata = (uint8_t *)mxGetPr(prhs[0]); 
 
     /* Get dimensions of input matrices */
-    nchan = dim_array[2];
+    nchan = image_channels(prhs[0]);
+    bit_depth = image_bit_depth(prhs[0]);
     height = dim_array[0];  
     width = dim_array[1];
+    if (alpha_arg)
+        alpha_src = (const uint8_t *)mxGetData(alpha_arg);
+    
+    /* Only the rows and columns saved are gathered from the input (and the alpha matrix), so a crop or a
+     * decimated view costs in proportion to its own size, before any other pass over the pixels */
+    if (has_roi || (step>1)) {
+        uint32_t r0 = 0, c0 = 0, rh = height, rw = width, esize = (uint32_t)mxGetElementSize(prhs[0]);
+        size_t n;
+        if (has_roi) {
+            if ((roi[0]+roi[2]-1>height) || (roi[1]+roi[3]-1>width)) {
+                mexErrMsgIdAndTxt("savepng:nrhs","ROI must lie within the %u by %u image.",(unsigned)height,(unsigned)width);
+            }
+            r0 = (uint32_t)roi[0] - 1;
+            c0 = (uint32_t)roi[1] - 1;
+            rh = (uint32_t)roi[2];
+            rw = (uint32_t)roi[3];
+        }
+        rh = (rh + step - 1) / step;
+        rw = (rw + step - 1) / step;
+        n = (size_t)rh*rw;
+        cropped = (uint8_t *)malloc(n*nchan*esize + (alpha_arg ? n : 0) + 1);
+        if (!cropped) {
+            mexErrMsgIdAndTxt("savepng:memory","Out of memory.");
+        }
+        crop_planes(indata, height, width, nchan, esize, r0, c0, rh, rw, step, cropped);
+        if (alpha_arg) {
+            crop_planes(alpha_src, height, width, 1, 1, r0, c0, rh, rw, step, cropped + n*nchan*esize);
+            alpha_src = cropped + n*nchan*esize;
+        }
+        indata = cropped;
+        height = rh;
+        width = rw;
+    }
+    
+    /* A scalar field becomes one plane of colormap indices, in a single pass */
+    if (cmap) {
+        scaled = colormap_image(indata, (size_t)width*height, mxGetClassID(prhs[0]), has_clim ? clim : NULL, pal.ncolors);
+        if (!scaled) {
+            free(cropped);
+            mexErrMsgIdAndTxt("savepng:memory","Out of memory.");
+        }
+        indata = scaled;
+        bit_depth = 8;
+    }
+    /* Floating point images in [0,1] are scaled to 8 bits here rather than by im2uint8 in MATLAB */
+    else if (mxIsDouble(prhs[0]) || mxIsSingle(prhs[0])) {
+        scaled = scale_float_image(indata, (size_t)width*height*nchan, mxGetClassID(prhs[0]));
+        if (!scaled) {
+            free(cropped);
+            mexErrMsgIdAndTxt("savepng:memory","Out of memory.");
+        }
+        indata = scaled;
+    }
+    /* Gathered samples are done with once converted, unless they hold the alpha plane */
+    if (scaled && !alpha_arg) {
+        free(cropped);
+        cropped = NULL;
+    }
+    
+    /* The alpha matrix is read in place as one more channel, rather than concatenated in MATLAB */
+    if (alpha_arg) {
+        alpha_data.data = alpha_src;
+        alpha_data.logical = mxIsLogical(alpha_arg);
+        alpha = &alpha_data;
+        nchan++;
+    }
+    
+    /* A Deep Zoom pyramid of tiles is written in place of a single file */
+    if (tile_size) {
+        std::vector<save_stats> tile_stats;
+        char *name = mxArrayToString(fname_arg);
+        bool ok = save_tiles(indata, alpha, width, height, nchan, bit_depth, name, tile_size, tile_overlap,
+                             comp_level, dpm, skip_unchanged, use_palette, reduce, clean_alpha, &quant_opts, max_error ? &nl_table : NULL,
+                             tile_stats, &errid, errmsg, sizeof(errmsg));
+        mxFree(name);
+        free(scaled);
+        free(cropped);
+        if (!ok) {
+            mexErrMsgIdAndTxt(errid, "%s", errmsg);
+        }
+        if (nlhs>0) {
+            mwSize dims[2] = { 1, (mwSize)tile_stats.size() };
+            plhs[0] = create_stats(2, dims, tile_stats.data());
+        }
+        return;
+    }
+    
+    /* Thumbnails are halved from the planes level by level, then encoded on other threads while this
+     * thread goes on with the image; the threads read only the thumbnails' own pixels */
+    if (thumb_arg) {
+        thumb_levels = make_thumbnails(indata, alpha, width, height, nchan, bit_depth, thumb_arg, thumbs);
+        if (!thumb_levels) {
+            free(scaled);
+            free(cropped);
+            mexErrMsgIdAndTxt("savepng:memory","Out of memory.");
+        }
+        thumb_worker = std::thread([&, comp_level]() {
+            thumbs_ok = encode_batch(thumbs, comp_level, dpm, nstripes, skip_unchanged, use_palette, reduce, clean_alpha, &quant_opts,
+                                     max_error ? &nl_table : NULL, thumb_stats, &errid, errmsg, sizeof(errmsg));
+        });
+    }
+    /* Wait for the thumbnails, if any; false when they could not all be saved */
+    auto finish_thumbnails = [&]() -> bool {
+        if (thumb_worker.joinable())
+            thumb_worker.join();
+        free(thumb_levels);
+        thumb_levels = NULL;
+        return thumbs_ok;
+    };
 
     /* Fetch output filename */
-    filenamelen = mxGetN(prhs[1])*sizeof(mxChar)+1;
+    filenamelen = mxGetN(fname_arg)*sizeof(mxChar)+1;
     filename = (char *)malloc(filenamelen);
-    mxGetString(prhs[1], filename, (mwSize)filenamelen);
+    mxGetString(fname_arg, filename, (mwSize)filenamelen);
     
-    /* Convert MATLAB image to raw pixels */
-    /* indata format: RRRRRR..., GGGGGG..., BBBBBB... */
-    /* outdata format: RGB, RGB, RGB, ... */
-    imgdata = (uint8_t *)malloc(width * height * nchan);
+    /* Skip encoding and writing altogether when the file already holds this image */
+    if (skip_unchanged) {
+        make_image_stamp(indata, alpha, width, height, nchan, bit_depth, mxGetClassID(prhs[0]), comp_level, dpm, nstripes, use_palette, reduce, clean_alpha, &quant_opts, max_error, cmap ? &pal : NULL, extra);
+        
+        if (file_has_stamp(filename, extra)) {
+            free(filename);
+            free(scaled);
+            free(cropped);
+            if (!finish_thumbnails()) {
+                mexErrMsgIdAndTxt(errid, "%s", errmsg);
+            }
+            if (nlhs>0) {
+                memset(&stats, 0, sizeof(stats));
+                stats.skipped = true;
+                plhs[0] = create_image_stats(&stats, thumb_stats);
+            }
+            return;
+        }
+        extra_len = STAMP_CHUNK_LEN;
+    }
     
-    idx = 0;    
-    for(y = 0; y < height; y++)
-    {
-        for(x = 0; x < width; x++) 
-        {
-            imgdata[idx++] = indata[x*height + y];                      /* red */
-            imgdata[idx++] = indata[1*width*height + x*height + y];     /* green */
-            imgdata[idx++] = indata[2*width*height + x*height + y];     /* blue */
-            if (nchan==4)
-            	imgdata[idx++] = indata[3*width*height + x*height + y]; /* alpha */
+    /* Smallest lossless layout; streaming only selects planes of the input, never copies them */
+    if (!reduce_image(indata, alpha, width, height, nchan, bit_depth, reduce, !streaming, &r)) {
+        free(filename);
+        free(r.buf);
+        free(scaled);
+        free(cropped);
+        finish_thumbnails();
+        mexErrMsgIdAndTxt("savepng:memory","Out of memory.");
+    }
+    indata = (uint8_t *)r.data;
+    nchan = r.nchan;
+    bit_depth = r.bit_depth;
+    
+    /* Images of up to 256 colours are written as palette indices, others quantized to one when asked to */
+    if (use_palette || quant_opts.colors)
+        p = find_image_palette(indata, r.alpha, width, height, nchan, bit_depth, clean_alpha, &pal);
+    quant = find_image_quantizer(indata, r.alpha, width, height, nchan, bit_depth, p, &quant_opts, clean_alpha, &quantizer);
+    if (quant) {
+        p = &quant->pal;
+        r.reductions |= REDUCE_QUANTIZE;
+    }
+    if (cmap) p = &pal;
+    if (p) extra_len += make_palette_chunks(p, extra + extra_len);
+    
+    /* Near-lossless rounding of 8-bit samples; palette indices are never rounded */
+    if (max_error && !p && (bit_depth == 8)) {
+        nl = &nl_table;
+        r.reductions |= REDUCE_MAXERROR;
+    }
+    
+    memset(&stats, 0, sizeof(stats));
+    stats.color_type = p ? PNG_COLOR_INDEXED : png_color_type(nchan);
+    stats.bit_depth = p ? palette_index_bits(p) : bit_depth;
+    stats.reductions = r.reductions;
+    
+    /* Encode band by band straight from the MATLAB image, without a full copy of the pixels or the file */
+    if (streaming) {
+        FILE *file = fopen(filename, "wb");
+        free(filename);
+        
+        if (!file) {
+            free(scaled);
+            free(cropped);
+            finish_thumbnails();
+            mexErrMsgIdAndTxt("savepng:write","Could not write PNG file.");
+        }
+        write_failed = !write_png_streaming(file, indata, r.alpha, width, height, nchan, bit_depth, p, quant, clean_alpha, nl, (comp_level<=2) ? 1 : comp_level-2, dpm, extra, extra_len);
+        free(scaled);
+        free(cropped);
+        stats.file_size = write_failed ? 0 : (uint64_t)ftell(file);
+        if (fclose(file) != 0)
+            write_failed = true;
+        
+        if (!finish_thumbnails() && !write_failed) {
+            mexErrMsgIdAndTxt(errid, "%s", errmsg);
+        }
+        if (write_failed) {
+            mexErrMsgIdAndTxt("savepng:write","Could not write PNG file.");
         }
+        if (nlhs>0)
+            plhs[0] = create_image_stats(&stats, thumb_stats);
+        return;
+    }
+    
+    /* Convert MATLAB image to raw pixels, or palette indices */
+    if (p) {
+        imgdata = quant ? quantize_image(indata, r.alpha, width, height, quant, 0) : index_image(indata, r.alpha, width, height, p);
+        color_type = PNG_COLOR_INDEXED;
+        bit_depth = palette_index_bits(p);
+    }
+    else {
+        imgdata = interleave_image(indata, r.alpha, width, height, nchan, bit_depth, clean_alpha);
+        color_type = png_color_type(nchan);
+    }
+    free(r.buf);
+    free(scaled);
+    free(cropped);
+    if (!imgdata) {
+        free(filename);
+        finish_thumbnails();
+        mexErrMsgIdAndTxt("savepng:memory","Out of memory.");
     }
     
     /* Encode PNG in memory */
+    comp_level = fpng_effective_level(comp_level, width, height, color_type, bit_depth, nstripes);
+    
     if (comp_level<=2) {
-        uint32_t fpng_flags = 0;
+        uint32_t fpng_flags = (bit_depth==16) ? fpng::FPNG_SAMPLES_16BIT : 0;
         if (comp_level==0)
             fpng_flags |= fpng::FPNG_FORCE_UNCOMPRESSED;
         else if (comp_level==2)
             fpng_flags |= fpng::FPNG_ENCODE_SLOWER;
+        if (nl)
+            near_lossless_image(nl, imgdata, png_row_bytes(width, color_type, bit_depth), height, nchan);
 
         std::vector<uint8_t> outdata;
-        if (fpng::fpng_encode_image_to_memory((uint8_t *)imgdata, width, height, nchan, outdata, fpng_flags))
+        if (!fpng::fpng_encode_image_to_memory((uint8_t *)imgdata, width, height, png_channels(color_type), outdata, fpng_flags))
         {
-            /* Write to file */
-            file = fopen(filename, "wb" );
-            if(!file) return;
-            fwrite(outdata.data(), 1, outdata.size(), file);
-            fclose(file);
+            write_failed = true;
+        }
+
+#if SAVEPNG_POSIX
+        else if (io_mode==IO_MMAP)
+        {
+            /* fpng only encodes into its own vector, so this saves the stdio copy but not the heap buffer */
+            mapped_file m;
+            if (map_output_file(filename, outdata.size() + extra_len, &m)) {
+                memcpy(m.data, outdata.data(), 33);
+                if (extra_len) memcpy(m.data + 33, extra, extra_len);
+                memcpy(m.data + 33 + extra_len, outdata.data() + 33, outdata.size() - 33);
+                write_failed = !unmap_output_file(&m, m.len);
+            }
+            else {
+                write_failed = true;
+            }
+        }
+#endif
+        else
+        {
+            /* Write to file, with the stamp chunk (if any) following IHDR */
+            out_piece pieces[3] = { { outdata.data(), 33 }, { extra, extra_len }, { outdata.data() + 33, outdata.size() - 33 } };
+            write_failed = !write_output_file(filename, io_mode, pieces, 3);
+        }
+        stats.file_size = outdata.size() + extra_len;
+    }
+#if SAVEPNG_POSIX
+    else if (io_mode==IO_MMAP) {
+        /* Compress straight into the mapped file, then cut it down to the final size */
+        mapped_file m;
+        if (map_output_file(filename, png_file_bound(width, height, color_type, bit_depth, nstripes, extra_len), &m)) {
+            size_t len = write_png_to_buffer((uint8_t *)imgdata, width, height, color_type, bit_depth, comp_level-2, dpm, nstripes, nl, extra, extra_len, m.data, NULL);
+            write_failed = !unmap_output_file(&m, len) || !len;
+            stats.file_size = len;
+        }
+        else {
+            write_failed = true;
         }
     }
+#endif
     else {
-        uint8_t *outdata = NULL;
-        outdata = (uint8_t * )write_image_to_png_file_in_memory((uint8_t *)imgdata, width, height, nchan, comp_level-2, dpm, filelen);
-
-        /* Write to file */
-        file = fopen(filename, "wb" );
-        if(!file) return;
-        fwrite(outdata, 1, filelen, file);
-        fclose(file);
+        /* Compress into a buffer that can be written as is, block aligned for O_DIRECT */
+        uint8_t *outdata = alloc_output_buffer(png_file_bound(width, height, color_type, bit_depth, nstripes, extra_len), io_mode);
+        size_t len = outdata ? write_png_to_buffer((uint8_t *)imgdata, width, height, color_type, bit_depth, comp_level-2, dpm, nstripes, nl, extra, extra_len, outdata, NULL) : 0;
+        
+        stats.file_size = len;
+        if (!len)
+            write_failed = true;
+#if SAVEPNG_DIRECT
+        else if (io_mode==IO_DIRECT)
+            write_failed = !write_file_direct(filename, outdata, len);
+#endif
+        else {
+            out_piece piece = { outdata, len };
+            write_failed = !write_output_file(filename, io_mode, &piece, 1);
+        }
         
         if (outdata) free(outdata);
     }
@@ -277,6 +2435,15 @@ void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     if (filename) free(filename);
     if (imgdata) free(imgdata);
     
+    if (!finish_thumbnails() && !write_failed) {
+        mexErrMsgIdAndTxt(errid, "%s", errmsg);
+    }
+    if (write_failed) {
+        mexErrMsgIdAndTxt("savepng:write","Could not write PNG file.");
+    }
+    
+    if (nlhs>0)
+        plhs[0] = create_image_stats(&stats, thumb_stats);
 }
 
 
@@ -1,9 +1,24 @@
-function savepng(CDATA,filename,varargin) %#ok<INUSD>
+function STATS = savepng(CDATA,filename,varargin) %#ok<STOUT,INUSD>
 % SAVEPNG
 %   Very fast PNG image compression routine.
 %
 %   Input syntax is:
-%   savepng(CDATA,filename[,Compression]);
+%   savepng(CDATA,filename[,Compression[,Resolution]][,Name,Value,...]);
+%   savepng({CDATA1,CDATA2,...},{filename1,filename2,...}[,...]);
+%   savepng(Z,map,filename[,Compression[,Resolution]][,Name,Value,...]);
+%   STATS = savepng(...);
+%
+%   CDATA is an MxN (grayscale), MxNx2 (grayscale+alpha), MxNx3 (RGB) or
+%   MxNx4 (RGBA) matrix of uint8, uint16, single or double. uint16 images
+%   are saved as 16-bit PNG files. single and double images hold values
+%   in [0,1] and are saved at 8 bits, scaled as by im2uint8. An MxN
+%   logical matrix (a mask) is saved as a 1-bit grayscale PNG file.
+%
+%   Z is an MxN matrix of uint8, uint16, single or double shown with the
+%   colormap map (Kx3 of values in [0,1], K at most 256), which is saved
+%   as an indexed colour image without an RGB copy. Z holds indices into
+%   map as for image and ind2rgb (1-based for single and double, 0-based
+%   for integers), or is scaled over CLim as imagesc does.
 %
 %   Optional parameters:
 %       Compression     A number between 0 and 14 controlling the amount of 
@@ -15,6 +30,106 @@ function savepng(CDATA,filename,varargin) %#ok<INUSD>
 %                       being saved. Resolution is expressed in Dots-Per-Inch 
 %                       (DPI). Default resolution is 96 DPI.
 %
+%   Optional name/value pairs (after the positional parameters):
+%       'SkipUnchanged' When true, a hash of the image data and encoding
+%                       parameters is embedded in the file. If the existing
+%                       file already carries the same hash it is left
+%                       untouched and nothing is encoded. Default is false.
+%       'Stripes'       Number of row stripes compressed independently, on
+%                       parallel threads. The file stays a standard PNG and
+%                       carries a stripe index so loadpng can also decode
+%                       the stripes in parallel. Costs a little compression.
+%                       Levels 0-2 are written at level 3 when striped.
+%                       Default is 1.
+%       'IO'            How the file is written: 'stdio' (default),
+%                       'mmap', which maps the output file and compresses
+%                       straight into it, saving a heap buffer and a copy
+%                       of the file, 'posix', which preallocates the file
+%                       and writes it with one writev() call, or 'direct',
+%                       which also bypasses the page cache (O_DIRECT).
+%                       Modes not available on a platform fall back to
+%                       'posix' or 'stdio'.
+%       'Palette'       When true, RGB and RGBA images of uint8 with at
+%                       most 256 colours (typical of plots) are saved as
+%                       indexed colour with 1, 2, 4 or 8-bit indices,
+%                       which is usually several times smaller and faster
+%                       to compress. Levels 1-2 use libdeflate level 1 for
+%                       such images; level 0 never uses a palette.
+%                       Default is true.
+%       'Reduce'        When true, images are written in the smallest
+%                       lossless layout: a fully opaque alpha channel is
+%                       dropped, RGB(A) with equal channels is written as
+%                       grayscale(+alpha) and uint16 data holding 8-bit
+%                       values (multiples of 257) is written at 8 bits.
+%                       loadpng then returns the reduced channels. Level 0
+%                       never reduces. Default is true.
+%       'Alpha'         MxN matrix of uint8 or logical (true is opaque)
+%                       used as the alpha channel of an MxN or MxNx3 image
+%                       of uint8, single or double, in place of
+%                       cat(3,CDATA,A), which copies the whole image. Not
+%                       for batch saves or colormaps.
+%       'CleanAlpha'    When true, fully transparent pixels (alpha 0) of
+%                       grayscale+alpha and RGBA images are written as
+%                       all zero, whatever their colour. The image looks
+%                       the same but compresses better; the colour of
+%                       those pixels is lost. Default is false.
+%       'Quantize'      Number of colours (2 to 256) to reduce RGB and RGBA
+%                       uint8 images with more colours to, saving them as
+%                       indexed colour. Lossy, usually several times
+%                       smaller. Images with few enough colours keep their
+%                       exact palette. 0 (default) turns it off; level 0
+%                       never quantizes.
+%       'Dither'        When true (default), quantized images are
+%                       Floyd-Steinberg dithered.
+%       'QuantizeSpeed' 1 (best palette) to 10 (fastest). Default is 4.
+%       'MaxError'      Near-lossless mode: uint8 samples written as
+%                       grayscale or truecolour may differ from the image
+%                       by up to this many levels (1 to 32), rounded so
+%                       that the PNG Up filter leaves few distinct values,
+%                       which compresses much better. Alpha is kept exact
+%                       and palette images are never rounded. 0 (default)
+%                       is lossless; level 0 never rounds.
+%       'CLim'          [lo hi] for Z with a colormap: values from lo to hi
+%                       are spread evenly over the colormap entries and
+%                       values outside are clamped, as imagesc(Z,[lo hi]).
+%       'ROI'           [row col height width] region of the image to save,
+%                       as CDATA(row:row+height-1,col:col+width-1,:) but
+%                       without the copy; only the region is read. Also
+%                       applies to Z and to the Alpha matrix.
+%       'Step'          Save every Step-th row and column of the image (or
+%                       of its ROI), starting with the first, as
+%                       CDATA(1:Step:end,1:Step:end,:). Default is 1.
+%                       ROI and Step do not apply to batch saves.
+%       'Thumbnails'    Cell array of file names, each given a copy of the
+%                       image half the size of the one before (2x, 4x,
+%                       ...), every pixel the mean of a 2x2 block. They
+%                       are saved with the same options, on other threads
+%                       while the image is encoded. Logical masks give
+%                       grayscale thumbnails. Not for batch saves or
+%                       colormaps.
+%       'Tiles'         Tile size: write a Deep Zoom (DZI) tile pyramid
+%                       instead of a single PNG. filename is the .dzi
+%                       descriptor; the tiles go to <name>_files/<level>/
+%                       <column>_<row>.png, each level half the size of
+%                       the one above, down to 1x1. Not for batch saves,
+%                       colormaps, Thumbnails or Streaming.
+%       'TileOverlap'   Pixels shared by neighbouring tiles. Default is 1.
+%       'Streaming'     When true, the image is transposed and compressed
+%                       a band of rows at a time and written out as a
+%                       series of fixed size IDAT chunks, so memory use
+%                       stays at a few MB beyond the image itself however
+%                       large it is. Levels 0-2 use libdeflate level 1;
+%                       Stripes and IO do not apply. Default is false.
+%
+%   STATS is an optional struct (a struct array shaped like the cell of
+%   images for batch saves, the image followed by its Thumbnails, or one
+%   element per tile from the top level down with Tiles) with fields
+%   FileSize, ColorType ('grayscale', 'truecolor', 'indexed',
+%   'grayscale-alpha' or 'truecolor-alpha'),
+%   BitDepth, Reduction (comma-separated 'alpha', 'gray', '8bit',
+%   'quantize' and 'maxerror', or empty) and Skipped, which is true when
+%   SkipUnchanged left the file untouched; the other fields are then empty.
+%
 %   Example 1:
 %       img     = getframe(gcf);
 %       savepng(img.cdata,'example.png');
@@ -23,6 +138,17 @@ function savepng(CDATA,filename,varargin) %#ok<INUSD>
 %       img     = getframe(gcf);
 %       savepng(img.cdata,'exampleHighRes.png',10,300);
 %
+%   Batch saves take cell arrays of images and file names. Images are
+%   encoded on all cores while finished files are written in the
+%   background (io_uring on Linux, writer threads elsewhere); the IO
+%   option does not apply to them.
+%
+%   Example 3:
+%       savepng(img.cdata,'figure1.png',4,96,'SkipUnchanged',true);
+%
+%   Example 4:
+%       savepng(frames,compose('frame%05d.png',1:numel(frames)),1);
+%
 %   PNG encoding routine based on fpng (levels 0-2) and libdeflate (3-14):
 %   https://github.com/richgel999/fpng
 %   https://github.com/ebiggers/libdeflate
@@ -40,11 +166,32 @@ function savepng(CDATA,filename,varargin) %#ok<INUSD>
 %   08/04/2014, Added option to command image resolution in DPI
 %   11/25/2016, Added support for alpha channel
 %   11/21/2025, Complete re-write to use fpng and libdeflate for faster compression
+%   10/18/2026, Added name/value options and SkipUnchanged content hash chunk
+%   10/18/2026, Added Stripes option for parallel compression and decoding
+%   10/18/2026, Added IO option with memory-mapped output
+%   10/18/2026, Added posix and direct IO modes, file write errors are reported
+%   10/18/2026, Added batch saves with asynchronous (io_uring) file writing
+%   10/18/2026, Added Streaming option for bounded-memory encoding of large images
+%   10/18/2026, Full 32-bit image dimensions, IDAT split for streams over 1 GB
+%   10/18/2026, Added grayscale (MxN) and grayscale+alpha (MxNx2) images
+%   10/18/2026, Added 16-bit images from uint16 input
+%   10/18/2026, Automatic palette encoding of images with up to 256 colours
+%   10/18/2026, Added Reduce option for lossless channel and bit depth reduction, STATS output
+%   10/18/2026, Added CleanAlpha option to zero the colour of fully transparent pixels
+%   10/18/2026, Added Quantize, Dither and QuantizeSpeed options for lossy palette images
+%   10/18/2026, Added MaxError option for near-lossless compression
+%   10/18/2026, Accept single and double images in [0,1] without conversion
+%   10/18/2026, Scalar fields saved with a colormap as indexed colour, CLim option
+%   10/19/2026, Logical masks saved as 1-bit grayscale
+%   10/19/2026, Added Alpha option for an alpha matrix passed separately
+%   10/19/2026, Added ROI and Step options for cropped and subsampled saving
+%   10/19/2026, Added Thumbnails option for downscaled copies saved in the same call
+%   10/19/2026, Added Tiles and TileOverlap options for Deep Zoom tile pyramids
 
 % Compile string
 try
     mex -c libdeflate_amalgamated.c -largeArrayDims
-    mex savepng.cpp fpng.cpp libdeflate_amalgamated.obj -largeArrayDims -DFPNG_NO_SSE=0 CXXFLAGS="$CXXFLAGS -msse4.1 -mpclmul"
+    mex savepng.cpp fpng.cpp asyncwrite.cpp imgtranspose.cpp palette.cpp quantize.cpp nearlossless.cpp pyramid.cpp libdeflate_amalgamated.obj -largeArrayDims -DFPNG_NO_SSE=0 CXXFLAGS="$CXXFLAGS -msse4.1 -mpclmul"
     delete libdeflate_amalgamated.obj
 catch
     error('Sorry, auto-compilation failed.');
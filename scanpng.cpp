@@ -0,0 +1,257 @@
+// % SCANPNG
+// %   Very fast PNG header scanner for cataloguing large image collections.
+// %
+// %   Input syntax is:
+// %   INFO = scanpng(filename);
+// %   INFO = scanpng({filename1,filename2,...});
+// %
+// %   Output:
+// %       INFO            Struct array the size of the input with fields
+// %           Filename    File name as given
+// %           FileSize    File size in bytes
+// %           Width       Image width in pixels
+// %           Height      Image height in pixels
+// %           Channels    Number of channels loadpng returns (1 to 4)
+// %           BitDepth    Bits per sample
+// %           ColorType   'grayscale', 'truecolor', 'indexed',
+// %                       'grayscale-alpha' or 'truecolor-alpha'
+// %           Interlaced  True for Adam7 interlaced files
+// %           Decoder     'fpng' for files written by fpng (savepng levels
+// %                       0-2), 'striped' for files saved with the Stripes
+// %                       option, otherwise 'generic'
+// %           DPI         [X Y] resolution from the pHYs chunk, or empty
+// %           Error       Empty, or why the file could not be scanned
+// %
+// %   Only the chunks preceding the image data are read (usually the first
+// %   few hundred bytes of a file), and files are scanned in parallel, so
+// %   cataloguing is bound by file system latency rather than decoding.
+// %   A file that cannot be read or parsed does not stop the scan; its
+// %   Error field says what went wrong.
+// %
+// %   Example:
+// %       files   = dir('archive/**/*.png');
+// %       info    = scanpng(fullfile({files.folder},{files.name}));
+// %       large   = info([info.Width] > 4000);
+// %
+//
+// % Author: S.Slonevskiy, 02/18/2013
+// % File bug reports at:
+// %       https://github.com/stefslon/savepng/issues
+//
+// % Versions:
+// %   10/18/2026, Initial version
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+
+#ifdef _WIN32
+    #include <io.h>
+    #include <fcntl.h>
+    #include <sys/stat.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+#endif
+
+#include "mex.h"
+#include "matrix.h"
+
+#include "pngread.h"
+
+/* Leading bytes read from each file; grown when the chunks before IDAT are larger */
+#define HEADER_PROBE_LEN 4096
+
+/* Scanning is I/O bound, so run more threads than there are cores to keep requests in flight */
+#define THREADS_PER_CORE 4
+#define MAX_THREADS      64
+
+/* Scan state shared by the workers */
+typedef struct {
+    std::vector<std::string> filenames;
+    std::vector<png_header> hdr;
+    std::vector<uint64_t> filesize;
+    std::vector<int> status;            /* per file: parse status, -1 when it could not be read */
+    std::atomic<size_t> next;           /* next file to scan */
+} scan_state;
+
+/* Read up to len bytes at offset ofs, returns the number of bytes read */
+static size_t read_at(int fd, uint8_t *buf, size_t len, uint64_t ofs)
+{
+    size_t got = 0;
+#ifdef _WIN32
+    /* No pread on Windows; each worker owns its descriptor, so seek + read is safe */
+    if (_lseeki64(fd, (__int64)ofs, SEEK_SET) < 0) return 0;
+    while (got < len) {
+        int n = _read(fd, buf + got, (unsigned int)(len - got));
+        if (n <= 0) break;
+        got += n;
+    }
+#else
+    while (got < len) {
+        ssize_t n = pread(fd, buf + got, len - got, (off_t)(ofs + got));
+        if (n <= 0) break;
+        got += n;
+    }
+#endif
+    return got;
+}
+
+/* Parse the header of one file reading as little of it as possible */
+static int scan_file(const char *filename, png_header &hdr, uint64_t &filesize)
+{
+    std::vector<uint8_t> head(HEADER_PROBE_LEN);
+    size_t got, more;
+    int status, fd;
+
+#ifdef _WIN32
+    struct _stat64 st;
+    fd = _open(filename, _O_RDONLY | _O_BINARY);
+    if (fd < 0) return -1;
+    if (_fstat64(fd, &st) != 0) {
+        _close(fd);
+        return -1;
+    }
+#else
+    struct stat st;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+#endif
+    filesize = (uint64_t)st.st_size;
+
+    got = read_at(fd, head.data(), head.size(), 0);
+    for (;;) {
+        status = png_parse_header(head.data(), got, hdr, &more);
+        if ((status != PNG_DECODE_FAILED_CHUNK_PARSING) || !more || (got < head.size()))
+            break;
+
+        /* Prefix ended inside the chunks preceding IDAT */
+        head.resize((more > 2*head.size()) ? more : 2*head.size());
+        got += read_at(fd, head.data() + got, head.size() - got, got);
+    }
+
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+    return status;
+}
+
+/* Worker: scan the next file until all are done */
+static void scan_worker(scan_state *s)
+{
+    size_t i;
+    while ((i = s->next++) < s->filenames.size())
+        s->status[i] = scan_file(s->filenames[i].c_str(), s->hdr[i], s->filesize[i]);
+}
+
+static const char* color_type_string(uint8_t color_type)
+{
+    switch (color_type) {
+    case 0: return "grayscale";
+    case 2: return "truecolor";
+    case 3: return "indexed";
+    case 4: return "grayscale-alpha";
+    case 6: return "truecolor-alpha";
+    }
+    return "";
+}
+
+/* The gateway function */
+void mexFunction( int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    static const char *fields[] = { "Filename", "FileSize", "Width", "Height", "Channels", "BitDepth",
+                                    "ColorType", "Interlaced", "Decoder", "DPI", "Error" };
+    scan_state s;
+    std::vector<std::thread> workers;
+    uint32_t nthreads;
+    size_t n, i;
+
+    /* Check for proper number of arguments */
+    if((nrhs!=1) || !(mxIsChar(prhs[0]) || mxIsCell(prhs[0]))) {
+        mexErrMsgIdAndTxt("scanpng:nrhs","File name input required.");
+    }
+
+    /* Fetch file names */
+    n = mxIsCell(prhs[0]) ? mxGetNumberOfElements(prhs[0]) : 1;
+    s.filenames.resize(n);
+    s.hdr.resize(n);
+    s.filesize.resize(n);
+    s.status.resize(n);
+    for (i = 0; i < n; i++) {
+        const mxArray *f = mxIsCell(prhs[0]) ? mxGetCell(prhs[0], i) : prhs[0];
+        char *filename;
+        if (!f || !mxIsChar(f)) {
+            mexErrMsgIdAndTxt("scanpng:nrhs","File names must be given as a cell array of strings.");
+        }
+        filename = mxArrayToString(f);
+        s.filenames[i] = filename;
+        mxFree(filename);
+    }
+
+    /* Scan in parallel */
+    nthreads = std::thread::hardware_concurrency() * THREADS_PER_CORE;
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+    if (nthreads > n) nthreads = (uint32_t)n;
+    s.next = 0;
+    for (i = 0; i < nthreads; i++)
+        workers.push_back(std::thread(scan_worker, &s));
+    for (i = 0; i < nthreads; i++)
+        workers[i].join();
+
+    /* Build struct array */
+    if (mxIsCell(prhs[0]))
+        plhs[0] = mxCreateStructArray(mxGetNumberOfDimensions(prhs[0]), mxGetDimensions(prhs[0]), sizeof(fields)/sizeof(fields[0]), fields);
+    else
+        plhs[0] = mxCreateStructMatrix(1, 1, sizeof(fields)/sizeof(fields[0]), fields);
+
+    for (i = 0; i < n; i++) {
+        const png_header &h = s.hdr[i];
+        int status = s.status[i];
+
+        mxSetField(plhs[0], i, "Filename", mxCreateString(s.filenames[i].c_str()));
+        if (status == -1) {
+            mxSetField(plhs[0], i, "Error", mxCreateString("Could not read file."));
+            continue;
+        }
+        mxSetField(plhs[0], i, "FileSize", mxCreateDoubleScalar((double)s.filesize[i]));
+
+        /* Unsupported files (interlaced, 16-bit palette) still have a valid header */
+        if ((status != PNG_DECODE_SUCCESS) && (status != PNG_DECODE_FAILED_UNSUPPORTED)) {
+            mxSetField(plhs[0], i, "Error", mxCreateString(png_decode_status_string(status)));
+            continue;
+        }
+
+        mxSetField(plhs[0], i, "Width", mxCreateDoubleScalar(h.width));
+        mxSetField(plhs[0], i, "Height", mxCreateDoubleScalar(h.height));
+        mxSetField(plhs[0], i, "Channels", mxCreateDoubleScalar(h.channels));
+        mxSetField(plhs[0], i, "BitDepth", mxCreateDoubleScalar(h.bit_depth));
+        mxSetField(plhs[0], i, "ColorType", mxCreateString(color_type_string(h.color_type)));
+        mxSetField(plhs[0], i, "Interlaced", mxCreateLogicalScalar(h.interlace != 0));
+        mxSetField(plhs[0], i, "Decoder", mxCreateString(h.fpng ? "fpng" : h.striped ? "striped" : "generic"));
+        if (h.has_phys && (h.phys_unit == 1)) {
+            /* Pixels per meter to DPI */
+            mxArray *dpi = mxCreateDoubleMatrix(1, 2, mxREAL);
+            mxGetPr(dpi)[0] = h.phys_x * 0.0254;
+            mxGetPr(dpi)[1] = h.phys_y * 0.0254;
+            mxSetField(plhs[0], i, "DPI", dpi);
+        }
+        else {
+            mxSetField(plhs[0], i, "DPI", mxCreateDoubleMatrix(0, 0, mxREAL));
+        }
+        mxSetField(plhs[0], i, "Error", mxCreateString((status == PNG_DECODE_SUCCESS) ? "" : png_decode_status_string(status)));
+    }
+}
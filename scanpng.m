@@ -0,0 +1,50 @@
+function INFO = scanpng(filename) %#ok<STOUT,INUSD>
+% SCANPNG
+%   Very fast PNG header scanner for cataloguing large image collections.
+%
+%   Input syntax is:
+%   INFO = scanpng(filename);
+%   INFO = scanpng({filename1,filename2,...});
+%
+%   Output:
+%       INFO            Struct array the size of the input with fields
+%           Filename    File name as given
+%           FileSize    File size in bytes
+%           Width       Image width in pixels
+%           Height      Image height in pixels
+%           Channels    Number of channels loadpng returns (1 to 4)
+%           BitDepth    Bits per sample
+%           ColorType   'grayscale', 'truecolor', 'indexed',
+%                       'grayscale-alpha' or 'truecolor-alpha'
+%           Interlaced  True for Adam7 interlaced files
+%           Decoder     'fpng' for files written by fpng (savepng levels
+%                       0-2), 'striped' for files saved with the Stripes
+%                       option, otherwise 'generic'
+%           DPI         [X Y] resolution from the pHYs chunk, or empty
+%           Error       Empty, or why the file could not be scanned
+%
+%   Only the chunks preceding the image data are read (usually the first
+%   few hundred bytes of a file), and files are scanned in parallel, so
+%   cataloguing is bound by file system latency rather than decoding.
+%   A file that cannot be read or parsed does not stop the scan; its
+%   Error field says what went wrong.
+%
+%   Example:
+%       files   = dir('archive/**/*.png');
+%       info    = scanpng(fullfile({files.folder},{files.name}));
+%       large   = info([info.Width] > 4000);
+%
+
+% Author: S.Slonevskiy, 02/18/2013
+% File bug reports at:
+%       https://github.com/stefslon/savepng/issues
+
+% Versions:
+%   10/18/2026, Initial version
+
+% Compile string
+try
+    mex scanpng.cpp pngread.cpp fpng.cpp -largeArrayDims -DFPNG_NO_SSE=0 CXXFLAGS="$CXXFLAGS -msse4.1 -mpclmul"
+catch
+    error('Sorry, auto-compilation failed.');
+end
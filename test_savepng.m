@@ -0,0 +1,80 @@
+%
+%   Round-trip checks of savepng and loadpng. Run it from the folder
+%   holding the compiled MEX files; a failed check stops with an error.
+%
+
+% Make sure MEX is loaded into memory 
+try
+    savepng
+catch
+end
+
+rgb     = uint8(randi([0 255],97,131,3));
+smooth  = uint8(repmat(0:130,97,1,3));
+
+% General reader: files from imwrite and from savepng's libdeflate levels,
+% whose streams may end with empty blocks after the last row
+imwrite(rgb,'roundtrip.png');
+assert(isequal(loadpng('roundtrip.png'),rgb),'imwrite RGB');
+imwrite(smooth,'roundtrip.png');
+assert(isequal(loadpng('roundtrip.png'),smooth),'imwrite smooth RGB');
+for c = [0 1 2 3 4 7 10]
+    savepng(smooth,'roundtrip.png',c);
+    assert(isequal(loadpng('roundtrip.png'),smooth),'savepng level %d',c);
+end
+
+% Striped files: every stripe but the last ends in a sync flush
+for n = [2 5]
+    savepng(smooth,'roundtrip.png',6,'Stripes',n);
+    assert(isequal(loadpng('roundtrip.png'),smooth),'%d stripes',n);
+end
+
+% Every way of writing the file
+io = {'stdio','mmap','posix','direct'};
+for k = 1:numel(io)
+    for c = [1 6]
+        savepng(rgb,'roundtrip.png',c,'IO',io{k});
+        assert(isequal(loadpng('roundtrip.png'),rgb),'IO %s, level %d',io{k},c);
+    end
+end
+
+% Batch saves through the asynchronous writer
+frames  = cell(1,24);
+files   = cell(1,24);
+for k = 1:numel(frames)
+    frames{k}   = circshift(rgb,k,2);
+    files{k}    = sprintf('roundtrip_%02d.png',k);
+end
+for c = [1 6]
+    savepng(frames,files,c);
+    assert(isequal(loadpng(files),cat(4,frames{:})),'batch, level %d',c);
+end
+delete(files{:});
+
+% Grayscale and gray+alpha: rows of equal pixels give runs of 258 bytes
+for sz = [72 273; 39 213; 155 231].'
+    g   = uint8(repmat(mod((1:sz(1)).',7)*30,1,sz(2)));
+    ga  = cat(3,g,255-g);
+    for c = [1 2 6]
+        savepng(g,'roundtrip.png',c);
+        assert(isequal(loadpng('roundtrip.png'),g),'gray %dx%d, level %d',sz(2),sz(1),c);
+        savepng(ga,'roundtrip.png',c);
+        assert(isequal(loadpng('roundtrip.png'),ga),'gray+alpha %dx%d, level %d',sz(2),sz(1),c);
+    end
+end
+
+% 16-bit images read back as uint16
+rgb16   = uint16(randi([0 65535],97,131,3));
+gray16  = rgb16(:,:,1);
+for c = [1 6]
+    savepng(rgb16,'roundtrip.png',c);
+    assert(isequal(loadpng('roundtrip.png'),rgb16),'uint16 RGB, level %d',c);
+    savepng(gray16,'roundtrip.png',c);
+    assert(isequal(loadpng('roundtrip.png'),gray16),'uint16 gray, level %d',c);
+end
+savepng({rgb16,rgb16(end:-1:1,:,:)},{'roundtrip_01.png','roundtrip_02.png'},4);
+assert(isequal(loadpng({'roundtrip_01.png','roundtrip_02.png'}),cat(4,rgb16,rgb16(end:-1:1,:,:))),'uint16 batch');
+delete('roundtrip_01.png','roundtrip_02.png');
+
+delete('roundtrip.png');
+fprintf('All round-trip checks passed\n');